@@ -58,6 +58,14 @@ typedef struct TImageInfo TImageInfo;
  * (zero if there is no more input avaible or -1 if there is an error). */
 typedef intxx (*TIMGInputFn)(uint8* buffer, uintxx size, void* user);
 
+/*
+ * Output function prototype (streaming output).
+ * Receives n complete rows starting at the row y of the image, stride is the
+ * size in bytes of each row. The rows are only valid during the call. Return
+ * value must be zero to stop the decoding (non zero to continue). */
+typedef bool (*TIMGOutputFn)(
+	const uint8* rows, uintxx y, uintxx n, uintxx stride, void* user);
+
 
 /*
  * */
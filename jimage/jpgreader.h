@@ -29,6 +29,17 @@
 /* Progressive pass count limit */
 #define JPGR_MAXPASSES 100
 
+/* Flag to disable the intrinsics kernels (SSE2 to AVX-512), these are
+ * selected at runtime from the CPU features, together with the ASM ones */
+/* #define JPGR_CFG_NOINTRINSICS */
+
+/* Width in bits (10 to 12) of the multi-symbol AC decoding table of baseline
+ * images, 0 disables the table (the default is 11) */
+/* #define JPGR_CFG_MSROOTBITS 11 */
+
+/* Flag to disable the process-wide cache of built huffman tables */
+/* #define JPGR_CFG_NOTABLECACHE */
+
 
 /* Error codes */
 typedef enum {
@@ -53,16 +64,29 @@ typedef enum {
 	JPGR_ESEGMENTORDER  = 17,
 	JPGR_ENOSEGMENT     = 18,   /* missing segment */
 	JPGR_EPASSLIMIT     = 19,
+	JPGR_EABORTED       = 20,   /* stopped by the output function */
+	JPGR_EBADINDEX      = 21    /* the index doesn't match the image */
 } eJPGRError;
 
 
 /* Flags */
 typedef enum {
 	JPGR_IGNOREICCP = 0x01,
-	JPGR_KEEPYCBCR  = 0x02
+	JPGR_KEEPYCBCR  = 0x02,
+	JPGR_GRAYSCALE  = 0x04   /* decode only the luma of YCbCr images */
 } eJPGRFlags;
 
 
+/* Output pixel layouts */
+typedef enum {
+	JPGR_DEFAULTLAYOUT = 0,  /* RGB, grayscale or YCbCr */
+	JPGR_RGBA = 1,
+	JPGR_BGRA = 2,
+	JPGR_RGBX = 3,
+	JPGR_XRGB = 4
+} eJPGRLayout;
+
+
 /* State */
 typedef enum {
 	JPGR_ABORTED  = -3,
@@ -132,6 +156,47 @@ void jpgr_reset(TJPGReader*);
  * Sets the input function used to read the image data. */
 void jpgr_setinputfn(TJPGReader*, TIMGInputFn fn, void* user);
 
+/*
+ * Sets a memory buffer containing the complete JPEG file as the input, the
+ * data is read in place (without copying it to the internal buffer) so it
+ * must remain valid until the decoding ends. */
+void jpgr_setsource(TJPGReader*, const uint8* data, uintxx size);
+
+/*
+ * Sets the scale used to decode the image (1, 2, 4 or 8), the image is
+ * decoded at 1/scale of its size (rounded up) using a reduced inverse DCT.
+ * Must be called before jpgr_initdecoder, the size returned in the image
+ * info is the scaled size (sizex and sizey in the reader keep the size of
+ * the complete image). */
+void jpgr_setscale(TJPGReader*, uintxx scale);
+
+/*
+ * Sets the number of threads used to decode the image (1 by default, up to
+ * 64). Only baseline images with restart intervals are decoded in parallel,
+ * and only when the input is a memory buffer (see jpgr_setsource). */
+void jpgr_setthreads(TJPGReader*, uintxx nthreads);
+
+/*
+ * Sets the layout of the decoded pixels. With a 4 byte layout the color
+ * conversion writes the pixels directly in that order, the fourth byte (A or
+ * X) is set to alpha and grayscale images are expanded to RGB (the color type
+ * in the image info is IMAGE_RGBALPHA). The layout is ignored when the image
+ * is decoded as YCbCr (JPGR_KEEPYCBCR). Must be called before
+ * jpgr_initdecoder. */
+void jpgr_setlayout(TJPGReader*, eJPGRLayout layout, uint8 alpha);
+
+/*
+ * Sets a crop window (in pixels of the scaled image), only the given
+ * rectangle of the image is decoded (the size in the image info is the size
+ * of the window). The MCUs outside the window are huffman decoded but not
+ * transformed, and for baseline images the decoding stops after the last MCU
+ * row of the window (the segments after the scan are not read). With restart
+ * intervals and a memory source the intervals outside the window are
+ * skipped without decoding them. Must be called before jpgr_initdecoder, the
+ * window must be inside the image (jpgr_initdecoder fails) and planar output
+ * is not supported. */
+void jpgr_setcrop(TJPGReader*, uintxx y, uintxx x, uintxx sizey, uintxx sizex);
+
 /*
  * Init the decoder and determines the required internal memory nedeed
  * to decode the image. */
@@ -141,6 +206,60 @@ bool jpgr_initdecoder(TJPGReader*, TImageInfo* info);
  * Sets the target memory buffer for the decoded image (the complete image). */
 void jpgr_setbuffers(TJPGReader*, uint8* pixels);
 
+/*
+ * Sets planar target buffers for the decoded image (used instead of
+ * jpgr_setbuffers). Each component is stored in its own plane at its native
+ * sampling, without upsampling nor color conversion (Y, Cb and Cr for a
+ * YCbCr image, so a 4:2:0 image gives I420), strides are the size in bytes
+ * of the rows of each plane. Only the planes of the components in the image
+ * are used (see jpgr_getplanesize) and the layout is ignored. */
+void jpgr_setplanes(TJPGReader*, uint8* planes[3], uintxx strides[3]);
+
+/*
+ * Gets the size of the plane of the given component (0 to 2) for planar
+ * output, must be called after jpgr_initdecoder. At a reduced scale the
+ * chroma planes can have a higher resolution relative to the luma plane (a
+ * unit is never smaller than 1 / 8 of its size). Returns 0 if the image
+ * doesn't have the component. */
+bool jpgr_getplanesize(TJPGReader*, uintxx n, uintxx* sizey, uintxx* sizex);
+
+/*
+ * Sets an output function used instead of the image buffer (streaming
+ * output, used instead of jpgr_setbuffers). The image is decoded to an
+ * internal buffer of one MCU row (up to 32 rows) and the rows are passed to
+ * the function as soon as they are complete, so for interleaved baseline
+ * images the memory used doesn't depend on the height of the image.
+ * Progressive and non-interleaved images still keep the complete scan and
+ * the rows are passed each time the image is updated. The image is decoded
+ * in a single thread. */
+void jpgr_setoutputfn(TJPGReader*, TIMGOutputFn fn, void* user);
+
+/*
+ * Gets the size in bytes of a random access index with a checkpoint every
+ * step MCU rows, must be called after jpgr_initdecoder. Returns 0 if the
+ * image can't be indexed, only interleaved baseline images read from a
+ * memory buffer (see jpgr_setsource) are supported. */
+uintxx jpgr_getindexsize(TJPGReader*, uintxx step);
+
+/*
+ * Sets the memory (jpgr_getindexsize bytes) where the index is stored, the
+ * index is filled by the next jpgr_decodeimg call. Must be called after
+ * jpgr_setbuffers (with a NULL buffer the scan is only huffman decoded).
+ * Each checkpoint keeps the input offset, the bit position, the restart
+ * interval state and the DC predictors, the index doesn't depend on the
+ * scale, layout or crop of the decoding so it can be stored and reused. */
+void jpgr_buildindex(TJPGReader*, uintxx step, uint8* index);
+
+/*
+ * Sets an index made with jpgr_buildindex for the same file, must be called
+ * after jpgr_initdecoder. With a crop window (see jpgr_setcrop) the decoding
+ * starts at the last checkpoint before the window, so the cost depends on
+ * the position and size of the window and not on the size of the image
+ * (even without restart intervals). The index is not copied and must remain
+ * valid until the decoding ends. Sets the error JPGR_EBADINDEX if the index
+ * doesn't match the image. */
+void jpgr_setindex(TJPGReader*, const uint8* index, uintxx size);
+
 /*
  * Decodes the image to the image buffer (if set). */
 uintxx jpgr_decodeimg(TJPGReader*);
@@ -31,6 +31,10 @@
 /* Flag to toggle crc32 checksum check */
 /* #define PNGR_CFG_DOCRC */
 
+/* Flag to disable the intrinsics kernels (SSE2 to AVX-512), these are
+ * selected at runtime from the CPU features, together with the ASM ones */
+/* #define PNGR_CFG_NOINTRINSICS */
+
 
 /* Error codes */
 typedef enum {
@@ -50,6 +54,7 @@ typedef enum {
 	PNGR_EMISSINGCHUNK    = 12,
 	PNGR_EDUPLICATEDCHUNK = 13,
 	PNGR_ECHUNKORDER      = 14,
+	PNGR_EABORTED         = 15    /* stopped by the output function */
 } ePNGRError;
 
 
@@ -156,6 +161,35 @@ void pngr_reset(TPNGReader*);
  * Sets the input function. */
 void pngr_setinputfn(TPNGReader*, TIMGInputFn fn, void* user);
 
+/*
+ * Sets a memory buffer containing the complete PNG file as the input, the
+ * data is read in place (without copying it to the internal buffers) so it
+ * must remain valid until the decoding ends. */
+void pngr_setsource(TPNGReader*, const uint8* data, uintxx size);
+
+/*
+ * Sets a crop window, only the given rectangle of the image is decoded (the
+ * size in the image info is the size of the window). The rows above the
+ * window are unfiltered but not converted and the decoding stops after the
+ * last row of the window (the chunks after the image data are not read).
+ * Must be called before pngr_initdecoder, the window must be inside the
+ * image and interlaced images are not supported (pngr_initdecoder fails). */
+void pngr_setcrop(TPNGReader*, uintxx y, uintxx x, uintxx sizey, uintxx sizex);
+
+/*
+ * Sets the number of threads used to decode the image (1 by default). With 2
+ * or more threads the rows of large non-interlaced images are inflated by a
+ * second thread while the calling thread unfilters and converts them (the
+ * rows decoded with pngr_decoderows are decoded in a single thread). The
+ * input function is called from the second thread. Images with an iDOT chunk
+ * (row bands whose deflate streams start on their own IDAT chunk after a
+ * full flush) read from a memory buffer are decoded by bands, one band per
+ * thread, when the output is the image buffer. The bands run in parallel
+ * when the first row of each band doesn't use the row above (filters none
+ * and sub), other bands are finished in order. Must be called before
+ * pngr_initdecoder. */
+void pngr_setthreads(TPNGReader*, uintxx nthreads);
+
 /*
  * Init the decoder and determines the required internal memory nedeed
  * to decode the image. */
@@ -167,6 +201,26 @@ uintxx pngr_initdecoder(TPNGReader*, TImageInfo* info);
  * NULL. */
 void pngr_setbuffers(TPNGReader*, uint8* pixels, uint8* idxs);
 
+/*
+ * Sets an output function used instead of the image buffers (streaming
+ * output, used instead of pngr_setbuffers). Each row is passed to the
+ * function as soon as it is decoded (one row per call) using a single row
+ * buffer, so the memory used doesn't depend on the height of the image. Only
+ * for non-interlaced images. */
+void pngr_setoutputfn(TPNGReader*, TIMGOutputFn fn, void* user);
+
+/*
+ * Decodes the rows [first, first + count) of the crop window (the whole image
+ * by default) of a non-interlaced image and passes them to the output
+ * function (see pngr_setoutputfn), used instead of pngr_decodeimg. The reader
+ * keeps its position between the calls, so a strip after the last one
+ * decoded only needs the rows in between. The deflate stream can't be
+ * restarted at an arbitrary row, so a strip before the current position is
+ * decoded again from the start of the image data (only for a memory source,
+ * the call fails otherwise). The chunks after the image data are not read.
+ * Returns 0 in case of error. */
+uintxx pngr_decoderows(TPNGReader*, uintxx first, uintxx count);
+
 /*
  * Decodes the next pass of a progressive image, returns the next pass or zero
  * is there are not more passes or in case of error. */
@@ -66,10 +66,6 @@ global jpgr_inverseDCTASM
 ; Parameters:
 ; (int16 pointer) sblock , rblock, qtable
 
-global jpgr_upsamplerowASM
-; Parameters:
-; (pointer) int16 row, int16 target, int mode(0-6)
-
 global jpgr_setrow1ASM
 ; Parameters:
 ; (pointer) int16 row source, (pointer) int8 target
@@ -78,30 +74,33 @@ global jpgr_setrow3ASM
 ; Parameters:
 ; (pointer) int16 row1, row2, row2, (pointer) int8 target, int transform
 
+global jpgr_setrow4ASM
+; Parameters:
+; (pointer) int16 row1, row2, row2, (pointer) int8 target, int mode
+; mode: transform (bit 0) | layout (bits 1-3) | fourth byte (bits 8-15)
+
+global jpgr_upsamplerowASM
+; Parameters:
+; (pointer) int16 row, int16 target, int n, int ratio (2 or 4)
+
+global jpgr_initASM
+; Selects the SSSE3 variants when the CPU has them (called at the reader
+; creation, the functions also call it on first use)
+
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ; Initialize the variables according to the CPU capabilities
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 
-SSSE3_FLAG equ 0000200h
+SSSE3_FLAG equ 00000200h  ; ssse3 (cpuid 1, ecx)
 
 
-init:
-	; preserve registers
-	push		rcx
-	push		rdx
+jpgr_initASM:
 	push		rbx
-	push		rax
-
-	xor			rax, rax
-	cmp			eax, dword[hasSSSE3.initdone]
-	jne .done
 
 	mov			eax, 1
 	cpuid
-	and			ecx, SSSE3_FLAG
-
-	test		ecx, ecx
-	jz .done
+	test		ecx, SSSE3_FLAG
+	jz  .done
 
 	; ssse3
 	lea			rax, [hasSSSE3]
@@ -111,8 +110,19 @@ init:
 	lea			rax, [hasSSSE3.initdone]
 	mov			dword[rax], 1h
 
-	pop			rax
 	pop			rbx
+	ret
+
+
+; used when a function is called before the initialization, rax holds the
+; function to resume
+init:
+	; preserve registers
+	push		rcx
+	push		rdx
+	push		rax
+	call		jpgr_initASM
+	pop			rax
 	pop			rdx
 	pop			rcx
 	jmp rax
@@ -823,60 +833,6 @@ jpgr_inverseDCTASM:
 	ret
 
 
-jpgr_upsamplerowASM:
-	lea			rax, [.upsample]
-	shl			ar3, 4
-	lea 		rax, [rax+ar3]
-	movdqa		xmm0, [ar1]
-	jmp rax
-
-align 16
-.upsample:
-	; mode 0
-	movdqa		[ar2], xmm0
-	ret
-	align 16, db 0xcc
-
-	; mode 1
-	punpcklwd	xmm0, xmm0
-	movdqa		[ar2], xmm0
-	ret
-	align 16, db 0xcc
-
-	; mode 2
-	punpckhwd	xmm0, xmm0
-	movdqa		[ar2], xmm0
-	ret
-	align 16, db 0xcc
-
-	; mode 3
-	punpcklwd	xmm0, xmm0
-	punpcklwd	xmm0, xmm0
-	movdqa		[ar2], xmm0
-	ret
-	align 16, db 0xcc
-
-	; mode 4
-	punpcklwd	xmm0, xmm0
-	punpckhwd	xmm0, xmm0
-	movdqa		[ar2], xmm0
-	ret
-	align 16, db 0xcc
-
-	; mode 5
-	punpckhwd	xmm0, xmm0
-	punpcklwd	xmm0, xmm0
-	movdqa		[ar2], xmm0
-	ret
-	align 16, db 0xcc
-
-	; mode 6
-	punpckhwd	xmm0, xmm0
-	punpckhwd	xmm0, xmm0
-	movdqa		[ar2], xmm0
-	ret
-
-
 align 16
 c128:
 	dw 8 dup (128)
@@ -1054,6 +1010,141 @@ jpgr_setrow3ASM:
 	jmp init
 
 
+; layouts (shifted by one bit as in the mode)
+LAYOUT_BGRA equ 4h
+LAYOUT_XRGB equ 8h
+
+jpgr_setrow4ASM:
+	movdqa		xmm1, [ar1]
+	movdqa		xmm2, [ar2]
+	movdqa		xmm3, [ar3]
+
+%ifdef WINDOWS64
+	mov			r8, qword[rsp+8*5]
+%endif
+	test		r8, 1h
+	jz .notransform
+
+%ifdef WINDOWS64
+	; preserve xmm6, xmm7, xmm8, and xmm9
+	sub			rsp, 48h
+	movaps		[rsp+ 0h], xmm6
+	movaps		[rsp+10h], xmm7
+	movaps		[rsp+20h], xmm8
+	movaps		[rsp+30h], xmm9
+%endif
+
+	; r = y + cr * 1.402
+	movdqa		xmm4, xmm1
+	movdqa		xmm5, xmm1
+	punpckhwd	xmm4, xmm3
+	punpcklwd	xmm5, xmm3
+	movdqa		xmm0, [c1]
+	pmaddwd		xmm4, xmm0
+	pmaddwd		xmm5, xmm0
+
+	; b = y + cb * 1.772
+	movdqa		xmm6, xmm1
+	movdqa		xmm7, xmm1
+	punpckhwd	xmm6, xmm2
+	punpcklwd	xmm7, xmm2
+	movdqa		xmm0, [c3]
+	pmaddwd		xmm6, xmm0
+	pmaddwd		xmm7, xmm0
+
+	; g = y + cb * -0.344 + cr * -0.714
+	movdqa		xmm8, xmm2
+	movdqa		xmm9, xmm2
+	punpckhwd	xmm8, xmm3
+	punpcklwd	xmm9, xmm3
+	movdqa		xmm0, [c2]
+	pmaddwd		xmm8, xmm0
+	pmaddwd		xmm9, xmm0
+
+	movdqa		xmm0, [c4]
+
+	; g
+	paddd		xmm8, xmm0
+	paddd		xmm9, xmm0
+	psrad		xmm8, 12
+	psrad		xmm9, 12
+	packssdw	xmm9, xmm8
+	paddw		xmm9, xmm1
+	movdqa		xmm2, xmm9
+
+	; r
+	paddd		xmm4, xmm0
+	paddd		xmm5, xmm0
+	psrad		xmm4, 12
+	psrad		xmm5, 12
+	packssdw	xmm5, xmm4
+	movdqa		xmm1, xmm5
+
+	; b
+	paddd		xmm6, xmm0
+	paddd		xmm7, xmm0
+	psrad		xmm6, 12
+	psrad		xmm7, 12
+	packssdw	xmm7, xmm6
+	movdqa		xmm3, xmm7
+
+%ifdef WINDOWS64
+	; restore registers
+	movaps		xmm6, [rsp+ 0h]
+	movaps		xmm7, [rsp+10h]
+	movaps		xmm8, [rsp+20h]
+	movaps		xmm9, [rsp+30h]
+	add			rsp, 48h
+%endif
+
+.setpels:
+	packuswb	xmm1, xmm1
+	packuswb	xmm2, xmm2
+	packuswb	xmm3, xmm3
+
+	; fourth byte
+	mov			rax, r8
+	shr			rax, 8
+	movd		xmm0, eax
+	punpcklbw	xmm0, xmm0
+	pshuflw		xmm0, xmm0, 0h
+
+	and			r8, 0eh
+	cmp			r8, LAYOUT_BGRA
+	jne .notbgra
+	movdqa		xmm4, xmm1
+	movdqa		xmm1, xmm3
+	movdqa		xmm3, xmm4
+
+.notbgra:
+	cmp			r8, LAYOUT_XRGB
+	jne .store
+	movdqa		xmm4, xmm3
+	movdqa		xmm3, xmm2
+	movdqa		xmm2, xmm1
+	movdqa		xmm1, xmm0
+	movdqa		xmm0, xmm4
+
+.store:
+	; xmm1, xmm2, xmm3 and xmm0 are the bytes 0 to 3 of each pixel
+	punpcklbw	xmm1, xmm2
+	punpcklbw	xmm3, xmm0
+	movdqa		xmm2, xmm1
+	punpcklwd	xmm1, xmm3
+	punpckhwd	xmm2, xmm3
+	movdqu		[ar4], xmm1
+	movdqu		[ar4+10h], xmm2
+	ret
+
+.notransform:
+	movdqa		xmm0, [c128]
+	paddw		xmm1, xmm0
+	paddw		xmm2, xmm0
+	paddw		xmm3, xmm0
+
+	jmp .setpels
+
+
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ; SSSE3 version
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
@@ -1226,6 +1317,76 @@ ssse3_setrow3:
 	jmp .setpels
 
 
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; Upsample a full row, each source value is repeated ratio times
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+jpgr_upsamplerowASM:
+	cmp			ar4, 2
+	jne .ratio4
+
+.loop2:
+	cmp			ar3, 16
+	jb  .tail2
+	movdqu		xmm0, [ar1]
+	movdqa		xmm1, xmm0
+	punpcklwd	xmm0, xmm0
+	punpckhwd	xmm1, xmm1
+	movdqu		[ar2], xmm0
+	movdqu		[ar2+10h], xmm1
+	add			ar1, 10h
+	add			ar2, 20h
+	sub			ar3, 16
+	jmp .loop2
+
+.tail2:
+	test		ar3, ar3
+	jz  .done
+	movzx		eax, word[ar1]
+	mov			word[ar2], ax
+	dec			ar3
+	jz  .done
+	mov			word[ar2+2], ax
+	add			ar1, 2
+	add			ar2, 4
+	dec			ar3
+	jmp .tail2
+
+.ratio4:
+	cmp			ar3, 16
+	jb  .tail4
+	movq		xmm0, [ar1]
+	punpcklwd	xmm0, xmm0
+	movdqa		xmm1, xmm0
+	punpckldq	xmm0, xmm0
+	punpckhdq	xmm1, xmm1
+	movdqu		[ar2], xmm0
+	movdqu		[ar2+10h], xmm1
+	add			ar1, 8h
+	add			ar2, 20h
+	sub			ar3, 16
+	jmp .ratio4
+
+.tail4:
+	test		ar3, ar3
+	jz  .done
+	movzx		eax, word[ar1]
+	mov			r10d, 4
+
+.repeat4:
+	mov			word[ar2], ax
+	add			ar2, 2
+	dec			ar3
+	jz  .done
+	dec			r10d
+	jnz .repeat4
+	add			ar1, 2
+	jmp .tail4
+
+.done:
+	ret
+
+
 section .data
 align 16
 
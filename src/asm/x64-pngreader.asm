@@ -44,33 +44,29 @@ align 16
 ; 2) filter is non zero, "only valid values" are 1, 2, 3, 4
 ; 3) pixel size is 1, 2, 3, 4, 6 or 8
 ; if any assertion is not meet the program may crash
+;
+; The Sub, Average and Paeth filters are specialised for each pixel size, the
+; kernel is selected from the pixel size using a table for each filter
 
 global pngr_unfilterASM
 ; Parameters:
 ; (pointer) current row, (pointer) prev row, row size, filter << 16 | pel size
 
+global pngr_initASM
+; Selects the SSE4.1 Paeth kernels when the CPU has them (called at the
+; reader creation, the unfilter function also calls it on first use)
+
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
-;  Initialize the jump table according to the CPU capabilities
+;  Initialize the jump tables according to the CPU capabilities
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 
-SSE4_FLAG equ 0180000h  ; sse4.1 | sse4.2
-
+SSE4_FLAG equ 00080000h  ; sse4.1 (cpuid 1, ecx)
 
-initjump:
-	xor			rax, rax
-	cmp			rax, qword[initdone]
-	jne .done
 
-	; preserve registers
-	push		rcx
-	push		rdx
+pngr_initASM:
 	push		rbx
 
-	mov			eax, 1
-	cpuid
-	and			ecx, SSE4_FLAG
-
 	; sse2
 	lea			rax, [sse2_filter1]
 	mov			qword[jumptable+1*8], rax
@@ -81,22 +77,39 @@ initjump:
 	lea			rax, [sse2_filter4]
 	mov			qword[jumptable+4*8], rax
 
-	test		ecx, ecx
-	jz  .restore
+	mov			eax, 1
+	cpuid
+	test		ecx, SSE4_FLAG
+	jz  .done
 
 	; sse4
-	lea			rax, [sse4_filter4]
-	mov			qword[jumptable+4*8], rax
+	lea			rax, [sse4_paeth1]
+	mov			qword[paethtable+1*8], rax
+	lea			rax, [sse4_paeth2]
+	mov			qword[paethtable+2*8], rax
+	lea			rax, [sse4_paeth3]
+	mov			qword[paethtable+3*8], rax
+	lea			rax, [sse4_paeth4]
+	mov			qword[paethtable+4*8], rax
+	lea			rax, [sse4_paeth6]
+	mov			qword[paethtable+6*8], rax
+	lea			rax, [sse4_paeth8]
+	mov			qword[paethtable+8*8], rax
 
-.restore:
+.done:
 	pop			rbx
+	ret
+
+
+; used when the unfilter function is called before the initialization
+initjump:
+	; preserve registers
+	push		rcx
+	push		rdx
+	call		pngr_initASM
 	pop			rdx
 	pop			rcx
 
-.done:
-	lea			rax, [initdone]
-	mov			qword[rax], 1h
-
 	jmp pngr_unfilterASM.dojump
 
 
@@ -341,345 +354,312 @@ filter4:
 ; SSE2 version
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 
-sse2_filter1:
-	pop			rcx
-	and			rcx, 0xffff
-
-	; use the scalar version is pelsize is <= 2
-	cmp			rcx, 2
-	jbe filter1.dofilter
+; Sub, Average and Paeth work one pixel at time (each pixel depends on the
+; previous one), only the pixel bytes are written back so there are no
+; partial overlaps between the stores and the next loads
 
-	; curr + rowsize
-	add			rdx, rdi
-
-	pxor		xmm0, xmm0  ; zero
-	pxor		xmm1, xmm1  ; [curr - pelsize]
-
-	; calculate the jump to set the pixel
-	mov 		rax, 8
-	sub			rax, rcx
-	lea			r10, [.setpel]
-	lea			r10, [r10+rax*8]
-
-.loop1:
-	cmp			rdi, rdx
-	jnb .done
-
-	movdqu		xmm2, [rdi]
-	punpcklbw	xmm2, xmm0
-
-	paddw		xmm2, xmm1
-	movdqa		xmm1, xmm2
-
-	movdqu		[rsp-16], xmm2
-	jmp r10
-
-.setpel:
-	%assign counter 7
-	%rep 8
-		mov			ax, word[rsp-16+counter*2]
-		mov			byte[rdi+counter], al
-		%assign counter counter-1
-	%endrep
-	nop
-
-	add			rdi, rcx
-	jmp .loop1
+; loads a pixel of %2 bytes from [%3] into %1
+%macro LOADPEL 3
+%if %2 > 4
+	movq		%1, qword[%3]
+%else
+	movd		%1, dword[%3]
+%endif
+%endmacro
+
+; stores the first %1 bytes of %2 to [rdi]
+%macro STOREPEL 2
+%if %1 == 8
+	movq		qword[rdi], %2
+%elif %1 == 4
+	movd		dword[rdi], %2
+%elif %1 == 6
+	movq		rax, %2
+	mov			dword[rdi], eax
+	shr			rax, 32
+	mov			word[rdi+4], ax
+%elif %1 == 3
+	movd		eax, %2
+	mov			word[rdi], ax
+	shr			eax, 16
+	mov			byte[rdi+2], al
+%elif %1 == 2
+	movd		eax, %2
+	mov			word[rdi], ax
+%else
+	movd		eax, %2
+	mov			byte[rdi], al
+%endif
+%endmacro
 
-.done:
+%macro RETURN 0
 %ifdef WINDOWS64
 	pop			rdi
 	pop			rsi
 %endif
 	ret
+%endmacro
 
 
-sse2_filter2:
-	pop			rcx
-
+; Sub filter for a pixel size of %1
+%macro SUBFILTER 1
 	; curr + rowsize
 	add			rdx, rdi
 
-.loop1:
+	pxor		xmm1, xmm1  ; a
+
+%%loop:
 	cmp			rdi, rdx
-	jnb .done
+	jnb %%done
 
-	movdqu		xmm0, [rdi]
-	movdqu		xmm1, [rsi]
+	LOADPEL		xmm0, %1, rdi
 	paddb		xmm0, xmm1
-	movdqu		[rdi], xmm0
+	movdqa		xmm1, xmm0
+	STOREPEL	%1, xmm0
 
-	add			rdi, 10h
-	add			rsi, 10h
-	jmp .loop1
+	add			rdi, %1
+	jmp %%loop
 
-.done:
-%ifdef WINDOWS64
-	pop			rdi
-	pop			rsi
-%endif
-	ret
+%%done:
+	RETURN
+%endmacro
 
 
-align 16
-andmask:
-	db 16 dup(1)
-
-sse2_filter3:
-	pop			rcx
-	and			rcx, 0xffff
-
-	; use the scalar version is pelsize is <= 2
-	cmp			rcx, 2
-	jbe filter3.dofilter
-
+; Average filter for a pixel size of %1
+%macro AVGFILTER 1
 	; curr + rowsize
 	add			rdx, rdi
 
-	; calculate the jump to set the pixel
-	mov 		rax, 8
-	sub			rax, rcx
-	lea			r10, [.setpel]
-	lea			r10, [r10+rax*8]
-
-	pxor		xmm0, xmm0  ; zero
-	pxor		xmm1, xmm1
-	movdqa		xmm6, [andmask]
+	pxor		xmm1, xmm1  ; a
+	movdqa		xmm5, [andmask]
 
-.loop1:
+%%loop:
 	cmp			rdi, rdx
-	jnb .done
+	jnb %%done
 
-	; xmm1 := [curr]; xmm2 := a; xmm3 := b;
-	movdqa		xmm2, xmm1
-	movdqu		xmm1, [rdi]
-	movdqu		xmm3, [rsi]
-
-	movdqa		xmm4, xmm2
-	movdqa		xmm5, xmm2
-	pavgb		xmm4, xmm3
-	pxor		xmm5, xmm3
-	pand		xmm5, xmm6
-	psubb		xmm4, xmm5
-	paddb		xmm1, xmm4
-	movdqa		xmm2, xmm1
-	punpcklbw	xmm2, xmm0
-
-	movdqu		[rsp-16], xmm2
-	jmp r10
-
-.setpel:
-	%assign counter 7
-	%rep 8
-		mov			ax, word[rsp-16+counter*2]
-		mov			byte[rdi+counter], al
-		%assign counter counter-1
-	%endrep
-	nop
+	LOADPEL		xmm0, %1, rdi
+	LOADPEL		xmm3, %1, rsi
 
-	add			rdi, rcx
-	add			rsi, rcx
-	jmp .loop1
+	; (a + b) >> 1 := avg(a, b) - ((a ^ b) & 1)
+	movdqa		xmm2, xmm1
+	pavgb		xmm2, xmm3
+	pxor		xmm1, xmm3
+	pand		xmm1, xmm5
+	psubb		xmm2, xmm1
 
-.done:
-%ifdef WINDOWS64
-	pop			rdi
-	pop			rsi
-%endif
-	ret
+	paddb		xmm0, xmm2
+	movdqa		xmm1, xmm0
+	STOREPEL	%1, xmm0
 
+	add			rdi, %1
+	add			rsi, %1
+	jmp %%loop
 
-sse2_filter4:
-	pop			rcx
-	and			rcx, 0xffff
+%%done:
+	RETURN
+%endmacro
 
-	; use the scalar version is pelsize is == 1
-	cmp			rcx, 1
-	je filter4.dofilter
 
+; Paeth filter for a pixel size of %1, %2 selects the SSE4 version, the
+; values are kept as words so the result is the next a without unpacking
+%macro PAETHFILTER 2
 	; curr + rowsize
 	add			rdx, rdi
 
-	; calculate the jump to set the pixel
-	mov 		rax, 8
-	sub			rax, rcx
-	lea			r10, [.setpel]
-	lea			r10, [r10+rax*8]
-
-	pxor		xmm1, xmm1 ; a
-	pxor		xmm2, xmm2 ; b
-	pxor		xmm3, xmm3 ; c
-	pxor		xmm4, xmm4 ; x
-	pxor		xmm5, xmm5 ; zero
+	pxor		xmm1, xmm1  ; a
+	pxor		xmm2, xmm2  ; c
+	pxor		xmm4, xmm4  ; zero
 
-.loop1:
+%%loop:
 	cmp			rdi, rdx
-	jnb .done
+	jnb %%done
+
+	LOADPEL		xmm5, %1, rdi  ; x
+	LOADPEL		xmm3, %1, rsi  ; b
+	punpcklbw	xmm5, xmm4
+	punpcklbw	xmm3, xmm4
 
-	movdqa		xmm3, xmm2   ; c = b
-	movdqu		xmm2, [rsi]  ; b = prev
-	movdqa		xmm1, xmm4   ; a = x
-	movdqu		xmm4, [rdi]  ; x = curr
-	punpcklbw	xmm2, xmm5
-	punpcklbw	xmm4, xmm5
-
-	; pa = b - c
-	movdqa		xmm6, xmm2
-	psubw		xmm6, xmm3
-	; pb = a - c
+	movdqa		xmm6, xmm3
+	psubw		xmm6, xmm2  ; pa = b - c
 	movdqa		xmm7, xmm1
-	psubw		xmm7, xmm3
-	; pc = pb + pb
-	movdqa		xmm8, xmm7
-	paddw		xmm8, xmm6
+	psubw		xmm7, xmm2  ; pb = a - c
+	movdqa		xmm8, xmm6
+	paddw		xmm8, xmm7  ; pc = pa + pb
 
+%if %2
+	pabsw		xmm6, xmm6
+	pabsw		xmm7, xmm7
+	pabsw		xmm8, xmm8
+%else
 	; abs(pa)
-	movdqa		xmm9, xmm6
-	psraw		xmm9, 15
-	pxor		xmm6, xmm9
-	psubw		xmm6, xmm9
-
+	movdqa		xmm0, xmm4
+	psubw		xmm0, xmm6
+	pmaxsw		xmm6, xmm0
 	; abs(pb)
-	movdqa		xmm9, xmm7
-	psraw		xmm9, 15
-	pxor		xmm7, xmm9
-	psubw		xmm7, xmm9
-
+	movdqa		xmm0, xmm4
+	psubw		xmm0, xmm7
+	pmaxsw		xmm7, xmm0
 	; abs(pc)
-	movdqa		xmm9, xmm8
-	psraw		xmm9, 15
-	pxor		xmm8, xmm9
-	psubw		xmm8, xmm9
-
-	; xmm9 = min(pc, min(pa, pb))
-	movdqa		xmm9, xmm6
-	pminsw		xmm9, xmm7 ; min(pa, pb)
-	pminsw		xmm9, xmm8 ; min(min(pa, pb), pc) := sm
+	movdqa		xmm0, xmm4
+	psubw		xmm0, xmm8
+	pmaxsw		xmm8, xmm0
+%endif
 
-	pcmpeqw		xmm6, xmm9  ; min(pa, min(pc, min(pa, pb))); mask1
-	pcmpeqw		xmm7, xmm9  ; min(pb, min(pc, min(pa, pb))); mask2
+	movdqa		xmm0, xmm6
+	pminsw		xmm0, xmm7
+	pminsw		xmm0, xmm8  ; min(min(pa, pb), pc) := sm
 
-	movdqa		xmm9, xmm7  ; andnot(min(pb..), c) := 1
+	pcmpeqw		xmm6, xmm0  ; pa == sm; mask1
+	pcmpeqw		xmm7, xmm0  ; pb == sm; mask2
 
-	pandn		xmm9, xmm3  ; andnot(mask1, c)
-	pand		xmm7, xmm2  ; and(mask1, b)
-	por			xmm9, xmm7  ; or (1, 2) := v
+%if %2
+	movdqa		xmm8, xmm2
+	movdqa		xmm0, xmm7
+	pblendvb	xmm8, xmm3  ; blend(c, b) := v
 
 	movdqa		xmm0, xmm6
-	pandn		xmm0, xmm9 ; andnot(min(pa..), v)   := 3
-	pand		xmm6, xmm1 ; and(min(pa..), a)      := 4
-	por			xmm0, xmm6 ; or(3, 4)
-
-	movdqa		xmm9, xmm0
-	paddb		xmm4, xmm9
-
-	movdqu		[rsp-16], xmm4
-	jmp r10
-
-.setpel:
-	%assign counter 7
-	%rep 8
-		mov			ax, word[rsp-16+counter*2]
-		mov			byte[rdi+counter], al
-		%assign counter counter-1
-	%endrep
-	nop
+	pblendvb	xmm8, xmm1  ; blend(v, a)
+	paddb		xmm5, xmm8
+%else
+	movdqa		xmm8, xmm7
+	pand		xmm8, xmm3  ; and(mask2, b)
+	pandn		xmm7, xmm2  ; andnot(mask2, c)
+	por			xmm7, xmm8  ; or(1, 2) := v
+
+	movdqa		xmm8, xmm6
+	pand		xmm8, xmm1  ; and(mask1, a)
+	pandn		xmm6, xmm7  ; andnot(mask1, v)
+	por			xmm6, xmm8
+	paddb		xmm5, xmm6
+%endif
 
-	add			rdi, rcx
-	add			rsi, rcx
-	jmp .loop1
+	; the next a and c
+	movdqa		xmm1, xmm5
+	movdqa		xmm2, xmm3
 
-.done:
-%ifdef WINDOWS64
-	pop			rdi
-	pop			rsi
-%endif
-	ret
+	packuswb	xmm5, xmm5
+	STOREPEL	%1, xmm5
 
+	add			rdi, %1
+	add			rsi, %1
+	jmp %%loop
+
+%%done:
+	RETURN
+%endmacro
 
-;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
-; SSE4 version
-;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 
-sse4_filter4:
+sse2_filter1:
 	pop			rcx
 	and			rcx, 0xffff
 
-	; use the scalar version is pelsize is == 1
-	cmp			rcx, 1
-	je filter4.dofilter
+	lea			rax, [subtable]
+	jmp qword[rax+rcx*8]
 
-	; curr + rowsize
-	add			rdx, rdi
 
-	; calculate the jump to set the pixel
-	mov 		rax, 8
-	sub			rax, rcx
-	lea			r10, [.setpel]
-	lea			r10, [r10+rax*8]
+sse2_filter2:
+	pop			rcx
 
-	pxor		xmm1, xmm1 ; a
-	pxor		xmm2, xmm2 ; b
-	pxor		xmm3, xmm3 ; c
-	pxor		xmm4, xmm4 ; x
-	pxor		xmm5, xmm5 ; zero
+	; curr + rowsize
+	add			rdx, rdi
 
 .loop1:
 	cmp			rdi, rdx
 	jnb .done
 
-	movdqa		xmm3, xmm2   ; c = b
-	movdqu		xmm2, [rsi]  ; b = prev
-	movdqa		xmm1, xmm4   ; a = x
-	movdqu		xmm4, [rdi]  ; x = curr
-	punpcklbw	xmm2, xmm5
-	punpcklbw	xmm4, xmm5
+	movdqu		xmm0, [rdi]
+	movdqu		xmm1, [rsi]
+	paddb		xmm0, xmm1
+	movdqu		[rdi], xmm0
 
-	movdqa		xmm6, xmm2
-	psubw		xmm6, xmm3  ; pa = b - c
-	movdqa		xmm7, xmm1
-	psubw		xmm7, xmm3  ; pb = a - c
-	movdqa		xmm8, xmm7
-	paddw		xmm8, xmm6  ; pc = pb + pb
+	add			rdi, 10h
+	add			rsi, 10h
+	jmp .loop1
 
-	pabsw		xmm6, xmm6
-	pabsw		xmm7, xmm7
-	pabsw		xmm8, xmm8
+.done:
+%ifdef WINDOWS64
+	pop			rdi
+	pop			rsi
+%endif
+	ret
 
-	movdqa		xmm9, xmm6
-	pminsw		xmm9, xmm7  ; min(pa, pb)
-	pminsw		xmm9, xmm8  ; min(min(pa, pb), pc) := sm
 
-	pcmpeqw		xmm6, xmm9  ; min(pa, min(pc, min(pa, pb))); mask1
-	pcmpeqw		xmm7, xmm9  ; min(pb, min(pc, min(pa, pb))); mask2
+sse2_filter3:
+	pop			rcx
+	and			rcx, 0xffff
 
-	;
-	movdqa		xmm0, xmm7
-	movdqa		xmm9, xmm3
-	pblendvb	xmm9, xmm2  ; blend(c, b) := 5
+	lea			rax, [avgtable]
+	jmp qword[rax+rcx*8]
 
-	movdqa		xmm0, xmm6
-	pblendvb	xmm9, xmm1  ; blend(5, a)
 
-	paddb		xmm4, xmm9
+sse2_filter4:
+	pop			rcx
+	and			rcx, 0xffff
 
-	movdqu		[rsp-16], xmm4
-	jmp r10
+	lea			rax, [paethtable]
+	jmp qword[rax+rcx*8]
 
-.setpel:
-	%assign counter 7
-	%rep 8
-		mov			ax, word[rsp-16+counter*2]
-		mov			byte[rdi+counter], al
-		%assign counter counter-1
-	%endrep
-	nop
 
-	add			rdi, rcx
-	add			rsi, rcx
-	jmp .loop1
+align 16
+andmask:
+	db 16 dup(1)
 
-.done:
+
+sse2_sub2:
+	SUBFILTER 2
+sse2_sub3:
+	SUBFILTER 3
+sse2_sub4:
+	SUBFILTER 4
+sse2_sub6:
+	SUBFILTER 6
+sse2_sub8:
+	SUBFILTER 8
+
+sse2_avg2:
+	AVGFILTER 2
+sse2_avg3:
+	AVGFILTER 3
+sse2_avg4:
+	AVGFILTER 4
+sse2_avg6:
+	AVGFILTER 6
+sse2_avg8:
+	AVGFILTER 8
+
+sse2_paeth1:
+	PAETHFILTER 1, 0
+sse2_paeth2:
+	PAETHFILTER 2, 0
+sse2_paeth3:
+	PAETHFILTER 3, 0
+sse2_paeth4:
+	PAETHFILTER 4, 0
+sse2_paeth6:
+	PAETHFILTER 6, 0
+sse2_paeth8:
+	PAETHFILTER 8, 0
+
+
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; SSE4 version
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+sse4_paeth1:
+	PAETHFILTER 1, 1
+sse4_paeth2:
+	PAETHFILTER 2, 1
+sse4_paeth3:
+	PAETHFILTER 3, 1
+sse4_paeth4:
+	PAETHFILTER 4, 1
+sse4_paeth6:
+	PAETHFILTER 6, 1
+sse4_paeth8:
+	PAETHFILTER 8, 1
+
+
+badpel:
 %ifdef WINDOWS64
 	pop			rdi
 	pop			rsi
@@ -706,7 +686,39 @@ jumptable:
 	dq		initjump
 	dq		initjump
 
-initdone:
-	dq		0h
+; kernels for each pixel size, Sub and Average use the scalar version for a
+; pixel size of 1
+subtable:
+	dq		badpel
+	dq		filter1.dofilter
+	dq		sse2_sub2
+	dq		sse2_sub3
+	dq		sse2_sub4
+	dq		badpel
+	dq		sse2_sub6
+	dq		badpel
+	dq		sse2_sub8
+
+avgtable:
+	dq		badpel
+	dq		filter3.dofilter
+	dq		sse2_avg2
+	dq		sse2_avg3
+	dq		sse2_avg4
+	dq		badpel
+	dq		sse2_avg6
+	dq		badpel
+	dq		sse2_avg8
+
+paethtable:
+	dq		badpel
+	dq		sse2_paeth1
+	dq		sse2_paeth2
+	dq		sse2_paeth3
+	dq		sse2_paeth4
+	dq		badpel
+	dq		sse2_paeth6
+	dq		badpel
+	dq		sse2_paeth8
 
 
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "imgcpu.h"
+
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(_M_AMD64)
+	#define ISX64 1
+#else
+	#define ISX64 0
+#endif
+
+#if ISX64
+	#if defined(_MSC_VER) && !defined(__clang__)
+		#include <intrin.h>
+		#include <immintrin.h>
+	#else
+		#include <cpuid.h>
+	#endif
+#endif
+
+
+#if ISX64
+
+#define SSSE3_FLAG  0x00000200u  /* ssse3 (cpuid 1, ecx) */
+#define SSE41_FLAG  0x00080000u  /* sse4.1 (cpuid 1, ecx) */
+#define AVX_FLAG    0x18000000u  /* osxsave | avx (cpuid 1, ecx) */
+#define AVX2_FLAG   0x00000020u  /* avx2 (cpuid 7, ebx) */
+#define AVX512_FLAG 0x40010000u  /* avx512f | avx512bw (cpuid 7, ebx) */
+
+/* state saved by the OS (xcr0): sse and ymm, opmask and zmm */
+#define YMM_STATE 0x06u
+#define ZMM_STATE 0xe6u
+
+#if defined(_MSC_VER) && !defined(__clang__)
+
+CTB_INLINE void
+cpuid(uint32 leaf, uint32 r[4])
+{
+	int v[4];
+
+	__cpuidex(v, (int) leaf, 0);
+	r[0] = (uint32) v[0];
+	r[1] = (uint32) v[1];
+	r[2] = (uint32) v[2];
+	r[3] = (uint32) v[3];
+}
+
+CTB_INLINE uint32
+getxcr0(void)
+{
+	return (uint32) _xgetbv(0);
+}
+
+#else
+
+CTB_INLINE void
+cpuid(uint32 leaf, uint32 r[4])
+{
+	__cpuid_count(leaf, 0, r[0], r[1], r[2], r[3]);
+}
+
+CTB_INLINE uint32
+getxcr0(void)
+{
+	uint32 a;
+	uint32 d;
+
+	/* xgetbv, encoded to build without -mxsave */
+	__asm__ volatile (".byte 0x0f, 0x01, 0xd0" : "=a" (a), "=d" (d) : "c" (0));
+	return a;
+}
+
+#endif
+
+uintxx
+imgcpu_getfeatures(void)
+{
+	uint32 r[4];
+	uint32 ecx;
+	uint32 xcr0;
+	uintxx features;
+
+	features = 0;
+
+	cpuid(0, r);
+	if (r[0] < 1) {
+		return features;
+	}
+	cpuid(1, r);
+	ecx = r[2];
+	if (ecx & SSSE3_FLAG) {
+		features |= IMGCPU_SSSE3;
+	}
+	if (ecx & SSE41_FLAG) {
+		features |= IMGCPU_SSE41;
+	}
+
+	if ((ecx & AVX_FLAG) != AVX_FLAG) {
+		return features;
+	}
+	xcr0 = getxcr0();
+	if ((xcr0 & YMM_STATE) != YMM_STATE) {
+		return features;
+	}
+
+	cpuid(0, r);
+	if (r[0] < 7) {
+		return features;
+	}
+	cpuid(7, r);
+	if ((r[1] & AVX2_FLAG) == 0) {
+		return features;
+	}
+	features |= IMGCPU_AVX2;
+
+	if ((r[1] & AVX512_FLAG) == AVX512_FLAG) {
+		if ((xcr0 & ZMM_STATE) == ZMM_STATE) {
+			features |= IMGCPU_AVX512;
+		}
+	}
+	return features;
+}
+
+#else
+
+uintxx
+imgcpu_getfeatures(void)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef a51c3f0e_4b8d_4e27_9c61_2f07d4b8e913
+#define a51c3f0e_4b8d_4e27_9c61_2f07d4b8e913
+
+/*
+ * imgcpu.h
+ * CPU feature detection used to select the decoding kernels (internal).
+ */
+
+#include <ctoolbox/ctoolbox.h>
+
+
+/* CPU features (SSE2 is part of the x86-64 baseline) */
+#define IMGCPU_SSSE3  0x01
+#define IMGCPU_SSE41  0x02
+#define IMGCPU_AVX2   0x04
+#define IMGCPU_AVX512 0x08
+
+
+/*
+ * Returns the features of the CPU (0 on other architectures). The AVX2 and
+ * AVX-512 (F and BW) flags are only set when the OS saves the extended
+ * registers. */
+uintxx imgcpu_getfeatures(void);
+
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "imgthreads.h"
+
+
+#if !defined(IMGTHR_CFG_NOTHREADS)
+	#if defined(_WIN32)
+		#define WIN32_LEAN_AND_MEAN
+		#include <windows.h>
+	#else
+		#include <pthread.h>
+		#include <sched.h>
+	#endif
+#endif
+
+
+struct TIMGTask {
+	TIMGTaskFn fn;
+	void* arg;
+	uintxx index;
+};
+
+
+#if defined(IMGTHR_CFG_NOTHREADS)
+
+void
+imgthr_runtasks(TIMGTaskFn fn, void* arg, uintxx n)
+{
+	uintxx i;
+	CTB_ASSERT(fn && n <= IMGTHR_MAXTASKS);
+
+	for (i = 0; i < n; i++) {
+		fn(arg, i);
+	}
+}
+
+void
+imgthr_lock(void)
+{
+}
+
+void
+imgthr_unlock(void)
+{
+}
+
+bool
+imgthr_runpair(TIMGTaskFn fn, void* arg)
+{
+	CTB_ASSERT(fn);
+
+	(void) fn;
+	(void) arg;
+	return 0;
+}
+
+uintxx
+imgthr_load(volatile uintxx* p)
+{
+	return p[0];
+}
+
+void
+imgthr_store(volatile uintxx* p, uintxx v)
+{
+	p[0] = v;
+}
+
+void
+imgthr_yield(void)
+{
+}
+
+#else
+
+#if defined(_WIN32)
+
+typedef HANDLE TIMGThread;
+
+static SRWLOCK globallock = SRWLOCK_INIT;
+
+void
+imgthr_lock(void)
+{
+	AcquireSRWLockExclusive(&globallock);
+}
+
+void
+imgthr_unlock(void)
+{
+	ReleaseSRWLockExclusive(&globallock);
+}
+
+static DWORD WINAPI
+taskentry(LPVOID p)
+{
+	struct TIMGTask* task;
+
+	task = p;
+	task->fn(task->arg, task->index);
+	return 0;
+}
+
+CTB_INLINE bool
+threadcreate(TIMGThread* thread, struct TIMGTask* task)
+{
+	thread[0] = CreateThread(NULL, 0, taskentry, task, 0, NULL);
+	return thread[0] != NULL;
+}
+
+CTB_INLINE void
+threadjoin(TIMGThread* thread)
+{
+	WaitForSingleObject(thread[0], INFINITE);
+	CloseHandle(thread[0]);
+}
+
+void
+imgthr_yield(void)
+{
+	SwitchToThread();
+}
+
+#else
+
+typedef pthread_t TIMGThread;
+
+static pthread_mutex_t globallock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+imgthr_lock(void)
+{
+	pthread_mutex_lock(&globallock);
+}
+
+void
+imgthr_unlock(void)
+{
+	pthread_mutex_unlock(&globallock);
+}
+
+static void*
+taskentry(void* p)
+{
+	struct TIMGTask* task;
+
+	task = p;
+	task->fn(task->arg, task->index);
+	return NULL;
+}
+
+CTB_INLINE bool
+threadcreate(TIMGThread* thread, struct TIMGTask* task)
+{
+	return pthread_create(thread, NULL, taskentry, task) == 0;
+}
+
+CTB_INLINE void
+threadjoin(TIMGThread* thread)
+{
+	pthread_join(thread[0], NULL);
+}
+
+void
+imgthr_yield(void)
+{
+	sched_yield();
+}
+
+#endif
+
+void
+imgthr_runtasks(TIMGTaskFn fn, void* arg, uintxx n)
+{
+	uintxx i;
+	struct TIMGTask tasks[IMGTHR_MAXTASKS];
+	TIMGThread threads[IMGTHR_MAXTASKS];
+	bool created[IMGTHR_MAXTASKS];
+	CTB_ASSERT(fn && n <= IMGTHR_MAXTASKS);
+
+	for (i = 1; i < n; i++) {
+		tasks[i].fn    = fn;
+		tasks[i].arg   = arg;
+		tasks[i].index = i;
+
+		created[i] = threadcreate(threads + i, tasks + i);
+	}
+	fn(arg, 0);
+
+	for (i = 1; i < n; i++) {
+		if (created[i]) {
+			threadjoin(threads + i);
+			continue;
+		}
+		fn(arg, i);
+	}
+}
+
+bool
+imgthr_runpair(TIMGTaskFn fn, void* arg)
+{
+	struct TIMGTask task;
+	TIMGThread thread;
+	CTB_ASSERT(fn);
+
+	task.fn    = fn;
+	task.arg   = arg;
+	task.index = 1;
+	if (threadcreate(&thread, &task) == 0) {
+		return 0;
+	}
+	fn(arg, 0);
+
+	threadjoin(&thread);
+	return 1;
+}
+
+#if defined(_MSC_VER) && !defined(__clang__)
+
+uintxx
+imgthr_load(volatile uintxx* p)
+{
+	uintxx v;
+
+	v = p[0];
+	MemoryBarrier();
+	return v;
+}
+
+void
+imgthr_store(volatile uintxx* p, uintxx v)
+{
+	MemoryBarrier();
+	p[0] = v;
+}
+
+#else
+
+uintxx
+imgthr_load(volatile uintxx* p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void
+imgthr_store(volatile uintxx* p, uintxx v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+#endif
+
+#endif
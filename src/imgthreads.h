@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2023, jpn
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef d23772e9_e795_498f_b3b2_54ebb82b3631
+#define d23772e9_e795_498f_b3b2_54ebb82b3631
+
+/*
+ * imgthreads.h
+ * Minimal thread support used by the decoders (internal).
+ */
+
+#include <ctoolbox/ctoolbox.h>
+
+
+/* Flag to disable the threads (the tasks run in the calling thread) */
+/* #define IMGTHR_CFG_NOTHREADS */
+
+
+/* Maximum number of tasks run at the same time */
+#define IMGTHR_MAXTASKS 64
+
+
+/* Task function, index is the task number (0 to n - 1) */
+typedef void (*TIMGTaskFn)(void* arg, uintxx index);
+
+
+/*
+ * Runs n tasks (n <= IMGTHR_MAXTASKS) each one in its own thread, the first
+ * one runs in the calling thread. Returns when all the tasks are done. If a
+ * thread can't be created the task runs in the calling thread. */
+void imgthr_runtasks(TIMGTaskFn fn, void* arg, uintxx n);
+
+
+/*
+ * Process-wide lock, used to guard the data shared by all the decoders
+ * (caches). It must not be held while running tasks. */
+void imgthr_lock(void);
+void imgthr_unlock(void);
+
+
+/*
+ * Runs fn(arg, 0) in the calling thread and fn(arg, 1) in a new thread at
+ * the same time (the tasks can wait for each other). Returns 0 without
+ * running the tasks if the thread can't be created. */
+bool imgthr_runpair(TIMGTaskFn fn, void* arg);
+
+
+/*
+ * Load (acquire) and store (release) of a value shared by two threads, used
+ * for single producer and single consumer handoffs (a thread waiting for the
+ * other one calls imgthr_yield). */
+uintxx imgthr_load(volatile uintxx* p);
+void imgthr_store(volatile uintxx* p, uintxx v);
+
+void imgthr_yield(void);
+
+
+#endif
@@ -21,6 +21,46 @@
 #include <jimage/jpgreader.h>
 #include <ctoolbox/memory.h>
 #include <ctoolbox/ckdint.h>
+#include "imgthreads.h"
+#include "imgcpu.h"
+
+
+#if defined(JPGR_CFG_NOINTRINSICS)
+	#define DOSSE2 0
+	#define DOX64  0
+#else
+	#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+		#define DOSSE2 1
+	#else
+		#define DOSSE2 0
+	#endif
+
+	#if defined(__x86_64__) || defined(_M_X64) || defined(_M_AMD64)
+		#define DOX64 1
+	#else
+		#define DOX64 0
+	#endif
+#endif
+
+#if DOSSE2
+	#include <emmintrin.h>
+#endif
+
+/* the SSSE3, AVX2 and AVX-512 kernels are compiled for their instruction
+ * set and only called when the CPU has it */
+#if DOX64
+	#include <immintrin.h>
+
+	#if defined(__GNUC__) || defined(__clang__)
+		#define TARGETSSSE3  __attribute__((target("ssse3")))
+		#define TARGETAVX2   __attribute__((target("avx2")))
+		#define TARGETAVX512 __attribute__((target("avx512f,avx512bw")))
+	#else
+		#define TARGETSSSE3
+		#define TARGETAVX2
+		#define TARGETAVX512
+	#endif
+#endif
 
 
 /* segment markers */
@@ -81,6 +121,12 @@
 #define MAXICCPSIZE 0xfeef11
 
 
+/* mode of the setrow4 kernels: color transform flag, output layout (see
+ * eJPGRLayout) and the value of the fourth byte */
+#define SETROW4MODE(T, L, A) \
+	((uintxx) (T) | ((uintxx) (L) << 1) | ((uintxx) (A) << 8))
+
+
 /* direct decoding table size */
 #define ROOTBITS 9
 
@@ -93,6 +139,17 @@
 	#define ENOUGH_AC 822  /* 256 9 */
 #endif
 
+/* multi-symbol AC table size (baseline only), 0 disables the table */
+#if defined(JPGR_CFG_MSROOTBITS)
+	#define MSROOTBITS JPGR_CFG_MSROOTBITS
+#else
+	#define MSROOTBITS 11
+#endif
+
+#if MSROOTBITS != 0 && (MSROOTBITS < 10 || MSROOTBITS > 12)
+	#error "JPGR_CFG_MSROOTBITS must be 0 or a value from 10 to 12"
+#endif
+
 
 /* NOTE: we use diferents structs for huffman decoding because the size of
  * the tables is diferent, for DC tables we have 16 symbols and 256 for AC
@@ -120,9 +177,19 @@ struct TJPGACHmTable {
 	uintxx defined;
 	uint16 symbols[ENOUGH_AC];
 
+#if MSROOTBITS
+	/* multi-symbol table, each entry decodes up to two short symbols with
+	 * their extended values:
+	 * total length (4 bits) | length of the first symbol (4 bits) |
+	 * first run (4 bits) | second run (4 bits) |
+	 * first value (8 bits) | second value (8 bits)
+	 * A zero value means end of block. */
+	int32 msymbols[1 << MSROOTBITS];
+#else
 	/* combined table contaning extended values and the length in bits of the
 	 * symbol + symbol bits */
 	int16 sextent[1 << ROOTBITS];
+#endif
 };
 
 
@@ -136,12 +203,8 @@ struct TJPGQnTable {
 };
 
 
-/* bit prefecth buffer size */
-#if defined(CTB_ENV64)
-#	define BPREFETCHBZ 32
-#else
-#	define BPREFETCHBZ 16
-#endif
+/* size of the unstuffed input buffer used by the bit reader */
+#define UBUFFERSIZE 512
 
 /* bit buffer type */
 #if defined(CTB_ENV64)
@@ -178,12 +241,10 @@ struct TJPGRPrvt {
 	uintxx xsampling;
 	uint32 issubsampled;
 
-	/* scan size in number of MCU and the total number of units */
+	/* scan size in number of MCU */
 	uintxx nrows;
 	uintxx ncols;
 
-	uintxx nunits;
-
 	/* component in the scan (if it's a single scan) and number of components
 	 * in the scan */
 	uintxx nscancomponents;
@@ -192,13 +253,43 @@ struct TJPGRPrvt {
 	/* component order */
 	uintxx corder[3];
 
-	/* color transform flags */
+	/* color transform flags, with grayonly only the luma component is
+	 * transformed (the chroma units are decoded and discarded) */
 	uint32 isrgb;
 	uint32 keepyuv;
+	uint32 grayonly;
 
 	/* number of components in the image */
 	uint32 ncomponents;
 
+	/* output scale (as a shift, 1/1 to 1/8) and the size of the scaled
+	 * image */
+	uintxx scale;
+	uintxx scaledy;
+	uintxx scaledx;
+
+	/* maximum number of threads used to decode the image */
+	uintxx nthreads;
+
+	/* output layout and the size in bytes of each pixel, for the 4 byte
+	 * layouts lmode is the mode passed to setrow4 (see jpgr_setlayout) */
+	uintxx layout;
+	uintxx pelsize;
+	uintxx lmode;
+
+	/* crop window in output pixels (see jpgr_setcrop), the whole image by
+	 * default, and the MCU rows and columns covered by the window (units
+	 * for a 1 component image) */
+	uintxx cropy;
+	uintxx cropx;
+	uintxx cropsizey;
+	uintxx cropsizex;
+	uintxx mcuy1;
+	uintxx mcuy2;
+	uintxx mcux1;
+	uintxx mcux2;
+	uint32 iscropped;
+
 	/* to ensure segment order */
 	struct TJPGRSegmentMap {
 		uintxx APP0s: 1;
@@ -224,12 +315,30 @@ struct TJPGRPrvt {
 	/* restart interval */
 	uint32 rinterval;
 
-	/* to map MCU to the final image */
-	uint8 originy[16];
-	uint8 originx[16];
+	/* random access index (see jpgr_buildindex and jpgr_setindex), a
+	 * checkpoint every istep MCU rows, isbuilding is set when the index is
+	 * filled during the decoding */
+	uint8* index;
+	uintxx istep;
+	uintxx icount;
+	uint32 isbuilding;
 
-	/* decoded image data */
+	/* decoded image data and the size in bytes of each row */
 	uint8* pixels;
+	uintxx stride;
+
+	/* streaming output (see jpgr_setoutputfn), the pixels are a buffer of
+	 * one MCU row and firstrow is the image row of its first row */
+	TIMGOutputFn outputfn;
+	void* outputuser;
+	uint8* rowmemory;
+	uintxx rowmsize;
+	uintxx firstrow;
+
+	/* planar output (see jpgr_setplanes) */
+	uint8* planes[3];
+	uintxx strides[3];
+	uintxx planar;
 
 	/* input callback */
 	TIMGInputFn inputfn;
@@ -243,13 +352,20 @@ struct TJPGRPrvt {
 	intxx  bbcread;
 	uintxx bend;
 
-	/* bit prefecth buffer */
-	uint16 bb[BPREFETCHBZ];
-	uint32 bindex;
+	/* unstuffed input (the 0x00 after each 0xff removed), the extra space
+	 * allows to load (and store) 16 bytes at any position */
+	uint8  ubuffer[UBUFFERSIZE + 16];
+	uint32 uindex;
+	uint32 ucount;
 
 	/* flag used to indicate the end of the input */
 	uint32 endofinput;
 
+	/* set when the input is a caller provided memory buffer, srcbgn is the
+	 * start of the buffer (the index offsets are relative to it) */
+	uint32 ismemsource;
+	uint8* srcbgn;
+
 	/* input handling */
 	uint8* bgn;
 	uint8* end;
@@ -274,18 +390,10 @@ struct TJPGRPrvt {
 		uintxx irows;
 		uintxx icols;
 
-		/* upsample map */
-		const uint8* umap;
-
-		/* block index and upsample offset for each block in the component */
-		uint8 iblock[16];
-		uint8 offset[16];
-
-		/* row upsample mode
-		 * x1=0
-		 * x2=1 x2+4=2
-		 * x4=3 x4+2=4 x4+4=5 x4+6=6 */
-		uint8 rumode[16];
+		/* size of the decoded units, smaller than 8 when the image is
+		 * decoded at a reduced scale */
+		uintxx usizey;
+		uintxx usizex;
 
 		/* huffman tables */
 		struct TJPGDCHmTable* dctable;
@@ -296,6 +404,10 @@ struct TJPGRPrvt {
 
 		intxx cofficient;
 
+		/* positions of the cofficients of the last decoded block or-ed
+		 * together, used to select a sparse inverse DCT */
+		uintxx bmask;
+
 		/* complete component scan units in a non-interleaved or progressive
 		 * image */
 		int16* scan;
@@ -303,7 +415,15 @@ struct TJPGRPrvt {
 		/* scan units */
 		int16* units[8];
 
-		/* used for upsampling */
+		/* decoded units of a MCU row (swidth values per row) */
+		int16* strip;
+		uintxx swidth;
+
+		/* upsample ratio of the strip to the output image (1, 2 or 4) */
+		uintxx ry;
+		uintxx rx;
+
+		/* used for upsampling (a whole output row) */
 		int16* srow;
 
 		/* number of units in the scan or component */
@@ -317,6 +437,15 @@ struct TJPGRPrvt {
 
 	/* quantization tables */
 	struct TJPGQnTable qtables[4];
+
+	/* decoding kernels, selected at creation from the CPU features */
+	void (*inverseDCT)(int16*, int16*, int16*);
+	void (*inverseDCT2)(int16*, int16*, int16*);
+	void (*inverseDCT4)(int16*, int16*, int16*);
+	void (*upsamplerow)(int16*, int16*, uintxx, uintxx);
+	void (*setrow1)(int16*, uint8*);
+	void (*setrow3)(int16*, int16*, int16*, uint8*, uintxx, uintxx);
+	void (*setrow4)(int16*, int16*, int16*, uint8*, uintxx, uintxx);
 };
 
 
@@ -343,6 +472,8 @@ dispose_(struct TJPGRPrvt* p, void* memory, uintxx amount)
 	a->dispose(memory, amount, a->user);
 }
 
+static void setkernels(struct TJPGRPblc*);
+
 TJPGReader*
 jpgr_create(eJPGRFlags flags, TAllocator* allctr)
 {
@@ -369,7 +500,9 @@ jpgr_create(eJPGRFlags flags, TAllocator* allctr)
 
 	PRVT->mainmemory = NULL;
 	PRVT->iccpmemory = NULL;
+	PRVT->rowmemory  = NULL;
 	jpgr_reset(jpgr);
+	setkernels(jpgr);
 
 	PBLC->flags = flags;
 	return jpgr;
@@ -423,6 +556,12 @@ jpgr_reset(TJPGReader* jpgr)
 	}
 	PRVT->iccpmsize = 0;
 
+	if (PRVT->rowmemory) {
+		dispose_(PRVT, PRVT->rowmemory, PRVT->rowmsize);
+		PRVT->rowmemory = NULL;
+	}
+	PRVT->rowmsize = 0;
+
 	PRVT->iccpappend = NULL;
 	PRVT->iccpmode  = 0;
 	PRVT->iccps1 = 0;
@@ -432,9 +571,14 @@ jpgr_reset(TJPGReader* jpgr)
 	PRVT->xsampling = 0;
 	PRVT->nrows  = 0;
 	PRVT->ncols  = 0;
-	PRVT->nunits = 0;
 
 	PRVT->pixels = NULL;
+	PRVT->stride = 0;
+	PRVT->planar = 0;
+
+	PRVT->outputfn   = NULL;
+	PRVT->outputuser = NULL;
+	PRVT->firstrow   = 0;
 
 	PRVT->al = 0;
 	PRVT->ah = 0;
@@ -444,11 +588,32 @@ jpgr_reset(TJPGReader* jpgr)
 	PRVT->npass  = 0;
 	PRVT->rinterval   = 0;
 
+	PRVT->index  = NULL;
+	PRVT->istep  = 0;
+	PRVT->icount = 0;
+	PRVT->isbuilding = 0;
+
 	PRVT->inputfn = NULL;
 	PRVT->payload = NULL;
 
 	PRVT->isrgb   = 0;
 	PRVT->keepyuv = 0;
+	PRVT->grayonly = 0;
+
+	PRVT->scale   = 0;
+	PRVT->scaledy = 0;
+	PRVT->scaledx = 0;
+	PRVT->nthreads = 1;
+
+	PRVT->layout  = JPGR_DEFAULTLAYOUT;
+	PRVT->pelsize = 0;
+	PRVT->lmode   = 0;
+
+	PRVT->cropy = 0;
+	PRVT->cropx = 0;
+	PRVT->cropsizey = 0;
+	PRVT->cropsizex = 0;
+	PRVT->iscropped = 0;
 	for (i = 0; i < 3; i++) {
 		c = PRVT->components + i;
 
@@ -478,7 +643,9 @@ jpgr_reset(TJPGReader* jpgr)
 	PRVT->sourceend = PRVT->source + BUFFERSIZE;
 	PRVT->bgn = PRVT->source;
 	PRVT->end = PRVT->source;
-	PRVT->endofinput = 0;
+	PRVT->endofinput  = 0;
+	PRVT->ismemsource = 0;
+	PRVT->srcbgn = NULL;
 }
 
 void
@@ -491,6 +658,9 @@ jpgr_destroy(TJPGReader* jpgr)
 		if (PRVT->iccpmemory) {
 			dispose_(PRVT, PRVT->iccpmemory, PRVT->iccpmsize);
 		}
+		if (PRVT->rowmemory) {
+			dispose_(PRVT, PRVT->rowmemory, PRVT->rowmsize);
+		}
 		dispose_(PRVT, PBLC, sizeof(struct TJPGRPrvt));
 	}
 }
@@ -511,6 +681,114 @@ jpgr_setinputfn(TJPGReader* jpgr, TIMGInputFn fn, void* user)
 	}
 	PRVT->inputfn = fn;
 	PRVT->payload = user;
+
+	PRVT->sourceend = PRVT->source + BUFFERSIZE;
+	PRVT->bgn = PRVT->source;
+	PRVT->end = PRVT->source;
+	PRVT->endofinput  = 0;
+	PRVT->ismemsource = 0;
+	PRVT->srcbgn = NULL;
+}
+
+void
+jpgr_setsource(TJPGReader* jpgr, const uint8* data, uintxx size)
+{
+	CTB_ASSERT(jpgr && data);
+
+	if (jpgr->state != 0) {
+		SETERROR(JPGR_EINCORRECTUSE);
+		SETSTATE(JPGR_BADSTATE);
+		return;
+	}
+	PRVT->inputfn = NULL;
+	PRVT->payload = NULL;
+
+	/* the whole input is already in the buffer, there is nothing more
+	 * to read */
+	PRVT->bgn = (uint8*) data;
+	PRVT->end = (uint8*) data + size;
+	PRVT->srcbgn = PRVT->bgn;
+	PRVT->sourceend = PRVT->end;
+	PRVT->endofinput  = 1;
+	PRVT->ismemsource = 1;
+}
+
+void
+jpgr_setscale(TJPGReader* jpgr, uintxx scale)
+{
+	uintxx s;
+	CTB_ASSERT(jpgr);
+
+	if (jpgr->state != 0) {
+		SETERROR(JPGR_EINCORRECTUSE);
+		SETSTATE(JPGR_BADSTATE);
+		return;
+	}
+
+	switch (scale) {
+		case 1: s = 0; break;
+		case 2: s = 1; break;
+		case 4: s = 2; break;
+		case 8: s = 3; break;
+		default:
+			SETERROR(JPGR_EINCORRECTUSE);
+			SETSTATE(JPGR_BADSTATE);
+			return;
+	}
+
+	PRVT->scale = s;
+}
+
+void
+jpgr_setlayout(TJPGReader* jpgr, eJPGRLayout layout, uint8 alpha)
+{
+	CTB_ASSERT(jpgr);
+
+	if (jpgr->state != 0 || (uintxx) layout > JPGR_XRGB) {
+		SETERROR(JPGR_EINCORRECTUSE);
+		SETSTATE(JPGR_BADSTATE);
+		return;
+	}
+
+	PRVT->layout = layout;
+	PRVT->lmode  = SETROW4MODE(0, layout, alpha);
+}
+
+void
+jpgr_setcrop(TJPGReader* jpgr, uintxx y, uintxx x, uintxx sizey, uintxx sizex)
+{
+	CTB_ASSERT(jpgr);
+
+	if (jpgr->state != 0 || sizey == 0 || sizex == 0) {
+		SETERROR(JPGR_EINCORRECTUSE);
+		SETSTATE(JPGR_BADSTATE);
+		return;
+	}
+
+	PRVT->cropy = y;
+	PRVT->cropx = x;
+	PRVT->cropsizey = sizey;
+	PRVT->cropsizex = sizex;
+}
+
+void
+jpgr_setthreads(TJPGReader* jpgr, uintxx nthreads)
+{
+	CTB_ASSERT(jpgr);
+
+	if (jpgr->state != 0) {
+		SETERROR(JPGR_EINCORRECTUSE);
+		SETSTATE(JPGR_BADSTATE);
+		return;
+	}
+
+	if (nthreads == 0) {
+		nthreads = 1;
+	}
+	if (nthreads > IMGTHR_MAXTASKS) {
+		nthreads = IMGTHR_MAXTASKS;
+	}
+	PRVT->nthreads = nthreads;
 }
 
 
@@ -523,6 +801,11 @@ readmore(struct TJPGRPblc* jpgr, uintxx avaible, uintxx amount)
 	uintxx remaining;
 	intxx r;
 
+	/* nothing to refill (this is always the case for a memory source) */
+	if (PRVT->endofinput) {
+		return avaible;
+	}
+
 	remaining = (uintxx) (PRVT->sourceend - PRVT->end);
 	if (CTB_LIKELY(remaining + avaible < amount)) {
 		if (avaible) {
@@ -539,10 +822,6 @@ readmore(struct TJPGRPblc* jpgr, uintxx avaible, uintxx amount)
 		remaining = BUFFERSIZE - avaible;
 	}
 
-	if (PRVT->endofinput) {
-		return avaible;
-	}
-
 	r = PRVT->inputfn(PRVT->end, remaining, PRVT->payload);
 	if (CTB_LIKELY(r > 0)) {
 		avaible   += r;
@@ -586,6 +865,16 @@ skipbytes(struct TJPGRPblc* jpgr, uintxx amount)
 {
 	uintxx r;
 
+	/* skip the buffered bytes first (the complete input for a memory
+	 * source) */
+	r = (uintxx) (PRVT->end - PRVT->bgn);
+	if (CTB_LIKELY(r >= amount)) {
+		consumebytes(jpgr, amount);
+		return;
+	}
+	consumebytes(jpgr, r);
+	amount -= r;
+
 	while (amount) {
 		r = amount;
 		if (r > 256)
@@ -1089,7 +1378,10 @@ static const uint8 zzorder[] = {
 	23, 31, 38, 45, 52, 59, 60, 53,
 	46, 39, 47, 54, 61, 62, 55, 63,
 
-	/* extra values to prevent overflow during decoding */
+	/* extra values to prevent overflow during decoding (two runs of 16 with
+	 * the multi-symbol table) */
+	63, 63, 63, 63, 63, 63, 63, 63,
+	63, 63, 63, 63, 63, 63, 63, 63,
 	63, 63, 63, 63, 63, 63, 63, 63,
 	63, 63, 63, 63, 63, 63, 63, 63,
 };
@@ -1163,164 +1455,6 @@ parseDQT(struct TJPGRPblc* jpgr)
 }
 
 
-static const uint8 upscalemap[][64] = {
-	{  /* 1 1 */
-		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-		0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-		0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
-		0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27,
-		0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
-		0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-		0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f
-	},
-	{  /* 1 2 */
-		0x00, 0x00, 0x01, 0x01, 0x02, 0x02, 0x03, 0x03,
-		0x08, 0x08, 0x09, 0x09, 0x0a, 0x0a, 0x0b, 0x0b,
-		0x10, 0x10, 0x11, 0x11, 0x12, 0x12, 0x13, 0x13,
-		0x18, 0x18, 0x19, 0x19, 0x1a, 0x1a, 0x1b, 0x1b,
-		0x20, 0x20, 0x21, 0x21, 0x22, 0x22, 0x23, 0x23,
-		0x28, 0x28, 0x29, 0x29, 0x2a, 0x2a, 0x2b, 0x2b,
-		0x30, 0x30, 0x31, 0x31, 0x32, 0x32, 0x33, 0x33,
-		0x38, 0x38, 0x39, 0x39, 0x3a, 0x3a, 0x3b, 0x3b
-	},
-	{  /* 1 4 */
-		0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01,
-		0x08, 0x08, 0x08, 0x08, 0x09, 0x09, 0x09, 0x09,
-		0x10, 0x10, 0x10, 0x10, 0x11, 0x11, 0x11, 0x11,
-		0x18, 0x18, 0x18, 0x18, 0x19, 0x19, 0x19, 0x19,
-		0x20, 0x20, 0x20, 0x20, 0x21, 0x21, 0x21, 0x21,
-		0x28, 0x28, 0x28, 0x28, 0x29, 0x29, 0x29, 0x29,
-		0x30, 0x30, 0x30, 0x30, 0x31, 0x31, 0x31, 0x31,
-		0x38, 0x38, 0x38, 0x38, 0x39, 0x39, 0x39, 0x39
-	},
-	{  /* 2 1 */
-		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-		0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-		0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-		0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
-		0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
-	},
-	{  /* 2 2 */
-		0x00, 0x00, 0x01, 0x01, 0x02, 0x02, 0x03, 0x03,
-		0x00, 0x00, 0x01, 0x01, 0x02, 0x02, 0x03, 0x03,
-		0x08, 0x08, 0x09, 0x09, 0x0a, 0x0a, 0x0b, 0x0b,
-		0x08, 0x08, 0x09, 0x09, 0x0a, 0x0a, 0x0b, 0x0b,
-		0x10, 0x10, 0x11, 0x11, 0x12, 0x12, 0x13, 0x13,
-		0x10, 0x10, 0x11, 0x11, 0x12, 0x12, 0x13, 0x13,
-		0x18, 0x18, 0x19, 0x19, 0x1a, 0x1a, 0x1b, 0x1b,
-		0x18, 0x18, 0x19, 0x19, 0x1a, 0x1a, 0x1b, 0x1b
-	},
-	{  /* 2 4 */
-		0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01,
-		0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01,
-		0x08, 0x08, 0x08, 0x08, 0x09, 0x09, 0x09, 0x09,
-		0x08, 0x08, 0x08, 0x08, 0x09, 0x09, 0x09, 0x09,
-		0x10, 0x10, 0x10, 0x10, 0x11, 0x11, 0x11, 0x11,
-		0x10, 0x10, 0x10, 0x10, 0x11, 0x11, 0x11, 0x11,
-		0x18, 0x18, 0x18, 0x18, 0x19, 0x19, 0x19, 0x19,
-		0x18, 0x18, 0x18, 0x18, 0x19, 0x19, 0x19, 0x19
-	},
-	{  /* 4 1 */
-		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
-	},
-	{  /* 4 2 */
-		0x00, 0x00, 0x01, 0x01, 0x02, 0x02, 0x03, 0x03,
-		0x00, 0x00, 0x01, 0x01, 0x02, 0x02, 0x03, 0x03,
-		0x00, 0x00, 0x01, 0x01, 0x02, 0x02, 0x03, 0x03,
-		0x00, 0x00, 0x01, 0x01, 0x02, 0x02, 0x03, 0x03,
-		0x08, 0x08, 0x09, 0x09, 0x0a, 0x0a, 0x0b, 0x0b,
-		0x08, 0x08, 0x09, 0x09, 0x0a, 0x0a, 0x0b, 0x0b,
-		0x08, 0x08, 0x09, 0x09, 0x0a, 0x0a, 0x0b, 0x0b,
-		0x08, 0x08, 0x09, 0x09, 0x0a, 0x0a, 0x0b, 0x0b
-	},
-	{ /* 4 4 */
-		0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01,
-		0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01,
-		0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01,
-		0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01,
-		0x08, 0x08, 0x08, 0x08, 0x09, 0x09, 0x09, 0x09,
-		0x08, 0x08, 0x08, 0x08, 0x09, 0x09, 0x09, 0x09,
-		0x08, 0x08, 0x08, 0x08, 0x09, 0x09, 0x09, 0x09,
-		0x08, 0x08, 0x08, 0x08, 0x09, 0x09, 0x09, 0x09,
-	}
-};
-
-
-CTB_INLINE void
-setupscale(struct TJPGRPblc* jpgr, uintxx index, uintxx bsizey, uintxx bsizex)
-{
-	uintxx n;
-	uintxx j;
-	uintxx y;
-	uintxx x;
-	uintxx ys;
-	uintxx xs;
-	uintxx rumode;
-	uintxx totaly;
-	uintxx totalx;
-	struct TJPGComponent* c;
-	const uintxx s[] = {
-		0x00, 0x00, 0x01, 0x00, 0x02
-	};
-
-	/* 1 = 0; 2 = 1; 4 = 3 */
-	rumode = bsizex - 1;
-
-	/* set the lookup-upscale values */
-	totaly = 0x40 >> s[bsizey];
-	totalx = 0x08 >> s[bsizex];
-	ys = PRVT->ysampling;
-	xs = PRVT->xsampling;
-
-	j = 0;
-	n = 0;
-	c = PRVT->components + index;
-	for (y = 0; y < ys; y++) {
-		uintxx ay;
-		uintxx ax;
-		uintxx um;
-
-		um = rumode;
-		ax = 0;
-		ay = (y >> s[bsizey]) * c->xsampling;
-		for (x = 0; x < xs; x++) {
-			uintxx m;
-
-			m = n + ax;
-			c->iblock[j] = (uint8) (ay + (x >> s[bsizex]));
-			c->offset[j] = (uint8) (m & 0x3f);
-
-			ax += totalx;
-			if (ax >= 8)
-				ax -= 8;
-
-			c->rumode[j] = (uint8) um;
-			if (bsizex != 1) {
-				um++;
-				if (bsizex == 2) {
-					if (um > 2) {
-						um = rumode;
-					}
-				}
-			}
-			j++;
-		}
-		n += totaly;
-	}
-	c->umap = upscalemap[((s[bsizey] << 1) + s[bsizey]) + s[bsizex]];
-}
-
 CTB_INLINE void
 initcomponents(struct TJPGRPblc* jpgr, uintxx ys, uintxx xs)
 {
@@ -1329,8 +1463,7 @@ initcomponents(struct TJPGRPblc* jpgr, uintxx ys, uintxx xs)
 	uintxx sizex;
 	uintxx bsizey;
 	uintxx bsizex;
-	uintxx y;
-	uintxx x;
+	uintxx bsize;
 	struct TJPGComponent* c;
 	const uintxx s[] = {
 		0x00, 0x00, 0x01, 0x00, 0x02
@@ -1371,21 +1504,31 @@ initcomponents(struct TJPGRPblc* jpgr, uintxx ys, uintxx xs)
 		c->nrows = (jpgr->sizey + (bsizey << 3) - 1) >> f[bsizey];
 		c->ncols = (jpgr->sizex + (bsizex << 3) - 1) >> f[bsizex];
 
+		/* unit size */
+		c->usizey = (bsizey << 3) >> PRVT->scale;
+		c->usizex = (bsizex << 3) >> PRVT->scale;
+		if (c->usizey > 8)
+			c->usizey = 8;
+		if (c->usizex > 8)
+			c->usizex = 8;
+
+		/* strip width and upsample ratio of the decoded units, when the
+		 * image is decoded at a reduced scale the subsampled components use
+		 * a larger transform and the ratio can be smaller than the sampling
+		 * one */
 		if (PRVT->ncomponents == 3) {
-			setupscale(jpgr, i, bsizey, bsizex);
-		}
-	}
+			bsize = 8 >> PRVT->scale;
 
-	/* pixel origin for each block */
-	i = 0;
-	for (y = 0; y < ys; y++) {
-		for (x = 0; x < xs; x++) {
-			PRVT->originy[i] = (uint8) (y << 3);
-			PRVT->originx[i] = (uint8) (x << 3);
-			i++;
+			c->swidth = PRVT->ncols * c->xsampling * c->usizex;
+			c->swidth = (c->swidth + 7) & ((uintxx) -8);
+			c->ry = (bsizey * bsize) / c->usizey;
+			c->rx = (bsizex * bsize) / c->usizex;
 		}
 	}
-	PRVT->nunits = i;
+
+	/* output size */
+	PRVT->scaledy = (jpgr->sizey + ((1u << PRVT->scale) - 1)) >> PRVT->scale;
+	PRVT->scaledx = (jpgr->sizex + ((1u << PRVT->scale) - 1)) >> PRVT->scale;
 
 	if (PRVT->ysampling != 1 || PRVT->xsampling != 1) {
 		PRVT->issubsampled = 1;
@@ -1537,6 +1680,15 @@ parseSOF0(struct TJPGRPblc* jpgr, uintxx progressive)
 				/* don't do color transform */
 				PRVT->keepyuv = 1;
 			}
+
+			/* the luma must be the component with the highest sampling
+			 * (the output is written as in a 1 component image) */
+			if (jpgr->flags & JPGR_GRAYSCALE) {
+				if (c[0].ysampling == ysampling &&
+					c[0].xsampling == xsampling) {
+					PRVT->grayonly = 1;
+				}
+			}
 		}
 	}
 
@@ -1557,6 +1709,135 @@ parseSOF0(struct TJPGRPblc* jpgr, uintxx progressive)
 
 static uintxx buildtable(struct TJPGHmTable*, uintxx, uint8*, uint8*);
 
+
+#if !defined(JPGR_CFG_NOTABLECACHE)
+
+/* Process-wide cache of built huffman tables, most images use the standard
+ * tables or the few sets of a given encoder. */
+
+/* number of tables of each type (DC and AC) */
+#define HMCACHESIZE 8
+
+struct TJPGHmCacheKey {
+	uint32 hash;
+	uint16 mode;
+	uint16 total;
+	uint8 lns[16];
+	uint8 symbols[256];
+};
+
+struct TJPGHmCache {
+	uintxx next[2];
+
+	struct TJPGHmCacheKey dckeys[HMCACHESIZE];
+	struct TJPGHmCacheKey ackeys[HMCACHESIZE];
+	struct TJPGDCHmTable dctables[HMCACHESIZE];
+	struct TJPGACHmTable actables[HMCACHESIZE];
+};
+
+static struct TJPGHmCache hmcache;
+
+
+static void
+setcachekey(struct TJPGHmCacheKey* key, uintxx mode, uint8* lns, uint8* s)
+{
+	uintxx i;
+	uint32 h;
+
+	key->mode = (uint16) mode;
+	for (key->total = i = 0; i < 16; i++) {
+		key->total += (key->lns[i] = lns[i]);
+	}
+	ctb_memcpy(key->symbols, s, key->total);
+
+	/* FNV-1a */
+	h = 0x811c9dc5u ^ (uint32) mode;
+	for (i = 0; i < 16; i++) {
+		h = (h ^ lns[i]) * 0x01000193u;
+	}
+	for (i = 0; i < key->total; i++) {
+		h = (h ^ s[i]) * 0x01000193u;
+	}
+	key->hash = h;
+}
+
+CTB_INLINE bool
+equalkeys(struct TJPGHmCacheKey* a, struct TJPGHmCacheKey* b)
+{
+	uintxx i;
+
+	if (a->hash != b->hash || a->mode != b->mode || a->total != b->total) {
+		return 0;
+	}
+	for (i = 0; i < 16; i++) {
+		if (a->lns[i] != b->lns[i]) {
+			return 0;
+		}
+	}
+	for (i = 0; i < a->total; i++) {
+		if (a->symbols[i] != b->symbols[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Copies a cached table, returns 0 if the table is not in the cache. */
+static bool
+loadcachedtable(struct TJPGHmTable* table, struct TJPGHmCacheKey* key)
+{
+	uintxx i;
+	uintxx type;
+	struct TJPGHmCacheKey* keys;
+
+	type = key->mode & 0x01;
+	keys = type ? hmcache.ackeys : hmcache.dckeys;
+
+	imgthr_lock();
+	for (i = 0; i < HMCACHESIZE; i++) {
+		if (equalkeys(keys + i, key)) {
+			if (type) {
+				ctb_memcpy(table, hmcache.actables + i,
+					sizeof(struct TJPGACHmTable));
+			}
+			else {
+				ctb_memcpy(table, hmcache.dctables + i,
+					sizeof(struct TJPGDCHmTable));
+			}
+			break;
+		}
+	}
+	imgthr_unlock();
+	return i != HMCACHESIZE;
+}
+
+/* Adds a table to the cache (replacing the oldest one). */
+static void
+storecachedtable(struct TJPGHmTable* table, struct TJPGHmCacheKey* key)
+{
+	uintxx i;
+	uintxx type;
+
+	type = key->mode & 0x01;
+
+	imgthr_lock();
+	i = hmcache.next[type];
+	hmcache.next[type] = (i + 1) % HMCACHESIZE;
+	if (type) {
+		hmcache.ackeys[i] = key[0];
+		ctb_memcpy(hmcache.actables + i, table, sizeof(struct TJPGACHmTable));
+	}
+	else {
+		hmcache.dckeys[i] = key[0];
+		ctb_memcpy(hmcache.dctables + i, table, sizeof(struct TJPGDCHmTable));
+	}
+	imgthr_unlock();
+}
+
+#undef HMCACHESIZE
+
+#endif
+
 static uintxx
 parseDHT(struct TJPGRPblc* jpgr)
 {
@@ -1566,6 +1847,9 @@ parseDHT(struct TJPGRPblc* jpgr)
 	uintxx total;
 	uintxx tablemap;
 	uintxx mode;
+#if !defined(JPGR_CFG_NOTABLECACHE)
+	struct TJPGHmCacheKey key;
+#endif
 
 	r = read16(jpgr);
 	if (r <= 1) {
@@ -1631,11 +1915,21 @@ parseDHT(struct TJPGRPblc* jpgr)
 				mode = mode | (1 << 2);
 			}
 		}
+#if !defined(JPGR_CFG_NOTABLECACHE)
+		setcachekey(&key, mode, lns, s);
+		if (loadcachedtable(table, &key)) {
+			table->defined = 1;
+			continue;
+		}
+#endif
 		if (buildtable(table, mode, lns, s) == 0) {
 			SETERROR(JPGR_EBADHMTABLE);
 			return 0;
 		}
 		table->defined = 1;
+#if !defined(JPGR_CFG_NOTABLECACHE)
+		storecachedtable(table, &key);
+#endif
 	};
 
 	return 1;
@@ -1669,29 +1963,157 @@ readpassinfo(struct TJPGRPblc* jpgr, uint8* s)
 	return 1;
 }
 
+/* width of the upsampled rows (the output width including the padding of
+ * the last MCU) */
 CTB_INLINE uintxx
-setrequiredmemory(struct TJPGRPblc* jpgr)
+getrowwidth(struct TJPGRPblc* jpgr)
+{
+	uintxx n;
+
+	n = PRVT->ncols * PRVT->xsampling * (8 >> PRVT->scale);
+	return (n + 7) & ((uintxx) -8);
+}
+
+/* memory used by the strip and the upsampling row of each component of a 3
+ * component image (number of values) */
+CTB_INLINE uintxx
+getstripsize(struct TJPGRPblc* jpgr)
 {
 	uintxx i;
-	uint64 total;
-	uint64 v[1];
+	uintxx n;
 	struct TJPGComponent* c;
 
-	total = 0;
-	if (PRVT->isinterleaved) {
-		for (i = 0; i < PRVT->ncomponents; i++) {
-			c = PRVT->components + i;
-			total += c->ucount;
+	n = 0;
+	for (i = 0; i < PRVT->ncomponents; i++) {
+		c = PRVT->components + i;
+		n += c->swidth * c->ysampling * c->usizey;
+		if (PRVT->issubsampled) {
+			n += getrowwidth(jpgr);
 		}
 	}
-	else {
-		for (i = 0; i < PRVT->ncomponents; i++) {
-			c = PRVT->components + i;
-			total += c->ucount + (c->ysampling * c->xsampling);
-		}
+	return n;
+}
+
+/* number of rows of a MCU row of the output image */
+CTB_INLINE uintxx
+getmcuheight(struct TJPGRPblc* jpgr)
+{
+	if (PRVT->ncomponents == 1) {
+		return 8 >> PRVT->scale;
 	}
-	if (ckdu64_mul(total, 64 * sizeof(c->units[0][0]), v) == 0) {
-		if (ckdu64_add(v[0], 16, v)) {
+	return PRVT->ysampling * (8 >> PRVT->scale);
+}
+
+/* number of columns of a MCU of the output image */
+CTB_INLINE uintxx
+getmcuwidth(struct TJPGRPblc* jpgr)
+{
+	if (PRVT->ncomponents == 1) {
+		return 8 >> PRVT->scale;
+	}
+	return PRVT->xsampling * (8 >> PRVT->scale);
+}
+
+/* number of MCU rows and columns of an interleaved scan (a 1 component
+ * scan is made of single units) */
+CTB_INLINE void
+getmcucount(struct TJPGRPblc* jpgr, uintxx* nrows, uintxx* ncols)
+{
+	struct TJPGComponent* c;
+
+	if (PRVT->ncomponents == 1) {
+		c = PRVT->components + PRVT->corder[0];
+		nrows[0] = c->nrows;
+		ncols[0] = c->ncols;
+		return;
+	}
+	nrows[0] = PRVT->nrows;
+	ncols[0] = PRVT->ncols;
+}
+
+/* number of planes of the planar output */
+CTB_INLINE uintxx
+getplanecount(struct TJPGRPblc* jpgr)
+{
+	if (PRVT->grayonly) {
+		return 1;
+	}
+	return PRVT->ncomponents;
+}
+
+/* size of the plane of the component n (planar output), the subsampled
+ * components are not upsampled */
+CTB_INLINE void
+getplanesize(struct TJPGRPblc* jpgr, uintxx n, uintxx* sizey, uintxx* sizex)
+{
+	struct TJPGComponent* c;
+
+	sizey[0] = PRVT->scaledy;
+	sizex[0] = PRVT->scaledx;
+	if (getplanecount(jpgr) == 3) {
+		c = PRVT->components + n;
+		sizey[0] = (sizey[0] + c->ry - 1) / c->ry;
+		sizex[0] = (sizex[0] + c->rx - 1) / c->rx;
+	}
+}
+
+/* the crop window must be inside the (scaled) image, sets the MCU rows and
+ * columns covered by the window */
+CTB_INLINE bool
+checkcrop(struct TJPGRPblc* jpgr)
+{
+	uintxx mcusizey;
+	uintxx mcusizex;
+
+	if (PRVT->cropsizey == 0) {
+		PRVT->cropy = 0;
+		PRVT->cropx = 0;
+		PRVT->cropsizey = PRVT->scaledy;
+		PRVT->cropsizex = PRVT->scaledx;
+	}
+	else {
+		if (PRVT->cropy >= PRVT->scaledy || PRVT->cropx >= PRVT->scaledx) {
+			return 0;
+		}
+		if (PRVT->cropsizey > PRVT->scaledy - PRVT->cropy ||
+			PRVT->cropsizex > PRVT->scaledx - PRVT->cropx) {
+			return 0;
+		}
+		PRVT->iscropped = 1;
+	}
+
+	mcusizey = getmcuheight(jpgr);
+	mcusizex = getmcuwidth(jpgr);
+	PRVT->mcuy1 = PRVT->cropy / mcusizey;
+	PRVT->mcux1 = PRVT->cropx / mcusizex;
+	PRVT->mcuy2 = (PRVT->cropy + PRVT->cropsizey + mcusizey - 1) / mcusizey;
+	PRVT->mcux2 = (PRVT->cropx + PRVT->cropsizex + mcusizex - 1) / mcusizex;
+	return 1;
+}
+
+CTB_INLINE uintxx
+setrequiredmemory(struct TJPGRPblc* jpgr)
+{
+	uintxx i;
+	uint64 total;
+	uint64 v[1];
+	struct TJPGComponent* c;
+
+	total = 0;
+	if (PRVT->isinterleaved) {
+		for (i = 0; i < PRVT->ncomponents; i++) {
+			c = PRVT->components + i;
+			total += c->ucount;
+		}
+	}
+	else {
+		for (i = 0; i < PRVT->ncomponents; i++) {
+			c = PRVT->components + i;
+			total += c->ucount + (c->ysampling * c->xsampling);
+		}
+	}
+	if (ckdu64_mul(total, 64 * sizeof(c->units[0][0]), v) == 0) {
+		if (ckdu64_add(v[0], 16, v)) {
 			return 0;
 		}
 	}
@@ -1699,8 +2121,8 @@ setrequiredmemory(struct TJPGRPblc* jpgr)
 		return 0;
 	}
 
-	if (PRVT->issubsampled) {
-		total = PRVT->ncomponents * (8 * sizeof(c->srow[0]));
+	if (PRVT->ncomponents == 3) {
+		total = (uint64) getstripsize(jpgr) * sizeof(c->strip[0]);
 		if (ckdu64_add(v[0], total, v)) {
 			return 0;
 		}
@@ -1870,8 +2292,8 @@ jpgr_initdecoder(TJPGReader* jpgr, TImageInfo* info)
 		goto L_ERROR;
 	}
 
-	/* at this point we need an input function */
-	if (PRVT->inputfn == NULL) {
+	/* at this point we need an input function or a memory source */
+	if (PRVT->inputfn == NULL && PRVT->ismemsource == 0) {
 		SETERROR(JPGR_EIOERROR);
 		goto L_ERROR;
 	}
@@ -1883,6 +2305,10 @@ jpgr_initdecoder(TJPGReader* jpgr, TImageInfo* info)
 		if (parsesegments(PBLC) == 0) {
 			goto L_ERROR;
 		}
+		if (checkcrop(PBLC) == 0) {
+			SETERROR(JPGR_EINCORRECTUSE);
+			goto L_ERROR;
+		}
 
 		/* color mode */
 		mode = IMAGE_GRAY;
@@ -1907,13 +2333,23 @@ jpgr_initdecoder(TJPGReader* jpgr, TImageInfo* info)
 			if (mode == IMAGE_YCBCR && PRVT->keepyuv == 0) {
 				mode = IMAGE_RGB;
 			}
+			if (PRVT->grayonly) {
+				mode = IMAGE_GRAY;
+			}
+		}
+		if (PRVT->layout != JPGR_DEFAULTLAYOUT && mode != IMAGE_YCBCR) {
+			mode = IMAGE_RGBALPHA;
+		}
+		else {
+			PRVT->layout = JPGR_DEFAULTLAYOUT;
 		}
 
-		info->sizey = jpgr->sizey;
-		info->sizex = jpgr->sizex;
+		info->sizey = PRVT->cropsizey;
+		info->sizex = PRVT->cropsizex;
 		info->colortype = mode;
 		info->depth = 8;
-		info->size  = imginfo_getrowsize(info) * jpgr->sizey;
+		info->size  = imginfo_getrowsize(info) * PRVT->cropsizey;
+		PRVT->pelsize = imginfo_getpelsize(info);
 
 		SETSTATE(1);
 		return 1;
@@ -1988,178 +2424,545 @@ jpgr_setbuffers(TJPGReader* jpgr, uint8* pixels)
 	}
 
 	if (PRVT->ncomponents == 3) {
-		if (PRVT->issubsampled) {
-			for (i = 0; i < PRVT->ncomponents; i++) {
-				c = PRVT->components + i;
+		for (i = 0; i < PRVT->ncomponents; i++) {
+			c = PRVT->components + i;
 
+			c->strip = (void*) memory;
+			memory += c->swidth * c->ysampling * c->usizey * sizeof(int16);
+			if (PRVT->issubsampled) {
 				c->srow = (void*) memory;
-				memory += (8 * sizeof(c->srow[0]));
+				memory += getrowwidth(PBLC) * sizeof(c->srow[0]);
 			}
 		}
 	}
 
 	PRVT->pixels = pixels;
-	if (jpgr->isprogressive && pixels) {
-		ctb_memset(pixels, 0, jpgr->sizey * jpgr->sizex * PRVT->ncomponents);
+	if (PRVT->planar == 0) {
+		PRVT->stride = PRVT->cropsizex * PRVT->pelsize;
+		if (jpgr->isprogressive && pixels && PRVT->outputfn == NULL) {
+			ctb_memset(pixels, 0, PRVT->cropsizey * PRVT->stride);
+		}
+	}
+	else {
+		if (jpgr->isprogressive) {
+			for (i = 0; i < getplanecount(PBLC); i++) {
+				uintxx sizey;
+				uintxx sizex;
+
+				getplanesize(PBLC, i, &sizey, &sizex);
+				for (j = 0; j < sizey; j++) {
+					ctb_memset(
+						PRVT->planes[i] + j * PRVT->strides[i], 0, sizex);
+				}
+			}
+		}
 	}
 	SETSTATE(2);
 }
 
-/*
- * Image decoder */
-
-#define LENGTHBITS 5
-#define LENGTHMASK ((1u << LENGTHBITS) - 1)
-
-#define GETLENGTH(S) ((S) &  LENGTHMASK)
-#define GETSYMBOL(S) ((S) >> LENGTHBITS)
-
-
-CTB_INLINE intxx
-extend(intxx m, intxx a)
-{
-#if defined(CTB_ENV64)
-	return a + (((a - ((1LL) << (m - 1))) >> 31) & ((((uintxx) -1) << m) + 1));
-#else
-	return a + (((a - (( 1L) << (m - 1))) >> 31) & ((((uintxx) -1) << m) + 1));
-#endif
-}
-
-static void
-buildextenttable(struct TJPGACHmTable* table)
+void
+jpgr_setplanes(TJPGReader* jpgr, uint8* planes[3], uintxx strides[3])
 {
 	uintxx i;
-	uint16 s;
-	intxx rs;
-	intxx length;
-	intxx rrrr;
-	intxx ssss;
-
-	/* The idea for this optimization comes from stb_image by Sean Barret */
-	for (i = 0; i < (1u << ROOTBITS); i++) {
-		intxx v;
-		intxx a;
-
-		table->sextent[i] = 0;
-		s = table->symbols[i];
-		if ((int16) s < 0) {
-			/* subtable */
-			continue;
-		}
-		rs     = GETSYMBOL(s);
-		length = GETLENGTH(s);
+	uintxx sizey;
+	uintxx sizex;
+	CTB_ASSERT(jpgr && planes && strides);
 
-		rrrr = (rs >> 4);
-		ssss = (rs >> 0) & 0x0f;
-		if (ssss == 0 || ((length + ssss) > ROOTBITS)) {
-			continue;
+	if (jpgr->state ^ 1 || PRVT->iscropped) {
+		SETSTATE(JPGR_BADSTATE);
+		if (jpgr->error == 0) {
+			SETERROR(JPGR_EINCORRECTUSE);
 		}
+		return;
+	}
 
-		/* additional bits */
-		a = ((i << length) & ((1l << ROOTBITS) - 1)) >> (ROOTBITS - ssss);
-
-		v = extend(ssss, a);
-		if (v < -128 || v > 127) {
-			/* value is too large fo fit in 8 bits */
-			continue;
+	for (i = 0; i < getplanecount(PBLC); i++) {
+		getplanesize(PBLC, i, &sizey, &sizex);
+		if (planes[i] == NULL || strides[i] < sizex) {
+			SETSTATE(JPGR_BADSTATE);
+			SETERROR(JPGR_EINCORRECTUSE);
+			return;
 		}
-		rs = (int16) ((v << 8) | (rrrr << 4) | (length + ssss));
-		table->sextent[i] = (int16) rs;
+		PRVT->planes[i]  = planes[i];
+		PRVT->strides[i] = strides[i];
 	}
+	PRVT->planar = 1;
+
+	/* a gray image is decoded as usual (using the stride) */
+	PRVT->layout  = JPGR_DEFAULTLAYOUT;
+	PRVT->pelsize = 1;
+	PRVT->stride  = strides[0];
+	jpgr_setbuffers(jpgr, planes[0]);
 }
 
-static uintxx
-buildtable(struct TJPGHmTable* table, uintxx mode, uint8* lns, uint8* symbols)
+void
+jpgr_setoutputfn(TJPGReader* jpgr, TIMGOutputFn fn, void* user)
 {
-	intxx i;
-	intxx j;
-	intxx m;
-	intxx r;
-	intxx v;
-	intxx k;
-	intxx count;
-	intxx offset;
-	uint16 c;
-	uint16 codes[16];
-
-	j = 1;
-	c = 0;
-	for (i = m = 0; i < 16; i++) {
-		j = (j << 1) - lns[i];
-		if (j < 0) {
+	uintxx size;
+	CTB_ASSERT(jpgr && fn);
 
-			return 0;
+	if (jpgr->state ^ 1) {
+		SETSTATE(JPGR_BADSTATE);
+		if (jpgr->error == 0) {
+			SETERROR(JPGR_EINCORRECTUSE);
 		}
-		m += lns[i];
+		return;
+	}
 
-		codes[i] = c;
-		c = (c + lns[i]) << 1;
+	size = getmcuheight(PBLC) * PRVT->cropsizex * PRVT->pelsize;
+	PRVT->rowmemory = request_(PRVT, size);
+	if (PRVT->rowmemory == NULL) {
+		SETSTATE(JPGR_BADSTATE);
+		SETERROR(JPGR_EOOM);
+		return;
 	}
+	PRVT->rowmsize = size;
 
-	/* check symbols range 0-15 for DC tables */
-	if ((mode & 0x01) == 0) {
-		for (i = 0; i < m; i++) {
-			if (symbols[i] > 15) {
-				return 0;
-			}
-		}
-		v = ENOUGH_DC;
+	PRVT->outputfn   = fn;
+	PRVT->outputuser = user;
+	jpgr_setbuffers(jpgr, PRVT->rowmemory);
+}
+
+bool
+jpgr_getplanesize(TJPGReader* jpgr, uintxx n, uintxx* sizey, uintxx* sizex)
+{
+	CTB_ASSERT(jpgr && sizey && sizex);
+
+	if (jpgr->state == 0 || jpgr->state == JPGR_BADSTATE) {
+		return 0;
 	}
-	else {
-		v = ENOUGH_AC;
+	if (n >= getplanecount(PBLC)) {
+		return 0;
 	}
 
-	/* reset the main entries in the table */
-	for (i = 0; i < 1l << ROOTBITS; i++) {
-		table->symbols[i] = 0;
-	}
+	getplanesize(PBLC, n, sizey, sizex);
+	return 1;
+}
 
-	/* mark secondary tables as secondary and set the offsets */
-	offset = 1u << ROOTBITS;
-	for (i = 16; i > ROOTBITS; i--) {
-		count = lns[i - 1];
-		if (count == 0) {
-			continue;
-		}
 
-		r = i - ROOTBITS;
-		c = codes[i - 1] >> r;
+/*
+ * Random access index, the index starts with a header of 8 values (magic,
+ * version, size of the image, number of components, restart interval, MCU
+ * rows between checkpoints and number of checkpoints) followed by the
+ * checkpoints (see setcheckpoint), all the values are stored as 32 bits big
+ * endian integers */
 
-		j = count >> r;
-		if (count & ((1u << r) - 1))
-			j++;
+#define INDEXMAGIC 0x4A504749
+#define INDEXVERSION 1
 
-		for (m = 0; m < j; m++) {
-			uintxx entry;
-			k = c + m;
+#define INDEXHEADERSIZE (8 * 4)
+#define INDEXENTRYSIZE  (6 * 4)
 
-			if (table->symbols[k]) {
-				continue;
-			}
+CTB_INLINE void
+putu32(uint8* s, uint32 v)
+{
+	s[0] = (uint8) (v >> 0x18);
+	s[1] = (uint8) (v >> 0x10);
+	s[2] = (uint8) (v >> 0x08);
+	s[3] = (uint8) (v);
+}
 
-			/* Store the shift needed to get the lower bits of the code
-			 * in a 16bit word, for subtables we need to mask the top bits and
-			 * shift rigth using this value.
-			 * The top bit is used to indicate the symbol is a
-			 * subtable offset. */
-			entry = (1u << 15) | (offset << LENGTHBITS) | (16 - i);
+CTB_INLINE uint32
+getu32(const uint8* s)
+{
+	return ((uint32) s[0] << 0x18) | ((uint32) s[1] << 0x10) |
+		((uint32) s[2] << 0x08) | ((uint32) s[3]);
+}
 
-			table->symbols[k] = (uint16) entry;
-			offset += ((uintxx) 1) << r;
-		}
-	}
+/* number of checkpoints of an index, zero if the image can't be indexed
+ * (only interleaved baseline images read from a memory source) */
+CTB_INLINE uintxx
+getcheckpointcount(struct TJPGRPblc* jpgr, uintxx step)
+{
+	uintxx nrows;
+	uintxx ncols;
 
-	if (offset > v) {
-		/* should not happen */
+	if (jpgr->isprogressive || PRVT->isinterleaved == 0) {
+		return 0;
+	}
+	if (PRVT->ismemsource == 0 || PRVT->srcbgn == NULL || step == 0) {
 		return 0;
 	}
 
-	/* populate the table */
-	m = 0;
-	for (j = 0; j < 16; j++) {
-		uint16 e;
+	getmcucount(jpgr, &nrows, &ncols);
+	return (nrows + (step - 1)) / step;
+}
 
-		count = lns[j];
+CTB_INLINE void
+setindexheader(struct TJPGRPblc* jpgr, uint8* index)
+{
+	putu32(index + 0x00, INDEXMAGIC);
+	putu32(index + 0x04, INDEXVERSION);
+	putu32(index + 0x08, jpgr->sizey);
+	putu32(index + 0x0c, jpgr->sizex);
+	putu32(index + 0x10, PRVT->ncomponents);
+	putu32(index + 0x14, PRVT->rinterval);
+	putu32(index + 0x18, (uint32) PRVT->istep);
+	putu32(index + 0x1c, (uint32) PRVT->icount);
+}
+
+uintxx
+jpgr_getindexsize(TJPGReader* jpgr, uintxx step)
+{
+	uintxx n;
+	CTB_ASSERT(jpgr);
+
+	if (jpgr->state == 0 || jpgr->state == JPGR_BADSTATE) {
+		return 0;
+	}
+
+	n = getcheckpointcount(PBLC, step);
+	if (n == 0) {
+		return 0;
+	}
+	return INDEXHEADERSIZE + n * INDEXENTRYSIZE;
+}
+
+void
+jpgr_buildindex(TJPGReader* jpgr, uintxx step, uint8* index)
+{
+	uintxx n;
+	CTB_ASSERT(jpgr && index);
+
+	n = getcheckpointcount(PBLC, step);
+	if (jpgr->state ^ 2 || n == 0 || PRVT->iscropped) {
+		SETSTATE(JPGR_BADSTATE);
+		if (jpgr->error == 0) {
+			SETERROR(JPGR_EINCORRECTUSE);
+		}
+		return;
+	}
+
+	PRVT->index  = index;
+	PRVT->istep  = step;
+	PRVT->icount = n;
+	PRVT->isbuilding = 1;
+	setindexheader(PBLC, index);
+}
+
+void
+jpgr_setindex(TJPGReader* jpgr, const uint8* index, uintxx size)
+{
+	uintxx i;
+	uintxx n;
+	uintxx step;
+	uint8 header[INDEXHEADERSIZE];
+	CTB_ASSERT(jpgr && index);
+
+	if (jpgr->state ^ 1) {
+		SETSTATE(JPGR_BADSTATE);
+		if (jpgr->error == 0) {
+			SETERROR(JPGR_EINCORRECTUSE);
+		}
+		return;
+	}
+
+	if (size < INDEXHEADERSIZE) {
+		goto L_ERROR;
+	}
+	step = getu32(index + 0x18);
+	n = getcheckpointcount(PBLC, step);
+	if (n == 0 || size != INDEXHEADERSIZE + n * INDEXENTRYSIZE) {
+		goto L_ERROR;
+	}
+
+	/* the index must be made for this image */
+	PRVT->istep  = step;
+	PRVT->icount = n;
+	setindexheader(PBLC, header);
+	for (i = 0; i < INDEXHEADERSIZE; i++) {
+		if (header[i] != index[i]) {
+			goto L_ERROR;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		const uint8* e;
+		uint64 offset;
+
+		e = index + INDEXHEADERSIZE + i * INDEXENTRYSIZE;
+		offset = ((uint64) getu32(e) << 0x20) | getu32(e + 4);
+		if (offset >= (uint64) (PRVT->end - PRVT->srcbgn)) {
+			goto L_ERROR;
+		}
+		if (e[8] > 7 || (getu32(e + 8) & 0xffff) > PRVT->rinterval) {
+			goto L_ERROR;
+		}
+	}
+	PRVT->index = (uint8*) index;
+	return;
+
+L_ERROR:
+	PRVT->istep  = 0;
+	PRVT->icount = 0;
+	SETSTATE(JPGR_BADSTATE);
+	SETERROR(JPGR_EBADINDEX);
+}
+
+
+/*
+ * Image decoder */
+
+#define LENGTHBITS 5
+#define LENGTHMASK ((1u << LENGTHBITS) - 1)
+
+#define GETLENGTH(S) ((S) &  LENGTHMASK)
+#define GETSYMBOL(S) ((S) >> LENGTHBITS)
+
+
+#define ROOTMASK (~(((1u << ROOTBITS) - 1) << (16 - ROOTBITS)))
+
+CTB_INLINE uint16
+decodesymbol(struct TJPGACHmTable* table, uintxx bits)
+{
+	int16 s;
+
+	s = (uint16) table->symbols[bits >> (16 - ROOTBITS)];
+
+	if (CTB_UNLIKELY((int16) s < 0)) {
+		uintxx offset;
+		uintxx extra;
+
+		offset = GETSYMBOL(s & ((1u << 15) - 1));
+		extra  = GETLENGTH(s);
+		s = table->symbols[offset + ((bits & ROOTMASK) >> extra)];
+	}
+	return s;
+}
+
+#undef ROOTMASK
+
+
+CTB_INLINE intxx
+extend(intxx m, intxx a)
+{
+#if defined(CTB_ENV64)
+	return a + (((a - ((1LL) << (m - 1))) >> 31) & ((((uintxx) -1) << m) + 1));
+#else
+	return a + (((a - (( 1L) << (m - 1))) >> 31) & ((((uintxx) -1) << m) + 1));
+#endif
+}
+
+#if MSROOTBITS
+
+/* Decodes a short symbol and its additional bits from the top n bits of
+ * a 16 bit word, returns the total length or 0 if they don't fit (or the value
+ * is too large to fit in 8 bits). The value is zero for the end of block. */
+static uintxx
+shortsymbol(struct TJPGACHmTable* table, uintxx bits, uintxx n, uintxx* run,
+	intxx* value)
+{
+	uint16 s;
+	uintxx length;
+	uintxx rs;
+	uintxx ssss;
+	intxx a;
+
+	s = decodesymbol(table, bits);
+	length = GETLENGTH(s);
+	if (s == 0 || length > n) {
+		return 0;
+	}
+	rs = GETSYMBOL(s);
+
+	run[0]   = rs >> 4;
+	value[0] = 0;
+	ssss = rs & 0x0f;
+	if (ssss == 0) {
+		if (rs != 0) {
+			/* zero run-length, slow path */
+			return 0;
+		}
+		return length;
+	}
+	if (length + ssss > n) {
+		return 0;
+	}
+
+	a = (intxx) (((bits << length) & 0xffff) >> (16 - ssss));
+	value[0] = extend((intxx) ssss, a);
+	if (value[0] < -128 || value[0] > 127) {
+		return 0;
+	}
+	return length + ssss;
+}
+
+static void
+buildmsymboltable(struct TJPGACHmTable* table)
+{
+	uintxx i;
+
+	for (i = 0; i < (1u << MSROOTBITS); i++) {
+		uintxx bits;
+		uintxx l1;
+		uintxx l2;
+		uintxx r1;
+		uintxx r2;
+		intxx v1;
+		intxx v2;
+		uint32 e;
+
+		table->msymbols[i] = 0;
+
+		bits = i << (16 - MSROOTBITS);
+		l1 = shortsymbol(table, bits, MSROOTBITS, &r1, &v1);
+		if (l1 == 0) {
+			continue;
+		}
+		e = (uint32) (l1 | (l1 << 4) | (r1 << 8) | ((v1 & 0xff) << 16));
+
+		/* a second symbol (or the end of block) after a cofficient */
+		if (v1 != 0) {
+			bits = (bits << l1) & 0xffff;
+			l2 = shortsymbol(table, bits, MSROOTBITS - l1, &r2, &v2);
+			if (l2 != 0) {
+				e = (uint32) ((l1 + l2) | (l1 << 4) | (r1 << 8) | (r2 << 12));
+				e = e | (uint32) ((v1 & 0xff) << 16) | ((uint32) v2 << 24);
+			}
+		}
+		table->msymbols[i] = (int32) e;
+	}
+}
+
+#else
+
+static void
+buildextenttable(struct TJPGACHmTable* table)
+{
+	uintxx i;
+	uint16 s;
+	intxx rs;
+	intxx length;
+	intxx rrrr;
+	intxx ssss;
+
+	/* The idea for this optimization comes from stb_image by Sean Barret */
+	for (i = 0; i < (1u << ROOTBITS); i++) {
+		intxx v;
+		intxx a;
+
+		table->sextent[i] = 0;
+		s = table->symbols[i];
+		if ((int16) s < 0) {
+			/* subtable */
+			continue;
+		}
+		rs     = GETSYMBOL(s);
+		length = GETLENGTH(s);
+
+		rrrr = (rs >> 4);
+		ssss = (rs >> 0) & 0x0f;
+		if (ssss == 0 || ((length + ssss) > ROOTBITS)) {
+			continue;
+		}
+
+		/* additional bits */
+		a = ((i << length) & ((1l << ROOTBITS) - 1)) >> (ROOTBITS - ssss);
+
+		v = extend(ssss, a);
+		if (v < -128 || v > 127) {
+			/* value is too large fo fit in 8 bits */
+			continue;
+		}
+		rs = (int16) ((v << 8) | (rrrr << 4) | (length + ssss));
+		table->sextent[i] = (int16) rs;
+	}
+}
+
+#endif
+
+static uintxx
+buildtable(struct TJPGHmTable* table, uintxx mode, uint8* lns, uint8* symbols)
+{
+	intxx i;
+	intxx j;
+	intxx m;
+	intxx r;
+	intxx v;
+	intxx k;
+	intxx count;
+	intxx offset;
+	uint16 c;
+	uint16 codes[16];
+
+	j = 1;
+	c = 0;
+	for (i = m = 0; i < 16; i++) {
+		j = (j << 1) - lns[i];
+		if (j < 0) {
+
+			return 0;
+		}
+		m += lns[i];
+
+		codes[i] = c;
+		c = (c + lns[i]) << 1;
+	}
+
+	/* check symbols range 0-15 for DC tables */
+	if ((mode & 0x01) == 0) {
+		for (i = 0; i < m; i++) {
+			if (symbols[i] > 15) {
+				return 0;
+			}
+		}
+		v = ENOUGH_DC;
+	}
+	else {
+		v = ENOUGH_AC;
+	}
+
+	/* reset the main entries in the table */
+	for (i = 0; i < 1l << ROOTBITS; i++) {
+		table->symbols[i] = 0;
+	}
+
+	/* mark secondary tables as secondary and set the offsets */
+	offset = 1u << ROOTBITS;
+	for (i = 16; i > ROOTBITS; i--) {
+		count = lns[i - 1];
+		if (count == 0) {
+			continue;
+		}
+
+		r = i - ROOTBITS;
+		c = codes[i - 1] >> r;
+
+		j = count >> r;
+		if (count & ((1u << r) - 1))
+			j++;
+
+		for (m = 0; m < j; m++) {
+			uintxx entry;
+			k = c + m;
+
+			if (table->symbols[k]) {
+				continue;
+			}
+
+			/* Store the shift needed to get the lower bits of the code
+			 * in a 16bit word, for subtables we need to mask the top bits and
+			 * shift rigth using this value.
+			 * The top bit is used to indicate the symbol is a
+			 * subtable offset. */
+			entry = (1u << 15) | (offset << LENGTHBITS) | (16 - i);
+
+			table->symbols[k] = (uint16) entry;
+			offset += ((uintxx) 1) << r;
+		}
+	}
+
+	if (offset > v) {
+		/* should not happen */
+		return 0;
+	}
+
+	/* populate the table */
+	m = 0;
+	for (j = 0; j < 16; j++) {
+		uint16 e;
+
+		count = lns[j];
 		if (count == 0) {
 			continue;
 		}
@@ -2196,7 +2999,11 @@ buildtable(struct TJPGHmTable* table, uintxx mode, uint8* lns, uint8* symbols)
 	}
 
 	if ((mode >> 1) != 0) {
+#if MSROOTBITS
+		buildmsymboltable((void*) table);
+#else
 		buildextenttable((void*) table);
+#endif
 	}
 	return 1;
 }
@@ -2205,111 +3012,126 @@ buildtable(struct TJPGHmTable* table, uintxx mode, uint8* lns, uint8* symbols)
 /*
  * BIT reading functions */
 
-#define BUFFERBYTES (BPREFETCHBZ * sizeof(PRVT->bb[0]))
+#if DOSSE2
+	#define UCHUNKSIZE 16
+#else
+	#define UCHUNKSIZE  8
+#endif
 
-static void
-fecthbits(struct TJPGRPblc* jpgr)
+/* copies a chunk of input, returns the number of bytes before the first
+ * 0xff (the chunk size if there is none) */
+CTB_INLINE uintxx
+copychunk(uint8* target, const uint8* source)
 {
 	uintxx j;
-	uintxx s;
-	uintxx r;
-	uintxx index;
-	uintxx buffer;
+#if DOSSE2
+	__m128i v;
+	uintxx m;
 
-	PRVT->bindex = 0;
-	if (CTB_UNLIKELY(PRVT->bend)) {
-		if (PRVT->bend == 1) {
-			for (index = 0; index < BPREFETCHBZ; index++) {
-				PRVT->bb[index] = 0;
-			}
-			PRVT->bend++;
-		}
-		return;
-	}
+	v = _mm_loadu_si128((const __m128i*) source);
+	_mm_storeu_si128((__m128i*) target, v);
 
-	index = 0;
-	if (CTB_LIKELY(((uintxx) (PRVT->end - PRVT->bgn)) >= BUFFERBYTES)) {
-		for (; index < BPREFETCHBZ; PRVT->bgn += 2) {
-			if (CTB_UNLIKELY(PRVT->bgn[0] == 0xff)) {
-				PRVT->bbcread += (index << 1) << 3;
-				goto L_SLOW;
-			}
-			if (CTB_UNLIKELY(PRVT->bgn[1] == 0xff)) {
-				PRVT->bbcread += (index << 1) << 3;
-				goto L_SLOW;
-			}
+	m = (uintxx) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(-1)));
+	if (CTB_LIKELY(m == 0)) {
+		return UCHUNKSIZE;
+	}
+	for (j = 0; (m & 1) == 0; j++) {
+		m = m >> 1;
+	}
+#else
+	uint64 v;
 
-			PRVT->bb[index++] = (PRVT->bgn[0] << 8) | PRVT->bgn[1];
-		}
+	ctb_memcpy(&v, source, sizeof(v));
+	ctb_memcpy(target, &v, sizeof(v));
 
-		PRVT->bbcread += BUFFERBYTES << 3;
-		return;
+	/* test for a 0xff byte (a zero byte in the complement) */
+	v = ~v;
+	if (CTB_LIKELY(((v - 0x0101010101010101ull) & ~v & 0x8080808080808080ull)
+		== 0)) {
+		return UCHUNKSIZE;
 	}
+	for (j = 0; source[j] != 0xff; j++)
+		;
+#endif
+	return j;
+}
 
-L_SLOW:
-	j = 0;
-	s = 0;
-	r = 0;
-	buffer = 0;
-	for (; index < BPREFETCHBZ;) {
-		uintxx m;
-		uintxx v;
-
-		v = PRVT->end - PRVT->bgn;
-		if (CTB_LIKELY(v > 1)) {
-			m = PRVT->bgn[0];
-		}
-		else {
-			if (CTB_UNLIKELY(PRVT->endofinput)) {
-				m = 0;
-				s = 1;
-				if (v) {
-					m = PRVT->bgn[0];
-					if (m == 0xff) {
-						m = 0;
-					}
-					else {
-						s = 0;
-					}
-				}
+/* Fills the unstuffed buffer, the data is copied in chunks until a 0xff is
+ * found, after the first marker (or the end of the input) the buffer is
+ * filled with zeros. */
+static void
+fecthbytes(struct TJPGRPblc* jpgr)
+{
+	uintxx j;
+	uintxx n;
+	uintxx r;
+	uint8* u;
+	uint8* e;
+
+	/* keep the bytes not used yet */
+	r = PRVT->ucount - PRVT->uindex;
+	for (j = 0; j < r; j++) {
+		PRVT->ubuffer[j] = PRVT->ubuffer[PRVT->uindex + j];
+	}
+	PRVT->uindex = 0;
+
+	u = PRVT->ubuffer + r;
+	e = PRVT->ubuffer + UBUFFERSIZE;
+	while (CTB_LIKELY(u < e) && PRVT->bend == 0) {
+		uintxx avaible;
+
+		avaible = (uintxx) (PRVT->end - PRVT->bgn);
+		if (CTB_LIKELY(avaible > UCHUNKSIZE)) {
+			n = copychunk(u, PRVT->bgn);
+			u += n;
+			PRVT->bgn += n;
+			if (CTB_LIKELY(n == UCHUNKSIZE)) {
+				continue;
 			}
-			else {
-				readmore(jpgr, v, 4 * BUFFERBYTES);
+
+			/* a stuffed 0xff or a marker */
+			if (PRVT->bgn[1] == 0x00) {
+				*u++ = 0xff;
+				PRVT->bgn += 2;
 				continue;
 			}
+			PRVT->bend = 1;
+			break;
 		}
 
-		if (CTB_UNLIKELY(m == 0xff)) {
-			if (PRVT->bgn[1]) {
-				m = 0;
-				s = 1;
-				PRVT->bend = 1;
-			}
-			if (s == 0) {
-				PRVT->bgn++;
-				PRVT->bgn++;
-				r++;
-			}
+		if (PRVT->endofinput == 0) {
+			readmore(jpgr, avaible, UBUFFERSIZE);
+			continue;
 		}
-		else {
-			if (s == 0) {
-				PRVT->bgn++;
-				r++;
+
+		/* last bytes of the input */
+		if (avaible == 0) {
+			PRVT->bend = 1;
+			break;
+		}
+		if (PRVT->bgn[0] == 0xff) {
+			if (avaible == 1 || PRVT->bgn[1] != 0x00) {
+				PRVT->bend = 1;
+				break;
 			}
+			*u++ = 0xff;
+			PRVT->bgn += 2;
+			continue;
 		}
+		*u++ = *PRVT->bgn++;
+	}
 
-		buffer = m | (buffer << 8);
-		j += 8;
-		if (j == 16) {
-			PRVT->bb[index++] = (uint16) buffer;
-			j = buffer = 0;
+	n = (uintxx) (u - PRVT->ubuffer);
+	PRVT->bbcread += (n - r) << 3;
+	if (PRVT->bend) {
+		for (; n < UBUFFERSIZE; n++) {
+			PRVT->ubuffer[n] = 0;
 		}
 	}
-
-	PRVT->bbcread += r << 3;
+	PRVT->ucount = (uint32) n;
 }
 
-#undef BUFFERBYTES
+#undef UCHUNKSIZE
 
 
 CTB_INLINE void
@@ -2320,18 +3142,51 @@ initbitmode(struct TJPGRPblc* jpgr)
 
 	PRVT->bbcread = 0;
 	PRVT->bend = 0;
-	fecthbits(jpgr);
+	PRVT->uindex = 0;
+	PRVT->ucount = 0;
+	fecthbytes(jpgr);
+}
+
+/* big endian load of the bytes that fit in the bit buffer */
+CTB_INLINE BBTYPE
+loadbytes(const uint8* s)
+{
+	BBTYPE v;
+
+	v = ((BBTYPE) s[0] << 0x18) | ((BBTYPE) s[1] << 0x10) |
+		((BBTYPE) s[2] << 0x08) | ((BBTYPE) s[3]);
+#if defined(CTB_ENV64)
+	v = (v << 0x20) |
+		((BBTYPE) s[4] << 0x18) | ((BBTYPE) s[5] << 0x10) |
+		((BBTYPE) s[6] << 0x08) | ((BBTYPE) s[7]);
+#endif
+	return v;
+}
+
+/* Refills the bit buffer with all the whole bytes that fit in it (bc must be
+ * less than 16 so at least 2 bytes fit). */
+CTB_INLINE BBTYPE
+fillbbuffer(struct TJPGRPblc* jpgr, BBTYPE bb, uintxx* bc)
+{
+	uintxx n;
+	BBTYPE v;
+
+	if (CTB_UNLIKELY(PRVT->ucount - PRVT->uindex < sizeof(BBTYPE))) {
+		fecthbytes(jpgr);
+	}
+	v = loadbytes(PRVT->ubuffer + PRVT->uindex);
+
+	n = ((sizeof(BBTYPE) << 3) - 1 - bc[0]) >> 3;
+	PRVT->uindex += (uint32) n;
+	bc[0] += n << 3;
+	return (bb << (n << 3)) | (v >> ((sizeof(BBTYPE) - n) << 3));
 }
 
 CTB_INLINE void
 ensurebits(struct TJPGRPblc* jpgr, uintxx n)
 {
 	if (CTB_LIKELY(PRVT->bbcount < n)) {
-		if (CTB_UNLIKELY(PRVT->bindex >= BPREFETCHBZ)) {
-			fecthbits(jpgr);
-		}
-		PRVT->bbuffer  = (PRVT->bbuffer << 16) | PRVT->bb[PRVT->bindex++];
-		PRVT->bbcount += 16;
+		PRVT->bbuffer = fillbbuffer(jpgr, PRVT->bbuffer, &PRVT->bbcount);
 	}
 }
 
@@ -2362,66 +3217,16 @@ overread(struct TJPGRPblc* jpgr)
 /*
  * Decoder */
 
-#define ROOTMASK (~(((1u << ROOTBITS) - 1) << (16 - ROOTBITS)))
-
-CTB_INLINE uint16
-decodesymbol(struct TJPGACHmTable* table, uintxx bits)
-{
-	int16 s;
-
-	s = (uint16) table->symbols[bits >> (16 - ROOTBITS)];
-
-	if (CTB_UNLIKELY((int16) s < 0)) {
-		uintxx offset;
-		uintxx extra;
-
-		offset = GETSYMBOL(s & ((1u << 15) - 1));
-		extra  = GETLENGTH(s);
-		s = table->symbols[offset + ((bits & ROOTMASK) >> extra)];
-	}
-	return s;
-}
-
-#undef ROOTMASK
-
-
-CTB_INLINE BBTYPE
-fillbbuffer(struct TJPGRPblc* jpgr, BBTYPE bb)
-{
-	/* keep 16 bits */
-#if defined(CTB_ENV64)
-	if (CTB_UNLIKELY(PRVT->bindex >= BPREFETCHBZ))
-		fecthbits(jpgr);
-	bb = (bb << 16) | PRVT->bb[PRVT->bindex++];
-
-	if (CTB_UNLIKELY(PRVT->bindex >= BPREFETCHBZ))
-		fecthbits(jpgr);
-	bb = (bb << 16) | PRVT->bb[PRVT->bindex++];
-#endif
-
-	if (CTB_UNLIKELY(PRVT->bindex >= BPREFETCHBZ))
-		fecthbits(jpgr);
-	bb = (bb << 16) | PRVT->bb[PRVT->bindex++];
-
-	return bb;
-}
-
-
 #define GETBITS(BB, BC, N) ((BB) >> ((BC) - (N)))
 
 #define DROPBITS(BB, BC, N) ((BB) &= ~(((BBTYPE) -1l) << ((BC) -= (N))))
 
 
-#if defined(CTB_ENV64)
-#	define BBFILLBITS 48
-#else
-#	define BBFILLBITS 16
-#endif
-
 static bool
 decodeblock(struct TJPGRPblc* jpgr, struct TJPGComponent* c, int16* block)
 {
 	uintxx i;
+	uintxx m;
 	uintxx symbol;
 	uintxx length;
 	uintxx r;
@@ -2430,6 +3235,9 @@ decodeblock(struct TJPGRPblc* jpgr, struct TJPGComponent* c, int16* block)
 	struct TJPGDCHmTable* dc;
 	struct TJPGACHmTable* ac;
 	int16 s;
+#if MSROOTBITS
+	int32 e;
+#endif
 
 	dc = c->dctable;
 	ac = c->actable;
@@ -2437,14 +3245,14 @@ decodeblock(struct TJPGRPblc* jpgr, struct TJPGComponent* c, int16* block)
 	bb = PRVT->bbuffer;
 	bc = PRVT->bbcount;
 	r = 0;
+	m = 0;
 
 	/* sets the cofficients to zero */
 	ctb_memset(block, 0, 64 * sizeof(block[0]));
 
 	/* DC cofficient decoding */
 	if (bc < 16) {
-		bb = fillbbuffer(jpgr, bb);
-		bc += BBFILLBITS;
+		bb = fillbbuffer(jpgr, bb, &bc);
 	}
 	s = decodesymbol((void*) dc, GETBITS(bb, bc, 16));
 	if (CTB_UNLIKELY(s == 0)) {
@@ -2459,8 +3267,7 @@ decodeblock(struct TJPGRPblc* jpgr, struct TJPGComponent* c, int16* block)
 
 	symbol = GETSYMBOL(s);
 	if (bc < 16) {
-		bb = fillbbuffer(jpgr, bb);
-		bc += BBFILLBITS;
+		bb = fillbbuffer(jpgr, bb, &bc);
 	}
 	c->cofficient += extend(symbol, GETBITS(bb, bc, symbol));
 	block[0] = (int16) c->cofficient;
@@ -2471,10 +3278,50 @@ decodeblock(struct TJPGRPblc* jpgr, struct TJPGComponent* c, int16* block)
 	/* AC cofficients decoding */
 	for (i = 1; i < 64; i++) {
 		if (bc < 16) {
-			bb = fillbbuffer(jpgr, bb);
-			bc += BBFILLBITS;
-		}
+			bb = fillbbuffer(jpgr, bb, &bc);
+		}
+
+#if MSROOTBITS
+		/* fast decoding for up to two run-length + extended value */
+		e = ac->msymbols[GETBITS(bb, bc, MSROOTBITS)];
+		if (CTB_LIKELY(e != 0)) {
+			length = e & 0x0f;
+			if (CTB_UNLIKELY((int8) (e >> 16) == 0)) {
+				/* end of block */
+				DROPBITS(bb, bc, length);
+				r += length;
+				break;
+			}
+
+			/* this can't be out of range now, that is why we extended
+			 * zzorder by 32 */
+			i += (e >> 8) & 0x0f;
+			block[zzorder[i]] = (int8) (e >> 16);
+			m |= zzorder[i];
+
+			if (((e >> 4) & 0x0f) != length) {
+				if (CTB_UNLIKELY(i >= 63)) {
+					/* the next symbol belongs to the next block */
+					length = (e >> 4) & 0x0f;
+				}
+				else {
+					if ((e >> 24) == 0) {
+						/* end of block */
+						DROPBITS(bb, bc, length);
+						r += length;
+						break;
+					}
 
+					i += ((e >> 12) & 0x0f) + 1;
+					block[zzorder[i]] = (int16) (e >> 24);
+					m |= zzorder[i];
+				}
+			}
+			DROPBITS(bb, bc, length);
+			r += length;
+			continue;
+		}
+#else
 		/* fast decoding for run-length + extended value */
 		s = ac->sextent[GETBITS(bb, bc, ROOTBITS)];
 		if (CTB_LIKELY(s != 0)) {
@@ -2482,12 +3329,14 @@ decodeblock(struct TJPGRPblc* jpgr, struct TJPGComponent* c, int16* block)
 			 * zzorder by 16 */
 			i += (s >> 4) & 0x0f;
 			block[zzorder[i]] = s >> 8;
+			m |= zzorder[i];
 
 			length = s & 0x0f;
 			DROPBITS(bb, bc, length);
 			r += length;
 			continue;
 		}
+#endif
 
 		s = decodesymbol(ac, GETBITS(bb, bc, 16));
 		if (CTB_UNLIKELY(s == 0)) {
@@ -2512,8 +3361,7 @@ decodeblock(struct TJPGRPblc* jpgr, struct TJPGComponent* c, int16* block)
 
 			if (CTB_UNLIKELY(i >= 64)) {
 				if (bc < 16) {
-					bb = fillbbuffer(jpgr, bb);
-					bc += BBFILLBITS;
+					bb = fillbbuffer(jpgr, bb, &bc);
 				}
 
 				DROPBITS(bb, bc, symbol);
@@ -2523,15 +3371,17 @@ decodeblock(struct TJPGRPblc* jpgr, struct TJPGComponent* c, int16* block)
 		}
 
 		if (bc < 16) {
-			bb = fillbbuffer(jpgr, bb);
-			bc += BBFILLBITS;
+			bb = fillbbuffer(jpgr, bb, &bc);
 		}
 		block[zzorder[i]] = (int16) extend(symbol, GETBITS(bb, bc, symbol));
+		m |= zzorder[i];
 
 		DROPBITS(bb, bc, symbol);
 		r += symbol;
 	}
 
+	c->bmask = m;
+
 	/* restore the state and check for bit overread */
 	PRVT->bbuffer = bb;
 	PRVT->bbcount = bc;
@@ -2572,12 +3422,6 @@ decodeblock(struct TJPGRPblc* jpgr, struct TJPGComponent* c, int16* block)
 
 #endif
 
-#if defined(JPGR_CFG_EXTERNALASM)
-
-extern void jpgr_inverseDCTASM(int16*, int16*, int16*);
-
-#else
-
 /* constant values scaled to (2**13) */
 #define C6xSQRT2  4433
 #define S6xSQRT2 10703
@@ -2773,26 +3617,354 @@ inverseDCT(int16* sblock, int16* rblock, int16* qtable)
 		y5 += z2 + z4;
 		y7 += z1 + z3;
 
-		/* last stage */
-		/* 13 bits + 4 bits (1 bit prev pass + 3 current pass) */
-		rblock[0 * 8] = ((l0 + l7) + 65536) >> 17;
-		rblock[7 * 8] = ((l0 - l7) + 65536) >> 17;
-		rblock[1 * 8] = ((l1 + l6) + 65536) >> 17;
-		rblock[6 * 8] = ((l1 - l6) + 65536) >> 17;
-		rblock[2 * 8] = ((l2 + l5) + 65536) >> 17;
-		rblock[5 * 8] = ((l2 - l5) + 65536) >> 17;
-		rblock[3 * 8] = ((l3 + l4) + 65536) >> 17;
-		rblock[4 * 8] = ((l3 - l4) + 65536) >> 17;
-		rr++;
-		rblock++;
+		/* last stage */
+		/* 13 bits + 4 bits (1 bit prev pass + 3 current pass) */
+		rblock[0 * 8] = ((l0 + l7) + 65536) >> 17;
+		rblock[7 * 8] = ((l0 - l7) + 65536) >> 17;
+		rblock[1 * 8] = ((l1 + l6) + 65536) >> 17;
+		rblock[6 * 8] = ((l1 - l6) + 65536) >> 17;
+		rblock[2 * 8] = ((l2 + l5) + 65536) >> 17;
+		rblock[5 * 8] = ((l2 - l5) + 65536) >> 17;
+		rblock[3 * 8] = ((l3 + l4) + 65536) >> 17;
+		rblock[4 * 8] = ((l3 - l4) + 65536) >> 17;
+		rr++;
+		rblock++;
+	}
+#undef y7
+#undef y5
+#undef y3
+#undef y1
+}
+
+
+/* Sparse versions of the inverse DCT, used when the decoded block only has
+ * cofficients in its top-left corner (most chroma blocks). The zero terms
+ * are removed from the transform above, the result is the same. */
+
+/* only the DC cofficient */
+static void
+inverseDCT1(int16* sblock, int16* rblock, int16* qtable)
+{
+	int32 a;
+	uintxx i;
+
+	/* both passes reduce to (dc * 2 + 8) >> 4 */
+	a = (int16) (sblock[0] * qtable[0]);
+	a = (a + 4) >> 3;
+	for (i = 0; i < 64; i++) {
+		rblock[i] = (int16) a;
+	}
+}
+
+/* 2x2 cofficients */
+static void
+inverseDCT2(int16* sblock, int16* rblock, int16* qtable)
+{
+	int32 l0;
+	int32 y1;
+	int32 o1, o3, o5, o7;
+	int16 r[16];
+	int16* rr;
+	uintxx i;
+
+	/* with only y0 and y1 the odd part is y1 times the sums of the
+	 * constants of each path */
+	rr = r;
+	for (i = 0; i < 2; i++) {
+		l0 = (int16) (sblock[0 * 8] * qtable[0 * 8]);
+		y1 = (int16) (sblock[1 * 8] * qtable[1 * 8]);
+
+		l0 = l0 << 13;
+		o1 = y1 * (D + E + H + I);
+		o3 = y1 * I;
+		o5 = y1 * (H + I);
+		o7 = y1 * (E + I);
+		rr[0] = (int16) (((l0 + o1) + 2048) >> 12);
+		rr[7] = (int16) (((l0 - o1) + 2048) >> 12);
+		rr[1] = (int16) (((l0 + o3) + 2048) >> 12);
+		rr[6] = (int16) (((l0 - o3) + 2048) >> 12);
+		rr[2] = (int16) (((l0 + o5) + 2048) >> 12);
+		rr[5] = (int16) (((l0 - o5) + 2048) >> 12);
+		rr[3] = (int16) (((l0 + o7) + 2048) >> 12);
+		rr[4] = (int16) (((l0 - o7) + 2048) >> 12);
+		qtable++;
+		sblock++;
+		rr += 8;
+	}
+
+	rr = r;
+	for (i = 0; i < 8; i++) {
+		l0 = rr[0 * 8];
+		y1 = rr[1 * 8];
+
+		l0 = l0 << 13;
+		o1 = y1 * (D + E + H + I);
+		o3 = y1 * I;
+		o5 = y1 * (H + I);
+		o7 = y1 * (E + I);
+		rblock[0 * 8] = ((l0 + o1) + 65536) >> 17;
+		rblock[7 * 8] = ((l0 - o1) + 65536) >> 17;
+		rblock[1 * 8] = ((l0 + o3) + 65536) >> 17;
+		rblock[6 * 8] = ((l0 - o3) + 65536) >> 17;
+		rblock[2 * 8] = ((l0 + o5) + 65536) >> 17;
+		rblock[5 * 8] = ((l0 - o5) + 65536) >> 17;
+		rblock[3 * 8] = ((l0 + o7) + 65536) >> 17;
+		rblock[4 * 8] = ((l0 - o7) + 65536) >> 17;
+		rr++;
+		rblock++;
+	}
+}
+
+/* 4x4 cofficients */
+static void
+inverseDCT4(int16* sblock, int16* rblock, int16* qtable)
+{
+	int32 l0;
+	int32 l1;
+	int32 l2;
+	int32 l3;
+	int32 y1;
+	int32 y3;
+	int32 y5;
+	int32 y7;
+	int32 z0, z1, z2, z3, z4, z5;
+	int16 r[32];
+	int16* rr;
+	uintxx i;
+
+	rr = r;
+	for (i = 0; i < 4; i++) {
+		l0 = (int16) (sblock[0 * 8] * qtable[0 * 8]);
+		l2 = (int16) (sblock[2 * 8] * qtable[2 * 8]);
+		y3 = (int16) (sblock[3 * 8] * qtable[3 * 8]);
+		y1 = (int16) (sblock[1 * 8] * qtable[1 * 8]);
+
+		/* even part (y4 and y6 are zero) */
+		z0 = l0 << 13;
+		z2 = l2 * -C6xSQRT2;
+		z3 = l2 *  S6xSQRT2;
+		l0 = z0 + z3;
+		l1 = z0 - z2;
+		l2 = z0 + z2;
+		l3 = z0 - z3;
+
+		/* odd part (y5 and y7 are zero) */
+		z5 = (y1 + y3) * I;
+		z1 = y1 * E;
+		z2 = y3 * F;
+		z3 = y3 * G + z5;
+		z4 = y1 * H + z5;
+		y7 = z1 + z3;
+		y5 = z2 + z4;
+		y3 = y3 * C + z2 + z3;
+		y1 = y1 * D + z1 + z4;
+
+		rr[0] = (int16) (((l0 + y1) + 2048) >> 12);
+		rr[7] = (int16) (((l0 - y1) + 2048) >> 12);
+		rr[1] = (int16) (((l1 + y3) + 2048) >> 12);
+		rr[6] = (int16) (((l1 - y3) + 2048) >> 12);
+		rr[2] = (int16) (((l2 + y5) + 2048) >> 12);
+		rr[5] = (int16) (((l2 - y5) + 2048) >> 12);
+		rr[3] = (int16) (((l3 + y7) + 2048) >> 12);
+		rr[4] = (int16) (((l3 - y7) + 2048) >> 12);
+		qtable++;
+		sblock++;
+		rr += 8;
+	}
+
+	rr = r;
+	for (i = 0; i < 8; i++) {
+		l0 = rr[0 * 8];
+		l2 = rr[2 * 8];
+		y3 = rr[3 * 8];
+		y1 = rr[1 * 8];
+
+		z0 = l0 << 13;
+		z2 = l2 * -C6xSQRT2;
+		z3 = l2 *  S6xSQRT2;
+		l0 = z0 + z3;
+		l1 = z0 - z2;
+		l2 = z0 + z2;
+		l3 = z0 - z3;
+
+		z5 = (y1 + y3) * I;
+		z1 = y1 * E;
+		z2 = y3 * F;
+		z3 = y3 * G + z5;
+		z4 = y1 * H + z5;
+		y7 = z1 + z3;
+		y5 = z2 + z4;
+		y3 = y3 * C + z2 + z3;
+		y1 = y1 * D + z1 + z4;
+
+		rblock[0 * 8] = ((l0 + y1) + 65536) >> 17;
+		rblock[7 * 8] = ((l0 - y1) + 65536) >> 17;
+		rblock[1 * 8] = ((l1 + y3) + 65536) >> 17;
+		rblock[6 * 8] = ((l1 - y3) + 65536) >> 17;
+		rblock[2 * 8] = ((l2 + y5) + 65536) >> 17;
+		rblock[5 * 8] = ((l2 - y5) + 65536) >> 17;
+		rblock[3 * 8] = ((l3 + y7) + 65536) >> 17;
+		rblock[4 * 8] = ((l3 - y7) + 65536) >> 17;
+		rr++;
+		rblock++;
+	}
+}
+
+
+/* Reduced size inverse DCT (used to decode the image at a reduced scale),
+ * only the low frequency coefficients are used and the result keeps the
+ * stride of 8 values. The constants are C(u) / 2 * cos((2x + 1) * u * pi / 2n)
+ * scaled to (2**13), multiplied by the mean of the basis function over the
+ * 8 / n pixels each output value covers (so each value is the average of
+ * the pixels of the complete transform). */
+static const int16 reducedk8[] = {
+	2896,  4017,  3784,  3406,  2896,  2276,  1567,   799,
+	2896,  3406,  1567,  -799, -2896, -4017, -3784, -2276,
+	2896,  2276, -1567, -4017, -2896,   799,  3784,  3406,
+	2896,   799, -3784, -2276,  2896,  3406, -1567, -4017,
+	2896,  -799, -3784,  2276,  2896, -3406, -1567,  4017,
+	2896, -2276, -1567,  4017, -2896,  -799,  3784, -3406,
+	2896, -3406,  1567,   799, -2896,  4017, -3784,  2276,
+	2896, -4017,  3784, -3406,  2896, -2276,  1567,  -799
+};
+
+static const int16 reducedk4[] = {
+	2896,  3711,  2676,  1303,
+	2896,  1537, -2676, -3146,
+	2896, -1537, -2676,  3146,
+	2896, -3711,  2676, -1303
+};
+
+static const int16 reducedk2[] = {
+	2896,  2624,
+	2896, -2624
+};
+
+static const int16 reducedk1[] = {
+	2896
+};
+
+CTB_INLINE const int16*
+getreducedk(uintxx n)
+{
+	switch (n) {
+		case 8: return reducedk8;
+		case 4: return reducedk4;
+		case 2: return reducedk2;
+	}
+	return reducedk1;
+}
+
+/* 4x4 case (the luma of 1/2 scale), same result as the generic version but
+ * using the symmetry of the constants */
+static void
+reducedDCT4(int16* sblock, int16* rblock, int16* qtable)
+{
+	int16 t[16];
+	uintxx i;
+	int32 r0, r1, r2, r3;
+	int32 e0, e1;
+	int32 o0, o1;
+
+	/* horizontal */
+	for (i = 0; i < 4; i++) {
+		r0 = (int16) (sblock[0 * 8 + i] * qtable[0 * 8 + i]);
+		r1 = (int16) (sblock[1 * 8 + i] * qtable[1 * 8 + i]);
+		r2 = (int16) (sblock[2 * 8 + i] * qtable[2 * 8 + i]);
+		r3 = (int16) (sblock[3 * 8 + i] * qtable[3 * 8 + i]);
+
+		e0 = 2896 * r0 + 2676 * r2;
+		e1 = 2896 * r0 - 2676 * r2;
+		o0 = 3711 * r1 + 1303 * r3;
+		o1 = 1537 * r1 - 3146 * r3;
+		t[0 * 4 + i] = (int16) ((e0 + o0 + 512) >> 10);
+		t[1 * 4 + i] = (int16) ((e1 + o1 + 512) >> 10);
+		t[2 * 4 + i] = (int16) ((e1 - o1 + 512) >> 10);
+		t[3 * 4 + i] = (int16) ((e0 - o0 + 512) >> 10);
+	}
+
+	/* vertical */
+	for (i = 0; i < 4; i++) {
+		r0 = t[i * 4 + 0];
+		r1 = t[i * 4 + 1];
+		r2 = t[i * 4 + 2];
+		r3 = t[i * 4 + 3];
+
+		e0 = 2896 * r0 + 2676 * r2;
+		e1 = 2896 * r0 - 2676 * r2;
+		o0 = 3711 * r1 + 1303 * r3;
+		o1 = 1537 * r1 - 3146 * r3;
+		rblock[0 * 8 + i] = (int16) ((e0 + o0 + 32768) >> 16);
+		rblock[1 * 8 + i] = (int16) ((e1 + o1 + 32768) >> 16);
+		rblock[2 * 8 + i] = (int16) ((e1 - o1 + 32768) >> 16);
+		rblock[3 * 8 + i] = (int16) ((e0 - o0 + 32768) >> 16);
+	}
+}
+
+/* the output is a block of sizey rows and sizex columns (one of them can be
+ * 8, but not both) */
+static void
+reducedDCT(int16* sblock, int16* rblock, int16* qtable, uintxx sizey,
+	uintxx sizex)
+{
+	const int16* ky;
+	const int16* kx;
+	int16 r[64];
+	int16 t[64];
+	uintxx i;
+	uintxx j;
+	uintxx u;
+
+	if (sizey == 1 && sizex == 1) {
+		int32 a;
+
+		/* same result as the DC only case of the complete transform */
+		a = (int16) (sblock[0] * qtable[0]);
+		rblock[0] = (int16) ((a + 4) >> 3);
+		return;
+	}
+	if (sizey == 4 && sizex == 4) {
+		reducedDCT4(sblock, rblock, qtable);
+		return;
+	}
+	ky = getreducedk(sizey);
+	kx = getreducedk(sizex);
+
+	/* dequantize, as in the complete transform the first index of the
+	 * block is the horizontal frequency */
+	for (i = 0; i < sizex; i++) {
+		for (j = 0; j < sizey; j++) {
+			r[i * sizey + j] = (int16) (sblock[i * 8 + j] * qtable[i * 8 + j]);
+		}
+	}
+
+	/* horizontal, keep 3 bits of precision */
+	for (i = 0; i < sizex; i++) {
+		for (j = 0; j < sizey; j++) {
+			int32 a;
+
+			a = 0;
+			for (u = 0; u < sizex; u++) {
+				a += kx[i * sizex + u] * r[u * sizey + j];
+			}
+			t[i * sizey + j] = (int16) ((a + 512) >> 10);
+		}
+	}
+
+	/* vertical */
+	for (i = 0; i < sizex; i++) {
+		for (j = 0; j < sizey; j++) {
+			int32 a;
+
+			a = 0;
+			for (u = 0; u < sizey; u++) {
+				a += ky[j * sizey + u] * t[i * sizey + u];
+			}
+			rblock[j * 8 + i] = (int16) ((a + 32768) >> 16);
+		}
 	}
-#undef y7
-#undef y5
-#undef y3
-#undef y1
 }
 
-#endif
 
 /*
  * We use the formula from the specification (CCIR 601 (256 levels)).
@@ -2876,24 +4048,18 @@ tograyscale(int16 v)
 }
 
 
-#if defined(JPGR_CFG_EXTERNALASM)
-
-extern void jpgr_setrow3ASM(int16*, int16*, int16*, uint8*, uintxx);
-extern void jpgr_setrow1ASM(int16*, uint8*);
-extern void jpgr_upsamplerowASM(int16*, int16*, uintxx);
-
-#else
-
-CTB_INLINE void
-setrow3(int16* r1, int16* r2, int16* r3, uint8* row, uintxx transform)
+/* converts n pixels of a row */
+static void
+setrow3(int16* r1, int16* r2, int16* r3, uint8* row, uintxx n,
+	uintxx transform)
 {
 	int32 r;
 	int32 g;
 	int32 b;
-	intxx i;
+	uintxx i;
 
 	if (CTB_LIKELY(transform)) {
-		for (i = 0; i < 8; i++, row += 3) {
+		for (i = 0; i < n; i++, row += 3) {
 			int32 m;
 			r = r3[i] *  FIXED_1_402;
 			g = r2[i] * -FIXED_0_344 + r3[i] * -FIXED_0_714;
@@ -2930,7 +4096,7 @@ setrow3(int16* r1, int16* r2, int16* r3, uint8* row, uintxx transform)
 		return;
 	}
 
-	for (i = 0; i < 8; i++, row += 3) {
+	for (i = 0; i < n; i++, row += 3) {
 		r = r1[i] + 128;
 		g = r2[i] + 128;
 		b = r3[i] + 128;
@@ -2959,272 +4125,1303 @@ setrow3(int16* r1, int16* r2, int16* r3, uint8* row, uintxx transform)
 	}
 }
 
-CTB_INLINE void
-setrow1(int16* r1, uint8* row)
+/* byte offsets of r, g, b and the fourth byte for each 4 byte layout */
+static const uint8 layoutoffsets[][4] = {
+	{0, 1, 2, 3},  /* RGBA */
+	{2, 1, 0, 3},  /* BGRA */
+	{0, 1, 2, 3},  /* RGBX */
+	{1, 2, 3, 0}   /* XRGB */
+};
+
+/* converts n pixels of a row to a 4 byte layout (see SETROW4MODE) */
+static void
+setrow4(int16* r1, int16* r2, int16* r3, uint8* row, uintxx n, uintxx mode)
+{
+	uintxx i;
+	uint8 alpha;
+	const uint8* o;
+
+	o = layoutoffsets[((mode >> 1) & 0x07) - 1];
+	alpha = (uint8) (mode >> 8);
+	for (i = 0; i < n; i++, row += 4) {
+		struct TJPGRGB p;
+
+		p = toRGB(r1[i], r2[i], r3[i], mode & 1);
+		row[o[0]] = p.r;
+		row[o[1]] = p.g;
+		row[o[2]] = p.b;
+		row[o[3]] = alpha;
+	}
+}
+
+static void
+setrow1(int16* r1, uint8* row)
+{
+	uintxx i;
+
+	for (i = 0; i < 8; i++, row++) {
+		int16 r;
+
+		r = r1[i] + 128;
+		if ((uint16) r > 255) {
+			if (r > 255)
+				r = 255;
+			else
+				r = 0;
+		}
+		row[0] = (uint8) r;
+	}
+}
+
+/* sets n values of the upsampled row, each source value is repeated ratio
+ * times (2 or 4) */
+static void
+upsamplerow(int16* row, int16* target, uintxx n, uintxx ratio)
+{
+	uintxx i;
+
+	if (ratio == 2) {
+		for (i = 0; i < n; i++) {
+			target[i] = row[i >> 1];
+		}
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		target[i] = row[i >> 2];
+	}
+}
+
+
+#if DOSSE2
+
+/* SSE2 versions of the decoding kernels, they produce the same output as
+ * the scalar functions */
+
+CTB_INLINE __m128i
+setpair(int16 a, int16 b)
+{
+	return _mm_set_epi16(b, a, b, a, b, a, b, a);
+}
+
+/* 1-D inverse DCT of four columns, the pairs are the interleaved
+ * coefficients (l0 l1), (l2 l3), (y1 y7), (y3 y5) and (z3 z4) */
+CTB_INLINE void
+idctcolumns(__m128i* p, __m128i* r)
+{
+	__m128i z0, z1, z2, z3;
+	__m128i t1, t2;
+	__m128i o1, o3, o5, o7;
+
+	/* even part */
+	z0 = _mm_madd_epi16(p[0], setpair(8192,  8192));
+	z1 = _mm_madd_epi16(p[0], setpair(8192, -8192));
+	z2 = _mm_madd_epi16(p[1], setpair(-C6xSQRT2, S6xSQRT2));
+	z3 = _mm_madd_epi16(p[1], setpair( S6xSQRT2, C6xSQRT2));
+
+	/* odd part, the products of the scalar version are merged into
+	 * pairs with the same result */
+	t1 = _mm_madd_epi16(p[4], setpair(I, H + I));
+	t2 = _mm_madd_epi16(p[4], setpair(G + I, I));
+	o1 = _mm_add_epi32(_mm_madd_epi16(p[2], setpair(D + E, E)), t1);
+	o7 = _mm_add_epi32(_mm_madd_epi16(p[2], setpair(E, A + E)), t2);
+	o3 = _mm_add_epi32(_mm_madd_epi16(p[3], setpair(C + F, F)), t2);
+	o5 = _mm_add_epi32(_mm_madd_epi16(p[3], setpair(F, B + F)), t1);
+
+	/* last stage */
+	t1 = _mm_add_epi32(z0, z3);
+	t2 = _mm_sub_epi32(z0, z3);
+	r[0] = _mm_add_epi32(t1, o1);
+	r[7] = _mm_sub_epi32(t1, o1);
+	r[3] = _mm_add_epi32(t2, o7);
+	r[4] = _mm_sub_epi32(t2, o7);
+
+	t1 = _mm_sub_epi32(z1, z2);
+	t2 = _mm_add_epi32(z1, z2);
+	r[1] = _mm_add_epi32(t1, o3);
+	r[6] = _mm_sub_epi32(t1, o3);
+	r[2] = _mm_add_epi32(t2, o5);
+	r[5] = _mm_sub_epi32(t2, o5);
+}
+
+/* one pass over the 8 rows, the columns are processed in parallel */
+CTB_INLINE void
+idctpass(__m128i* v, uintxx pass)
+{
+	__m128i p1[5];
+	__m128i p2[5];
+	__m128i r1[8];
+	__m128i r2[8];
+	__m128i z3;
+	__m128i z4;
+	__m128i k;
+	uintxx i;
+
+	/* the sums are truncated to 16 bits as in the scalar version */
+	z3 = _mm_add_epi16(v[7], v[3]);
+	z4 = _mm_add_epi16(v[5], v[1]);
+
+	p1[0] = _mm_unpacklo_epi16(v[0], v[4]);
+	p2[0] = _mm_unpackhi_epi16(v[0], v[4]);
+	p1[1] = _mm_unpacklo_epi16(v[2], v[6]);
+	p2[1] = _mm_unpackhi_epi16(v[2], v[6]);
+	p1[2] = _mm_unpacklo_epi16(v[1], v[7]);
+	p2[2] = _mm_unpackhi_epi16(v[1], v[7]);
+	p1[3] = _mm_unpacklo_epi16(v[3], v[5]);
+	p2[3] = _mm_unpackhi_epi16(v[3], v[5]);
+	p1[4] = _mm_unpacklo_epi16(z3, z4);
+	p2[4] = _mm_unpackhi_epi16(z3, z4);
+	idctcolumns(p1, r1);
+	idctcolumns(p2, r2);
+
+	if (pass == 0) {
+		/* keep 1 bit of precision, plus 3 (scaled by 8), the result is
+		 * truncated to 16 bits */
+		k = _mm_set1_epi32(2048);
+		for (i = 0; i < 8; i++) {
+			r1[i] = _mm_slli_epi32(_mm_add_epi32(r1[i], k), 4);
+			r2[i] = _mm_slli_epi32(_mm_add_epi32(r2[i], k), 4);
+			r1[i] = _mm_srai_epi32(r1[i], 16);
+			r2[i] = _mm_srai_epi32(r2[i], 16);
+			v[i] = _mm_packs_epi32(r1[i], r2[i]);
+		}
+		return;
+	}
+
+	k = _mm_set1_epi32(65536);
+	for (i = 0; i < 8; i++) {
+		r1[i] = _mm_srai_epi32(_mm_add_epi32(r1[i], k), 17);
+		r2[i] = _mm_srai_epi32(_mm_add_epi32(r2[i], k), 17);
+		v[i] = _mm_packs_epi32(r1[i], r2[i]);
+	}
+}
+
+CTB_INLINE void
+transpose8x8(__m128i* v)
+{
+	__m128i a0, a1, a2, a3, a4, a5, a6, a7;
+	__m128i b0, b1, b2, b3, b4, b5, b6, b7;
+
+	a0 = _mm_unpacklo_epi16(v[0], v[1]);
+	a1 = _mm_unpackhi_epi16(v[0], v[1]);
+	a2 = _mm_unpacklo_epi16(v[2], v[3]);
+	a3 = _mm_unpackhi_epi16(v[2], v[3]);
+	a4 = _mm_unpacklo_epi16(v[4], v[5]);
+	a5 = _mm_unpackhi_epi16(v[4], v[5]);
+	a6 = _mm_unpacklo_epi16(v[6], v[7]);
+	a7 = _mm_unpackhi_epi16(v[6], v[7]);
+
+	b0 = _mm_unpacklo_epi32(a0, a2);
+	b1 = _mm_unpackhi_epi32(a0, a2);
+	b2 = _mm_unpacklo_epi32(a1, a3);
+	b3 = _mm_unpackhi_epi32(a1, a3);
+	b4 = _mm_unpacklo_epi32(a4, a6);
+	b5 = _mm_unpackhi_epi32(a4, a6);
+	b6 = _mm_unpacklo_epi32(a5, a7);
+	b7 = _mm_unpackhi_epi32(a5, a7);
+
+	v[0] = _mm_unpacklo_epi64(b0, b4);
+	v[1] = _mm_unpackhi_epi64(b0, b4);
+	v[2] = _mm_unpacklo_epi64(b1, b5);
+	v[3] = _mm_unpackhi_epi64(b1, b5);
+	v[4] = _mm_unpacklo_epi64(b2, b6);
+	v[5] = _mm_unpackhi_epi64(b2, b6);
+	v[6] = _mm_unpacklo_epi64(b3, b7);
+	v[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+static void
+inverseDCTSSE2(int16* sblock, int16* rblock, int16* qtable)
+{
+	__m128i v[8];
+	uintxx i;
+
+	/* dequantize */
+	for (i = 0; i < 8; i++) {
+		__m128i s;
+		__m128i q;
+
+		s = _mm_loadu_si128((__m128i*) (sblock + (i << 3)));
+		q = _mm_loadu_si128((__m128i*) (qtable + (i << 3)));
+		v[i] = _mm_mullo_epi16(s, q);
+	}
+
+	idctpass(v, 0);
+	transpose8x8(v);
+	idctpass(v, 1);
+
+	for (i = 0; i < 8; i++) {
+		_mm_storeu_si128((__m128i*) (rblock + (i << 3)), v[i]);
+	}
+}
+
+/* packs 8 pixels to 24 bytes, the values must be in the [0, 255] range */
+CTB_INLINE void
+storergb(uint8* row, __m128i r, __m128i g, __m128i b)
+{
+	__m128i rg;
+	__m128i bz;
+	__m128i p1;
+	__m128i p2;
+	__m128i m1;
+	__m128i m2;
+
+	rg = _mm_packus_epi16(r, g);
+	rg = _mm_unpacklo_epi8(rg, _mm_srli_si128(rg, 8));
+	bz = _mm_packus_epi16(b, _mm_setzero_si128());
+	bz = _mm_unpacklo_epi8(bz, _mm_setzero_si128());
+
+	/* 4 pixels per register, one byte of padding each */
+	p1 = _mm_unpacklo_epi16(rg, bz);
+	p2 = _mm_unpackhi_epi16(rg, bz);
+
+	/* remove the padding */
+	m1 = _mm_set_epi32(0, 0x00ffffff, 0, 0x00ffffff);
+	m2 = _mm_set_epi32(
+		0x0000ffff, (int32) 0xff000000, 0x0000ffff, (int32) 0xff000000);
+	p1 = _mm_or_si128(
+		_mm_and_si128(p1, m1), _mm_and_si128(_mm_srli_epi64(p1, 8), m2));
+	p2 = _mm_or_si128(
+		_mm_and_si128(p2, m1), _mm_and_si128(_mm_srli_epi64(p2, 8), m2));
+	p1 = _mm_or_si128(
+		_mm_move_epi64(p1),
+		_mm_slli_si128(_mm_unpackhi_epi64(p1, _mm_setzero_si128()), 6));
+	p2 = _mm_or_si128(
+		_mm_move_epi64(p2),
+		_mm_slli_si128(_mm_unpackhi_epi64(p2, _mm_setzero_si128()), 6));
+
+	_mm_storeu_si128((__m128i*) row, _mm_or_si128(p1, _mm_slli_si128(p2, 12)));
+	_mm_storel_epi64((__m128i*) (row + 16), _mm_srli_si128(p2, 4));
+}
+
+/* converts 8 pixels, the results are not clamped to [0, 255] (the saturated
+ * pack does it) */
+CTB_INLINE void
+torgb8SSE2(int16* r1, int16* r2, int16* r3, __m128i* v, uintxx transform)
+{
+	__m128i y;
+	__m128i cb;
+	__m128i cr;
+
+	y  = _mm_loadu_si128((__m128i*) r1);
+	cb = _mm_loadu_si128((__m128i*) r2);
+	cr = _mm_loadu_si128((__m128i*) r3);
+	if (CTB_LIKELY(transform)) {
+		__m128i m;
+		__m128i a1, a2, a3;
+		__m128i b1, b2, b3;
+		__m128i r;
+		__m128i g;
+		__m128i b;
+
+		/* + 0.5 + 128 */
+		m = _mm_set1_epi32(2048 + 524228);
+
+		a1 = _mm_unpacklo_epi16(y, cr);
+		b1 = _mm_unpackhi_epi16(y, cr);
+		a2 = _mm_madd_epi16(a1, setpair(4096, FIXED_1_402));
+		b2 = _mm_madd_epi16(b1, setpair(4096, FIXED_1_402));
+		a2 = _mm_srai_epi32(_mm_add_epi32(a2, m), 12);
+		b2 = _mm_srai_epi32(_mm_add_epi32(b2, m), 12);
+		r  = _mm_packs_epi32(a2, b2);
+
+		a1 = _mm_unpacklo_epi16(y, cb);
+		b1 = _mm_unpackhi_epi16(y, cb);
+		a2 = _mm_madd_epi16(a1, setpair(4096, FIXED_1_772));
+		b2 = _mm_madd_epi16(b1, setpair(4096, FIXED_1_772));
+		a2 = _mm_srai_epi32(_mm_add_epi32(a2, m), 12);
+		b2 = _mm_srai_epi32(_mm_add_epi32(b2, m), 12);
+		b  = _mm_packs_epi32(a2, b2);
+
+		/* y << 12 */
+		a3 = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), y), 4);
+		b3 = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), y), 4);
+		a1 = _mm_unpacklo_epi16(cb, cr);
+		b1 = _mm_unpackhi_epi16(cb, cr);
+		a2 = _mm_madd_epi16(a1, setpair(-FIXED_0_344, -FIXED_0_714));
+		b2 = _mm_madd_epi16(b1, setpair(-FIXED_0_344, -FIXED_0_714));
+		a2 = _mm_add_epi32(_mm_add_epi32(a2, a3), m);
+		b2 = _mm_add_epi32(_mm_add_epi32(b2, b3), m);
+		a2 = _mm_srai_epi32(a2, 12);
+		b2 = _mm_srai_epi32(b2, 12);
+		g  = _mm_packs_epi32(a2, b2);
+
+		v[0] = r;
+		v[1] = g;
+		v[2] = b;
+		return;
+	}
+
+	v[0] = _mm_adds_epi16(y,  _mm_set1_epi16(128));
+	v[1] = _mm_adds_epi16(cb, _mm_set1_epi16(128));
+	v[2] = _mm_adds_epi16(cr, _mm_set1_epi16(128));
+}
+
+static void
+setrow3SSE2(int16* r1, int16* r2, int16* r3, uint8* row, uintxx n,
+	uintxx transform)
+{
+	uintxx i;
+
+	__m128i v[3];
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		torgb8SSE2(r1 + i, r2 + i, r3 + i, v, transform);
+		storergb(row + i * 3, v[0], v[1], v[2]);
+	}
+	if (i < n) {
+		setrow3(r1 + i, r2 + i, r3 + i, row + i * 3, n - i, transform);
+	}
+}
+
+static void
+setrow4SSE2(int16* r1, int16* r2, int16* r3, uint8* row, uintxx n,
+	uintxx mode)
+{
+	uintxx i;
+	uintxx layout;
+	__m128i v[4];
+	__m128i a;
+	__m128i b;
+
+	layout = (mode >> 1) & 0x07;
+	v[3] = _mm_set1_epi8((int8) (mode >> 8));
+	for (i = 0; i + 8 <= n; i += 8) {
+		torgb8SSE2(r1 + i, r2 + i, r3 + i, v, mode & 1);
+		v[0] = _mm_packus_epi16(v[0], v[0]);
+		v[1] = _mm_packus_epi16(v[1], v[1]);
+		v[2] = _mm_packus_epi16(v[2], v[2]);
+
+		/* byte pairs in the layout order */
+		switch (layout) {
+			case JPGR_BGRA:
+				a = _mm_unpacklo_epi8(v[2], v[1]);
+				b = _mm_unpacklo_epi8(v[0], v[3]);
+				break;
+			case JPGR_XRGB:
+				a = _mm_unpacklo_epi8(v[3], v[0]);
+				b = _mm_unpacklo_epi8(v[1], v[2]);
+				break;
+			default:
+				a = _mm_unpacklo_epi8(v[0], v[1]);
+				b = _mm_unpacklo_epi8(v[2], v[3]);
+		}
+		_mm_storeu_si128((__m128i*) (row + i * 4 +  0),
+			_mm_unpacklo_epi16(a, b));
+		_mm_storeu_si128((__m128i*) (row + i * 4 + 16),
+			_mm_unpackhi_epi16(a, b));
+	}
+	if (i < n) {
+		setrow4(r1 + i, r2 + i, r3 + i, row + i * 4, n - i, mode);
+	}
+}
+
+static void
+setrow1SSE2(int16* r1, uint8* row)
+{
+	__m128i y;
+
+	y = _mm_loadu_si128((__m128i*) r1);
+	y = _mm_adds_epi16(y, _mm_set1_epi16(128));
+	_mm_storel_epi64((__m128i*) row, _mm_packus_epi16(y, y));
+}
+
+static void
+upsamplerowSSE2(int16* row, int16* target, uintxx n, uintxx ratio)
+{
+	uintxx i;
+	__m128i v;
+	__m128i a;
+
+	i = 0;
+	if (ratio == 2) {
+		for (; i + 16 <= n; i += 16) {
+			v = _mm_loadu_si128((__m128i*) (row + (i >> 1)));
+			_mm_storeu_si128((__m128i*) (target + i + 0),
+				_mm_unpacklo_epi16(v, v));
+			_mm_storeu_si128((__m128i*) (target + i + 8),
+				_mm_unpackhi_epi16(v, v));
+		}
+	}
+	else {
+		for (; i + 16 <= n; i += 16) {
+			v = _mm_loadl_epi64((__m128i*) (row + (i >> 2)));
+			a = _mm_unpacklo_epi16(v, v);
+			_mm_storeu_si128((__m128i*) (target + i + 0),
+				_mm_unpacklo_epi32(a, a));
+			_mm_storeu_si128((__m128i*) (target + i + 8),
+				_mm_unpackhi_epi32(a, a));
+		}
+	}
+	if (i < n) {
+		upsamplerow(row + (i / ratio), target + i, n - i, ratio);
+	}
+}
+
+#endif
+
+
+#if DOX64
+
+/* SSSE3, AVX2 and AVX-512 versions of the kernels, selected at creation
+ * when the CPU has the instruction set */
+
+/* byte shuffles that interleave 8 pixels to 24 bytes, from the packed
+ * r, g (r0-r7 g0-g7) and b (b0-b7) bytes */
+#define RGBSHUFFLE1 \
+	 0,  8, -1,  1,  9, -1,  2, 10, -1,  3, 11, -1,  4, 12, -1,  5
+#define RGBSHUFFLE2 \
+	-1, -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1
+#define RGBSHUFFLE3 \
+	13, -1,  6, 14, -1,  7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1
+#define RGBSHUFFLE4 \
+	-1,  5, -1, -1,  6, -1, -1,  7, -1, -1, -1, -1, -1, -1, -1, -1
+
+static TARGETSSSE3 void
+setrow3SSSE3(int16* r1, int16* r2, int16* r3, uint8* row, uintxx n,
+	uintxx transform)
+{
+	uintxx i;
+	__m128i v[3];
+	__m128i rg;
+	__m128i bb;
+	__m128i m[4];
+
+	m[0] = _mm_setr_epi8(RGBSHUFFLE1);
+	m[1] = _mm_setr_epi8(RGBSHUFFLE2);
+	m[2] = _mm_setr_epi8(RGBSHUFFLE3);
+	m[3] = _mm_setr_epi8(RGBSHUFFLE4);
+	for (i = 0; i + 8 <= n; i += 8) {
+		torgb8SSE2(r1 + i, r2 + i, r3 + i, v, transform);
+		rg = _mm_packus_epi16(v[0], v[1]);
+		bb = _mm_packus_epi16(v[2], v[2]);
+
+		_mm_storeu_si128((__m128i*) (row + i * 3),
+			_mm_or_si128(
+				_mm_shuffle_epi8(rg, m[0]), _mm_shuffle_epi8(bb, m[1])));
+		_mm_storel_epi64((__m128i*) (row + i * 3 + 16),
+			_mm_or_si128(
+				_mm_shuffle_epi8(rg, m[2]), _mm_shuffle_epi8(bb, m[3])));
+	}
+	if (i < n) {
+		setrow3(r1 + i, r2 + i, r3 + i, row + i * 3, n - i, transform);
+	}
+}
+
+CTB_INLINE TARGETAVX2 __m256i
+setpairAVX2(int16 a, int16 b)
+{
+	uint32 v;
+
+	v = ((uint32) (uint16) b << 16) | (uint16) a;
+	return _mm256_set1_epi32((int32) v);
+}
+
+/* same as idctcolumns, with the columns 0-3 in the low lane and the columns
+ * 4-7 in the high lane */
+CTB_INLINE TARGETAVX2 void
+idctcolumnsAVX2(__m256i* p, __m256i* r)
+{
+	__m256i z0, z1, z2, z3;
+	__m256i t1, t2;
+	__m256i o1, o3, o5, o7;
+
+	/* even part */
+	z0 = _mm256_madd_epi16(p[0], setpairAVX2(8192,  8192));
+	z1 = _mm256_madd_epi16(p[0], setpairAVX2(8192, -8192));
+	z2 = _mm256_madd_epi16(p[1], setpairAVX2(-C6xSQRT2, S6xSQRT2));
+	z3 = _mm256_madd_epi16(p[1], setpairAVX2( S6xSQRT2, C6xSQRT2));
+
+	/* odd part */
+	t1 = _mm256_madd_epi16(p[4], setpairAVX2(I, H + I));
+	t2 = _mm256_madd_epi16(p[4], setpairAVX2(G + I, I));
+	o1 = _mm256_add_epi32(_mm256_madd_epi16(p[2], setpairAVX2(D + E, E)), t1);
+	o7 = _mm256_add_epi32(_mm256_madd_epi16(p[2], setpairAVX2(E, A + E)), t2);
+	o3 = _mm256_add_epi32(_mm256_madd_epi16(p[3], setpairAVX2(C + F, F)), t2);
+	o5 = _mm256_add_epi32(_mm256_madd_epi16(p[3], setpairAVX2(F, B + F)), t1);
+
+	/* last stage */
+	t1 = _mm256_add_epi32(z0, z3);
+	t2 = _mm256_sub_epi32(z0, z3);
+	r[0] = _mm256_add_epi32(t1, o1);
+	r[7] = _mm256_sub_epi32(t1, o1);
+	r[3] = _mm256_add_epi32(t2, o7);
+	r[4] = _mm256_sub_epi32(t2, o7);
+
+	t1 = _mm256_sub_epi32(z1, z2);
+	t2 = _mm256_add_epi32(z1, z2);
+	r[1] = _mm256_add_epi32(t1, o3);
+	r[6] = _mm256_sub_epi32(t1, o3);
+	r[2] = _mm256_add_epi32(t2, o5);
+	r[5] = _mm256_sub_epi32(t2, o5);
+}
+
+/* copies the values 0-3 of a row to the low lane and the values 4-7 to the
+ * high lane, so the in-lane unpacks of two rows give the pairs of the
+ * columns 0-3 and 4-7 */
+CTB_INLINE TARGETAVX2 __m256i
+spreadrow(__m128i v)
+{
+	return _mm256_permute4x64_epi64(_mm256_castsi128_si256(v), 0x50);
+}
+
+/* same as idctpass, all the columns are processed at once */
+CTB_INLINE TARGETAVX2 void
+idctpassAVX2(__m128i* v, uintxx pass)
+{
+	__m256i p[5];
+	__m256i r[8];
+	__m256i a;
+	__m256i k;
+	uintxx i;
+
+	p[0] = _mm256_unpacklo_epi16(spreadrow(v[0]), spreadrow(v[4]));
+	p[1] = _mm256_unpacklo_epi16(spreadrow(v[2]), spreadrow(v[6]));
+	p[2] = _mm256_unpacklo_epi16(spreadrow(v[1]), spreadrow(v[7]));
+	p[3] = _mm256_unpacklo_epi16(spreadrow(v[3]), spreadrow(v[5]));
+	p[4] = _mm256_unpacklo_epi16(
+		spreadrow(_mm_add_epi16(v[7], v[3])),
+		spreadrow(_mm_add_epi16(v[5], v[1])));
+	idctcolumnsAVX2(p, r);
+
+	if (pass == 0) {
+		k = _mm256_set1_epi32(2048);
+		for (i = 0; i < 8; i++) {
+			r[i] = _mm256_slli_epi32(_mm256_add_epi32(r[i], k), 4);
+			r[i] = _mm256_srai_epi32(r[i], 16);
+		}
+	}
+	else {
+		k = _mm256_set1_epi32(65536);
+		for (i = 0; i < 8; i++) {
+			r[i] = _mm256_srai_epi32(_mm256_add_epi32(r[i], k), 17);
+		}
+	}
+
+	/* two rows per pack, back to the column order */
+	for (i = 0; i < 8; i += 2) {
+		a = _mm256_packs_epi32(r[i], r[i + 1]);
+		a = _mm256_permute4x64_epi64(a, 0xd8);
+		v[i + 0] = _mm256_castsi256_si128(a);
+		v[i + 1] = _mm256_extracti128_si256(a, 1);
+	}
+}
+
+static TARGETAVX2 void
+inverseDCTAVX2(int16* sblock, int16* rblock, int16* qtable)
+{
+	__m128i v[8];
+	uintxx i;
+
+	/* dequantize */
+	for (i = 0; i < 8; i++) {
+		__m128i s;
+		__m128i q;
+
+		s = _mm_loadu_si128((__m128i*) (sblock + (i << 3)));
+		q = _mm_loadu_si128((__m128i*) (qtable + (i << 3)));
+		v[i] = _mm_mullo_epi16(s, q);
+	}
+
+	idctpassAVX2(v, 0);
+	transpose8x8(v);
+	idctpassAVX2(v, 1);
+
+	for (i = 0; i < 8; i++) {
+		_mm_storeu_si128((__m128i*) (rblock + (i << 3)), v[i]);
+	}
+}
+
+/* the AVX2 color conversion must give the same result as the other kernels
+ * of the build, the ASM ones add 0.5 + 128 with a (slightly) different
+ * constant and add the luma after the 16 bit pack */
+#if defined(JPGR_CFG_EXTERNALASM)
+	#define RGBBIAS (2048 + 524288)
+#else
+	#define RGBBIAS (2048 + 524228)
+#endif
+
+/* converts 16 pixels, the results are not clamped to [0, 255] */
+CTB_INLINE TARGETAVX2 void
+torgb16AVX2(int16* r1, int16* r2, int16* r3, __m256i* v, uintxx transform)
+{
+	__m256i y;
+	__m256i cb;
+	__m256i cr;
+	__m256i m;
+	__m256i a1, a2;
+	__m256i b1, b2;
+
+	y  = _mm256_loadu_si256((__m256i*) r1);
+	cb = _mm256_loadu_si256((__m256i*) r2);
+	cr = _mm256_loadu_si256((__m256i*) r3);
+	if (CTB_UNLIKELY(transform == 0)) {
+#if defined(JPGR_CFG_EXTERNALASM)
+		v[0] = _mm256_add_epi16(y,  _mm256_set1_epi16(128));
+		v[1] = _mm256_add_epi16(cb, _mm256_set1_epi16(128));
+		v[2] = _mm256_add_epi16(cr, _mm256_set1_epi16(128));
+#else
+		v[0] = _mm256_adds_epi16(y,  _mm256_set1_epi16(128));
+		v[1] = _mm256_adds_epi16(cb, _mm256_set1_epi16(128));
+		v[2] = _mm256_adds_epi16(cr, _mm256_set1_epi16(128));
+#endif
+		return;
+	}
+
+	m = _mm256_set1_epi32(RGBBIAS);
+
+	a1 = _mm256_unpacklo_epi16(y, cr);
+	b1 = _mm256_unpackhi_epi16(y, cr);
+	a2 = _mm256_madd_epi16(a1, setpairAVX2(4096, FIXED_1_402));
+	b2 = _mm256_madd_epi16(b1, setpairAVX2(4096, FIXED_1_402));
+	a2 = _mm256_srai_epi32(_mm256_add_epi32(a2, m), 12);
+	b2 = _mm256_srai_epi32(_mm256_add_epi32(b2, m), 12);
+	v[0] = _mm256_packs_epi32(a2, b2);
+
+	a1 = _mm256_unpacklo_epi16(y, cb);
+	b1 = _mm256_unpackhi_epi16(y, cb);
+	a2 = _mm256_madd_epi16(a1, setpairAVX2(4096, FIXED_1_772));
+	b2 = _mm256_madd_epi16(b1, setpairAVX2(4096, FIXED_1_772));
+	a2 = _mm256_srai_epi32(_mm256_add_epi32(a2, m), 12);
+	b2 = _mm256_srai_epi32(_mm256_add_epi32(b2, m), 12);
+	v[2] = _mm256_packs_epi32(a2, b2);
+
+	a1 = _mm256_unpacklo_epi16(cb, cr);
+	b1 = _mm256_unpackhi_epi16(cb, cr);
+	a2 = _mm256_madd_epi16(a1, setpairAVX2(-FIXED_0_344, -FIXED_0_714));
+	b2 = _mm256_madd_epi16(b1, setpairAVX2(-FIXED_0_344, -FIXED_0_714));
+#if defined(JPGR_CFG_EXTERNALASM)
+	a2 = _mm256_srai_epi32(_mm256_add_epi32(a2, m), 12);
+	b2 = _mm256_srai_epi32(_mm256_add_epi32(b2, m), 12);
+	v[1] = _mm256_add_epi16(_mm256_packs_epi32(a2, b2), y);
+#else
+	/* y << 12 */
+	a1 = _mm256_unpacklo_epi16(_mm256_setzero_si256(), y);
+	b1 = _mm256_unpackhi_epi16(_mm256_setzero_si256(), y);
+	a1 = _mm256_srai_epi32(a1, 4);
+	b1 = _mm256_srai_epi32(b1, 4);
+	a2 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(a2, a1), m), 12);
+	b2 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(b2, b1), m), 12);
+	v[1] = _mm256_packs_epi32(a2, b2);
+#endif
+}
+
+#undef RGBBIAS
+
+/* the last pixels (less than 16) are converted through a small buffer, so
+ * all of them use the same code */
+static TARGETAVX2 void
+setrow3AVX2(int16* r1, int16* r2, int16* r3, uint8* row, uintxx n,
+	uintxx transform)
+{
+	uintxx i;
+	__m256i v[3];
+	__m256i rg;
+	__m256i bb;
+	__m256i a;
+	__m256i b;
+	__m256i m[4];
+
+	m[0] = _mm256_broadcastsi128_si256(_mm_setr_epi8(RGBSHUFFLE1));
+	m[1] = _mm256_broadcastsi128_si256(_mm_setr_epi8(RGBSHUFFLE2));
+	m[2] = _mm256_broadcastsi128_si256(_mm_setr_epi8(RGBSHUFFLE3));
+	m[3] = _mm256_broadcastsi128_si256(_mm_setr_epi8(RGBSHUFFLE4));
+	for (i = 0; i < n; i += 16) {
+		int16 s[3][16];
+		uint8 t[48];
+		uint8* p;
+
+		p = row + i * 3;
+		if (i + 16 > n) {
+			ctb_memset(s, 0, sizeof(s));
+			ctb_memcpy(s[0], r1 + i, (n - i) * sizeof(int16));
+			ctb_memcpy(s[1], r2 + i, (n - i) * sizeof(int16));
+			ctb_memcpy(s[2], r3 + i, (n - i) * sizeof(int16));
+			torgb16AVX2(s[0], s[1], s[2], v, transform);
+			p = t;
+		}
+		else {
+			torgb16AVX2(r1 + i, r2 + i, r3 + i, v, transform);
+		}
+
+		/* the low lane has the pixels 0-7 and the high lane 8-15 */
+		rg = _mm256_packus_epi16(v[0], v[1]);
+		bb = _mm256_packus_epi16(v[2], v[2]);
+		a = _mm256_or_si256(
+			_mm256_shuffle_epi8(rg, m[0]), _mm256_shuffle_epi8(bb, m[1]));
+		b = _mm256_or_si256(
+			_mm256_shuffle_epi8(rg, m[2]), _mm256_shuffle_epi8(bb, m[3]));
+		_mm_storeu_si128((__m128i*) (p +  0), _mm256_castsi256_si128(a));
+		_mm_storel_epi64((__m128i*) (p + 16), _mm256_castsi256_si128(b));
+		_mm_storeu_si128((__m128i*) (p + 24), _mm256_extracti128_si256(a, 1));
+		_mm_storel_epi64((__m128i*) (p + 40), _mm256_extracti128_si256(b, 1));
+		if (p == t) {
+			ctb_memcpy(row + i * 3, t, (n - i) * 3);
+		}
+	}
+}
+
+static TARGETAVX2 void
+upsamplerowAVX2(int16* row, int16* target, uintxx n, uintxx ratio)
+{
+	uintxx i;
+	__m256i v;
+	__m256i a;
+	__m256i b;
+
+	i = 0;
+	if (ratio == 2) {
+		for (; i + 32 <= n; i += 32) {
+			v = _mm256_loadu_si256((__m256i*) (row + (i >> 1)));
+			a = _mm256_unpacklo_epi16(v, v);
+			b = _mm256_unpackhi_epi16(v, v);
+			_mm256_storeu_si256((__m256i*) (target + i + 0x00),
+				_mm256_permute2x128_si256(a, b, 0x20));
+			_mm256_storeu_si256((__m256i*) (target + i + 0x10),
+				_mm256_permute2x128_si256(a, b, 0x31));
+		}
+	}
+	else {
+		for (; i + 32 <= n; i += 32) {
+			v = spreadrow(_mm_loadu_si128((__m128i*) (row + (i >> 2))));
+			v = _mm256_unpacklo_epi16(v, v);
+			a = _mm256_unpacklo_epi32(v, v);
+			b = _mm256_unpackhi_epi32(v, v);
+			_mm256_storeu_si256((__m256i*) (target + i + 0x00),
+				_mm256_permute2x128_si256(a, b, 0x20));
+			_mm256_storeu_si256((__m256i*) (target + i + 0x10),
+				_mm256_permute2x128_si256(a, b, 0x31));
+		}
+	}
+	if (i < n) {
+		upsamplerowSSE2(row + (i / ratio), target + i, n - i, ratio);
+	}
+}
+
+/* source index of each target value, shifted by 1 or 2 for the ratio */
+static const uint16 upsampleindex[32] = {
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+	16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31
+};
+
+static TARGETAVX512 void
+upsamplerowAVX512(int16* row, int16* target, uintxx n, uintxx ratio)
+{
+	uintxx i;
+	uintxx shift;
+	__m512i index;
+	__m512i v;
+	__mmask32 mask;
+
+	shift = ratio >> 1;
+
+	/* only the values used by a step are loaded */
+	mask  = (__mmask32) (0xffffu >> (shift - 1) * 8);
+	index = _mm512_loadu_si512((void*) upsampleindex);
+	index = _mm512_srli_epi16(index, (int) shift);
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm512_maskz_loadu_epi16(mask, row + (i >> shift));
+		_mm512_storeu_si512((void*) (target + i),
+			_mm512_permutexvar_epi16(index, v));
+	}
+	if (i < n) {
+		upsamplerowSSE2(row + (i / ratio), target + i, n - i, ratio);
+	}
+}
+
+#undef RGBSHUFFLE1
+#undef RGBSHUFFLE2
+#undef RGBSHUFFLE3
+#undef RGBSHUFFLE4
+
+#endif
+
+
+#if defined(JPGR_CFG_EXTERNALASM)
+
+extern void jpgr_initASM(void);
+
+extern void jpgr_inverseDCTASM(int16*, int16*, int16*);
+extern void jpgr_setrow3ASM(int16*, int16*, int16*, uint8*, uintxx);
+extern void jpgr_setrow1ASM(int16*, uint8*);
+extern void jpgr_setrow4ASM(int16*, int16*, int16*, uint8*, uintxx);
+extern void jpgr_upsamplerowASM(int16*, int16*, uintxx, uintxx);
+
+typedef void (*TJPGRowASMFn)(int16*, int16*, int16*, uint8*, uintxx);
+
+/* the ASM kernels convert 8 pixels and the source rows must be aligned to
+ * 16 bytes, unaligned or incomplete groups go through a temporal buffer so
+ * all the pixels are converted by the same code (the result must not depend
+ * on how the rows are split) */
+static void
+setrowASM(TJPGRowASMFn fn, int16* r[3], uint8* row, uintxx n, uintxx mode,
+	uintxx pelsize)
 {
 	uintxx i;
+	uintxx j;
+	uintxx m;
+	int16 buffer[8 * 3 + 8];
+	uint8 pixels[8 * 4];
+	int16* t;
+
+	t = (int16*) (((uintxx) buffer + 15) & ~((uintxx) 15));
+	for (i = 0; i < n; i += 8) {
+		m = n - i;
+		if (m >= 8) {
+			uintxx a;
+
+			a  = (uintxx) (r[0] + i);
+			a |= (uintxx) (r[1] + i);
+			a |= (uintxx) (r[2] + i);
+			if ((a & 15) == 0) {
+				fn(r[0] + i, r[1] + i, r[2] + i, row + i * pelsize, mode);
+				continue;
+			}
+			m = 8;
+		}
 
-	for (i = 0; i < 8; i++, row++) {
-		int16 r;
-
-		r = r1[i] + 128;
-		if ((uint16) r > 255) {
-			if (r > 255)
-				r = 255;
-			else
-				r = 0;
+		for (j = 0; j < 8; j++) {
+			if (j < m) {
+				t[j +  0] = r[0][i + j];
+				t[j +  8] = r[1][i + j];
+				t[j + 16] = r[2][i + j];
+				continue;
+			}
+			t[j +  0] = t[j +  8] = t[j + 16] = 0;
 		}
-		row[0] = (uint8) r;
+		fn(t, t + 8, t + 16, pixels, mode);
+		ctb_memcpy(row + i * pelsize, pixels, m * pelsize);
 	}
 }
 
+static void
+setrow3ASM(int16* r1, int16* r2, int16* r3, uint8* row, uintxx n,
+	uintxx transform)
+{
+	int16* r[3];
+
+	r[0] = r1;
+	r[1] = r2;
+	r[2] = r3;
+	setrowASM(jpgr_setrow3ASM, r, row, n, transform, 3);
+}
+
+static void
+setrow4ASM(int16* r1, int16* r2, int16* r3, uint8* row, uintxx n,
+	uintxx mode)
+{
+	int16* r[3];
+
+	r[0] = r1;
+	r[1] = r2;
+	r[2] = r3;
+	setrowASM(jpgr_setrow4ASM, r, row, n, mode, 4);
+}
+
+#endif
+
+static void
+setkernels(struct TJPGRPblc* jpgr)
+{
+#if DOX64
+	uintxx features;
 #endif
 
+	PRVT->inverseDCT  = inverseDCT;
+	PRVT->inverseDCT2 = inverseDCT2;
+	PRVT->inverseDCT4 = inverseDCT4;
+	PRVT->upsamplerow = upsamplerow;
+	PRVT->setrow1     = setrow1;
+	PRVT->setrow3     = setrow3;
+	PRVT->setrow4     = setrow4;
+
+#if DOSSE2
+	/* SSE2 is part of the x86-64 baseline */
+	PRVT->inverseDCT  = inverseDCTSSE2;
+	PRVT->inverseDCT2 = inverseDCTSSE2;
+	PRVT->inverseDCT4 = inverseDCTSSE2;
+	PRVT->upsamplerow = upsamplerowSSE2;
+	PRVT->setrow1     = setrow1SSE2;
+	PRVT->setrow3     = setrow3SSE2;
+	PRVT->setrow4     = setrow4SSE2;
+#endif
 
-#if defined(JPGR_CFG_EXTERNALASM)
+#if DOX64
+	features = imgcpu_getfeatures();
+	if (features & IMGCPU_SSSE3) {
+		PRVT->setrow3 = setrow3SSSE3;
+	}
+#endif
 
-#define inverseDCT jpgr_inverseDCTASM
-#define setrow1 jpgr_setrow1ASM
-#define setrow3 jpgr_setrow3ASM
+#if defined(JPGR_CFG_EXTERNALASM)
+	/* the ASM kernels replace the SSE2 and SSSE3 ones (the ASM setrow3
+	 * selects its SSSE3 variant by itself) */
+	jpgr_initASM();
+	PRVT->inverseDCT  = jpgr_inverseDCTASM;
+	PRVT->inverseDCT2 = jpgr_inverseDCTASM;
+	PRVT->inverseDCT4 = jpgr_inverseDCTASM;
+	PRVT->upsamplerow = jpgr_upsamplerowASM;
+	PRVT->setrow1     = jpgr_setrow1ASM;
+	PRVT->setrow3     = setrow3ASM;
+	PRVT->setrow4     = setrow4ASM;
+#endif
 
+#if DOX64
+	if (features & IMGCPU_AVX2) {
+		PRVT->inverseDCT  = inverseDCTAVX2;
+		PRVT->inverseDCT2 = inverseDCTAVX2;
+		PRVT->inverseDCT4 = inverseDCTAVX2;
+		PRVT->upsamplerow = upsamplerowAVX2;
+		PRVT->setrow3     = setrow3AVX2;
+	}
+	if (features & IMGCPU_AVX512) {
+		PRVT->upsamplerow = upsamplerowAVX512;
+	}
 #endif
+}
+
+#define INVERSEDCT  PRVT->inverseDCT
+#define INVERSEDCT2 PRVT->inverseDCT2
+#define INVERSEDCT4 PRVT->inverseDCT4
+#define UPSAMPLEROW PRVT->upsamplerow
+#define SETROW1     PRVT->setrow1
+#define SETROW3     PRVT->setrow3
+#define SETROW4     PRVT->setrow4
+
+
+/* inverse DCT of a component unit, the unit is smaller than 8x8 when the
+ * image is decoded at a reduced scale, mask has the positions of the
+ * cofficients or-ed together (0x3f if unknown) */
+CTB_INLINE void
+transformunit(struct TJPGRPblc* jpgr, struct TJPGComponent* c, int16* sblock,
+	int16* rblock, uintxx mask)
+{
+	if (CTB_LIKELY(c->usizey == 8 && c->usizex == 8)) {
+		if (mask == 0) {
+			inverseDCT1(sblock, rblock, c->qtable->values);
+			return;
+		}
+		if ((mask & 0x36) == 0) {
+			INVERSEDCT2(sblock, rblock, c->qtable->values);
+			return;
+		}
+		if ((mask & 0x24) == 0) {
+			INVERSEDCT4(sblock, rblock, c->qtable->values);
+			return;
+		}
+		INVERSEDCT(sblock, rblock, c->qtable->values);
+		return;
+	}
+	reducedDCT(sblock, rblock, c->qtable->values, c->usizey, c->usizex);
+}
 
 
 static void
 setpixels1(struct TJPGRPblc* jpgr, uintxx y, uintxx x, int16* u1)
 {
-	uintxx s;
-	uintxx stepx;
-	uintxx row;
-	uintxx col;
-	uintxx o;
+	uintxx n;
+	uintxx r1;
+	uintxx r2;
+	uintxx c1;
+	uintxx c2;
+	uintxx bsize;
+	int16* s;
+	uint8* pixels;
 
-	row = y << 3;
-	for (s = 0; s < 64; s += 8) {
-		if (CTB_UNLIKELY(row >= jpgr->sizey)) {
-			break;
+	/* block size, 8 unless the image is decoded at a reduced scale */
+	bsize = 8 >> PRVT->scale;
+
+	/* part of the unit inside the crop window (the padding units of a MCU
+	 * are always outside) */
+	r1 = y * bsize;
+	c1 = x * bsize;
+	r2 = r1 + bsize;
+	c2 = c1 + bsize;
+	if (r2 > PRVT->cropy + PRVT->cropsizey)
+		r2 = PRVT->cropy + PRVT->cropsizey;
+	if (c2 > PRVT->cropx + PRVT->cropsizex)
+		c2 = PRVT->cropx + PRVT->cropsizex;
+	if (r1 < PRVT->cropy)
+		r1 = PRVT->cropy;
+	if (c1 < PRVT->cropx)
+		c1 = PRVT->cropx;
+	if (CTB_UNLIKELY(r1 >= r2 || c1 >= c2)) {
+		return;
+	}
+
+	n = c2 - c1;
+	s = u1 + ((r1 - y * bsize) << 3) + (c1 - x * bsize);
+	pixels = PRVT->pixels + (c1 - PRVT->cropx) * PRVT->pelsize;
+	pixels += (r1 - PRVT->cropy - PRVT->firstrow) * PRVT->stride;
+	for (; r1 < r2; r1++) {
+		if (PRVT->layout != JPGR_DEFAULTLAYOUT) {
+			/* expanded to RGB */
+			SETROW4(s, s, s, pixels, n, PRVT->lmode);
+		}
+		else {
+			if (n == 8) {
+				SETROW1(s, pixels);
+			}
+			else {
+				uintxx i;
+
+				for (i = 0; i < n; i++) {
+					pixels[i] = tograyscale(s[i]);
+				}
+			}
 		}
+		pixels += PRVT->stride;
+		s += 8;
+	}
+}
 
-		col = x << 3;
-		if (col + 8 <= jpgr->sizex) {
-			o = (row * jpgr->sizex) + col;
+/* copies the decoded unit j of the MCU at column x to the strip of the
+ * component */
+CTB_INLINE void
+stripunit(struct TJPGComponent* c, int16* unit, uintxx x, uintxx j)
+{
+	uintxx i;
+	uintxx k;
+	int16* s;
 
-			setrow1(u1 + s, PRVT->pixels + o);
-			row++;
-			continue;
+	s = c->strip + (j / c->xsampling) * c->usizey * c->swidth;
+	s = s + (x * c->xsampling + (j % c->xsampling)) * c->usizex;
+	if (CTB_LIKELY(c->usizex == 8)) {
+		for (i = 0; i < c->usizey; i++) {
+			ctb_memcpy(s, unit, 8 * sizeof(int16));
+			s += c->swidth;
+			unit += 8;
 		}
+		return;
+	}
 
-		o = (row * jpgr->sizex) + col;
-		for (stepx = 0; stepx < 8; stepx++) {
-			if (col >= jpgr->sizex) {
-				break;
-			}
+	for (i = 0; i < c->usizey; i++) {
+		for (k = 0; k < c->usizex; k++) {
+			s[k] = unit[k];
+		}
+		s += c->swidth;
+		unit += 8;
+	}
+}
+
+/* stores n values of a strip row in a plane */
+CTB_INLINE void
+setplanerow(struct TJPGRPblc* jpgr, int16* r, uint8* row, uintxx n)
+{
+	uintxx i;
 
-			PRVT->pixels[o++] = tograyscale(u1[s + stepx]);
-			col++;
+	i = 0;
+	if ((((uintxx) r) & 15) == 0) {
+		for (; i + 8 <= n; i += 8) {
+			SETROW1(r + i, row + i);
 		}
-		row++;
+	}
+	for (; i < n; i++) {
+		row[i] = tograyscale(r[i]);
 	}
 }
 
-/* non subsampled components */
+/* copies the MCU columns x1 to x2 of the strips to the planes (planar
+ * output) */
 static void
-setpixels3ns(struct TJPGRPblc* jpgr, uintxx y, uintxx x, uintxx torgb)
+flushplanes(struct TJPGRPblc* jpgr, uintxx y, uintxx x1, uintxx x2)
 {
-	uintxx s;
-	uintxx stepx;
-	int16* u1;
-	int16* u2;
-	int16* u3;
+	uintxx i;
+	uintxx j;
+	uintxx n;
 	uintxx row;
 	uintxx col;
+	uintxx sizey;
+	uintxx sizex;
+	uintxx psizey;
+	uintxx psizex;
+	struct TJPGComponent* c;
 
-	u1 = PRVT->components[0].units[0];
-	u2 = PRVT->components[1].units[0];
-	u3 = PRVT->components[2].units[0];
+	for (i = 0; i < 3; i++) {
+		c = PRVT->components + i;
+		getplanesize(jpgr, i, &psizey, &psizex);
 
-	row = y << 3;
-	for (s = 0; s < 64; s += 8) {
-		uintxx o;
+		sizey = c->ysampling * c->usizey;
+		sizex = c->xsampling * c->usizex;
 
-		if (CTB_UNLIKELY(row >= jpgr->sizey)) {
-			break;
+		col = x1 * sizex;
+		n = x2 * sizex;
+		if (n > psizex) {
+			n = psizex;
 		}
-
-		col = x << 3;
-		if (CTB_LIKELY(col + 8 <= jpgr->sizex)) {
-			o = ((row * jpgr->sizex) + col) * 3;
-			setrow3(u1 + s, u2 + s, u3 + s, PRVT->pixels + o, torgb);
-			row++;
+		if (col >= n) {
 			continue;
 		}
+		n -= col;
 
-		o = ((row * jpgr->sizex) + col) * 3;
-		for (stepx = 0; stepx < 8; stepx++) {
-			int16 a1;
-			int16 a2;
-			int16 a3;
-			struct TJPGRGB r;
+		row = y * sizey;
+		for (j = 0; j < sizey; j++) {
+			uint8* plane;
 
-			if (CTB_UNLIKELY(col >= jpgr->sizex)) {
+			if (CTB_UNLIKELY(row + j >= psizey)) {
 				break;
 			}
-			a1 = u1[s + stepx];
-			a2 = u2[s + stepx];
-			a3 = u3[s + stepx];
-			r = toRGB(a1, a2, a3, torgb);
-
-			PRVT->pixels[o++] = r.r;
-			PRVT->pixels[o++] = r.g;
-			PRVT->pixels[o++] = r.b;
-			col++;
+			plane = PRVT->planes[i] + (row + j) * PRVT->strides[i] + col;
+			setplanerow(jpgr, c->strip + j * c->swidth + col, plane, n);
 		}
-		row++;
 	}
 }
 
-/* image containing subsampled components */
+/* Converts the MCU columns x1 to x2 of the strips (a MCU row) to pixels, the
+ * subsampled components are upsampled a whole row at a time. */
 static void
-setpixels3ss(struct TJPGRPblc* jpgr, uintxx y, uintxx x, uintxx torgb)
+flushstrip(struct TJPGRPblc* jpgr, uintxx y, uintxx x1, uintxx x2,
+	uintxx torgb)
 {
 	uintxx i;
-	uintxx s;
-	uintxx stepx;
-	int16* r1;
-	int16* r2;
-	int16* r3;
-	int16* u1;
-	int16* u2;
-	int16* u3;
-	struct TJPGComponent* c1;
-	struct TJPGComponent* c2;
-	struct TJPGComponent* c3;
-
-	c1 = PRVT->components + 0;
-	c2 = PRVT->components + 1;
-	c3 = PRVT->components + 2;
-	r1 = c1->srow;
-	r2 = c2->srow;
-	r3 = c3->srow;
-	for (i = 0; i < PRVT->nunits; i++) {
-		uintxx row;
-		uintxx col;
-		uintxx d1, d2, d3;
-
-		d1 = c1->offset[i];
-		d2 = c2->offset[i];
-		d3 = c3->offset[i];
-		u1 = c1->units[c1->iblock[i]];
-		u2 = c2->units[c2->iblock[i]];
-		u3 = c3->units[c3->iblock[i]];
-
-		row = y * (PRVT->ysampling * 8) + PRVT->originy[i];
-		for (s = 0; s < 64; s += 8) {
-			uintxx o;
-			int16* row1;
-			int16* row2;
-			int16* row3;
+	uintxx j;
+	uintxx n;
+	uintxx row;
+	uintxx col;
+	uintxx c1;
+	uintxx c2;
+	uintxx mcusizey;
+	uintxx mcusizex;
+	uintxx last[3];
+	int16* r[3];
+	struct TJPGComponent* c;
 
-#if defined(JPGR_CFG_EXTERNALASM)
-			row1 = u1 + c1->umap[s] + (d1 & -0x08);
-			row2 = u2 + c2->umap[s] + (d2 & -0x08);
-			row3 = u3 + c3->umap[s] + (d3 & -0x08);
-#endif
-			if (CTB_UNLIKELY(row >= jpgr->sizey)) {
-				break;
-			}
+	if (PRVT->planar) {
+		flushplanes(jpgr, y, x1, x2);
+		return;
+	}
 
-			col = x * (PRVT->xsampling * 8) + PRVT->originx[i];
-			if (col + 8 <= jpgr->sizex) {
-				o = ((row * jpgr->sizex) + col) * 3;
+	/* only the part inside the crop window */
+	if (y < PRVT->mcuy1 || y >= PRVT->mcuy2) {
+		return;
+	}
+	if (x1 < PRVT->mcux1) {
+		x1 = PRVT->mcux1;
+	}
+	if (x2 > PRVT->mcux2) {
+		x2 = PRVT->mcux2;
+	}
 
-				/* this may be slow, but not significantly slower for most
-				 * images */
-				if (c1->rumode[i]) {
-#if defined(JPGR_CFG_EXTERNALASM)
-					jpgr_upsamplerowASM(row1, r1, c1->rumode[i]);
-#else
-					r1[0] = u1[c1->umap[s + 0] + d1];
-					r1[1] = u1[c1->umap[s + 1] + d1];
-					r1[2] = u1[c1->umap[s + 2] + d1];
-					r1[3] = u1[c1->umap[s + 3] + d1];
-					r1[4] = u1[c1->umap[s + 4] + d1];
-					r1[5] = u1[c1->umap[s + 5] + d1];
-					r1[6] = u1[c1->umap[s + 6] + d1];
-					r1[7] = u1[c1->umap[s + 7] + d1];
-#endif
-					row1 = r1;
-				}
-				else {
-					row1 = u1 + c1->umap[s] + d1;
-				}
+	mcusizey = PRVT->ysampling * (8 >> PRVT->scale);
+	mcusizex = PRVT->xsampling * (8 >> PRVT->scale);
 
-				if (c2->rumode[i]) {
-#if defined(JPGR_CFG_EXTERNALASM)
-					jpgr_upsamplerowASM(row2, r2, c2->rumode[i]);
-#else
-					r2[0] = u2[c2->umap[s + 0] + d2];
-					r2[1] = u2[c2->umap[s + 1] + d2];
-					r2[2] = u2[c2->umap[s + 2] + d2];
-					r2[3] = u2[c2->umap[s + 3] + d2];
-					r2[4] = u2[c2->umap[s + 4] + d2];
-					r2[5] = u2[c2->umap[s + 5] + d2];
-					r2[6] = u2[c2->umap[s + 6] + d2];
-					r2[7] = u2[c2->umap[s + 7] + d2];
-#endif
-					row2 = r2;
-				}
-				else {
-					row2 = u2 + c2->umap[s] + d2;
-				}
+	col = x1 * mcusizex;
+	n = x2 * mcusizex;
+	if (n > PRVT->scaledx) {
+		n = PRVT->scaledx;
+	}
+	if (col >= n) {
+		return;
+	}
+	n -= col;
 
-				if (c3->rumode[i]) {
-#if defined(JPGR_CFG_EXTERNALASM)
-					jpgr_upsamplerowASM(row3, r3, c3->rumode[i]);
-#else
-					r3[0] = u3[c3->umap[s + 0] + d3];
-					r3[1] = u3[c3->umap[s + 1] + d3];
-					r3[2] = u3[c3->umap[s + 2] + d3];
-					r3[3] = u3[c3->umap[s + 3] + d3];
-					r3[4] = u3[c3->umap[s + 4] + d3];
-					r3[5] = u3[c3->umap[s + 5] + d3];
-					r3[6] = u3[c3->umap[s + 6] + d3];
-					r3[7] = u3[c3->umap[s + 7] + d3];
-#endif
-					row3 = r3;
-				}
-				else {
-					row3 = u3 + c3->umap[s] + d3;
-				}
+	/* columns converted */
+	c1 = col;
+	c2 = col + n;
+	if (c1 < PRVT->cropx) {
+		c1 = PRVT->cropx;
+	}
+	if (c2 > PRVT->cropx + PRVT->cropsizex) {
+		c2 = PRVT->cropx + PRVT->cropsizex;
+	}
+	if (c1 >= c2) {
+		return;
+	}
+
+	last[0] = last[1] = last[2] = (uintxx) -1;
+
+	row = y * mcusizey;
+	for (j = 0; j < mcusizey; j++) {
+		uint8* pixels;
+
+		if (row + j < PRVT->cropy) {
+			continue;
+		}
+		if (CTB_UNLIKELY(row + j >= PRVT->cropy + PRVT->cropsizey)) {
+			break;
+		}
 
-				setrow3(row1, row2, row3, PRVT->pixels + o, torgb);
-				row++;
+		for (i = 0; i < 3; i++) {
+			int16* s;
+
+			c = PRVT->components + i;
+			s = c->strip + (j / c->ry) * c->swidth;
+			if (c->rx == 1) {
+				r[i] = s;
 				continue;
 			}
 
-			for (stepx = 0; stepx < 8; stepx++) {
-				int16 a1;
-				int16 a2;
-				int16 a3;
-				struct TJPGRGB r;
-
-				if (CTB_UNLIKELY(col >= jpgr->sizex)) {
-					break;
-				}
-				a1 = u1[c1->umap[s + stepx] + d1];
-				a2 = u2[c2->umap[s + stepx] + d2];
-				a3 = u3[c3->umap[s + stepx] + d3];
-				r = toRGB(a1, a2, a3, torgb);
-
-				o = (row * jpgr->sizex) + col;
-				PRVT->pixels[(o * 3) + 0] = r.r;
-				PRVT->pixels[(o * 3) + 1] = r.g;
-				PRVT->pixels[(o * 3) + 2] = r.b;
-				col++;
+			/* the upsampled row is reused for the next rows */
+			if (last[i] != j / c->ry) {
+				UPSAMPLEROW(s + col / c->rx, c->srow + col, n, c->rx);
+				last[i] = j / c->ry;
 			}
-			row++;
+			r[i] = c->srow;
+		}
+
+		pixels = PRVT->pixels;
+		pixels += (row + j - PRVT->cropy - PRVT->firstrow) * PRVT->stride;
+		pixels += (c1 - PRVT->cropx) * PRVT->pelsize;
+		if (PRVT->layout != JPGR_DEFAULTLAYOUT) {
+			SETROW4(
+				r[0] + c1, r[1] + c1, r[2] + c1, pixels, c2 - c1,
+				PRVT->lmode | torgb);
+			continue;
+		}
+		SETROW3(r[0] + c1, r[1] + c1, r[2] + c1, pixels, c2 - c1, torgb);
+	}
+}
+
+/* passes the image rows [row, row + n) of the row buffer to the output
+ * function (streaming output), only the first ncols pixels of each row were
+ * decoded (the rest are cleared), the rows outside the crop window are
+ * skipped */
+static uintxx
+emitrows(struct TJPGRPblc* jpgr, uintxx row, uintxx n, uintxx ncols)
+{
+	uintxx j;
+	uintxx r2;
+	uintxx size;
+	uint8* rows;
+
+	r2 = row + n;
+	if (row < PRVT->cropy) {
+		row = PRVT->cropy;
+	}
+	if (r2 > PRVT->cropy + PRVT->cropsizey) {
+		r2 = PRVT->cropy + PRVT->cropsizey;
+	}
+	if (row >= r2) {
+		return 1;
+	}
+	row -= PRVT->cropy;
+	n = (r2 - PRVT->cropy) - row;
+
+	/* decoded columns of the window */
+	if (ncols > PRVT->cropx) {
+		ncols -= PRVT->cropx;
+	}
+	else {
+		ncols = 0;
+	}
+	if (ncols > PRVT->cropsizex) {
+		ncols = PRVT->cropsizex;
+	}
+
+	rows = PRVT->pixels;
+	if (ncols < PRVT->cropsizex) {
+		size = (PRVT->cropsizex - ncols) * PRVT->pelsize;
+		for (j = 0; j < n; j++) {
+			ctb_memset(
+				rows + j * PRVT->stride + ncols * PRVT->pelsize, 0, size);
 		}
 	}
+
+	PRVT->firstrow = row + n;
+	if (PRVT->outputfn(rows, row, n, PRVT->stride, PRVT->outputuser) == 0) {
+		SETERROR(JPGR_EABORTED);
+		return 0;
+	}
+	return 1;
 }
 
 CTB_INLINE uintxx
@@ -3250,14 +5447,158 @@ checkinterval(struct TJPGRPblc* jpgr)
 	return 1;
 }
 
+/* Stores the checkpoint n of the index (the state before the next MCU): the
+ * offset of the input byte with the next bit (64 bits), the number of bits
+ * already used in that byte (top 8 bits) and the MCUs left in the restart
+ * interval, and the DC predictors of the components. The interval is the
+ * number of MCUs left after the current one. */
+static bool
+setcheckpoint(struct TJPGRPblc* jpgr, uintxx n, uintxx interval)
+{
+	uintxx i;
+	uintxx r;
+	uint8* s;
+	uint8* e;
+	uint64 offset;
+
+	if (overread(jpgr)) {
+		SETERROR(JPGR_EBADDATA);
+		return 0;
+	}
+
+	/* the bits not used yet are at the end of the data read from the input,
+	 * the stuffed bytes (0xff 0x00) are a single byte */
+	s = PRVT->bgn;
+	for (r = (PRVT->bbcread + 7) >> 3; r; r--) {
+		if (s[-1] == 0x00 && s[-2] == 0xff) {
+			s--;
+		}
+		s--;
+	}
+
+	if (PRVT->rinterval) {
+		interval++;
+	}
+	e = PRVT->index + INDEXHEADERSIZE + n * INDEXENTRYSIZE;
+	offset = (uint64) (s - PRVT->srcbgn);
+	putu32(e + 0, (uint32) (offset >> 0x20));
+	putu32(e + 4, (uint32) (offset));
+	putu32(e + 8, (uint32) (((8 - (PRVT->bbcread & 7)) & 7) << 0x18));
+	e[10] = (uint8) (interval >> 0x08);
+	e[11] = (uint8) (interval);
+	for (i = 0; i < 3; i++) {
+		uint32 v;
+
+		v = 0;
+		if (i < PRVT->ncomponents) {
+			v = (uint32) PRVT->components[i].cofficient;
+		}
+		putu32(e + 12 + i * 4, v);
+	}
+	return 1;
+}
+
+/* restores the decoder state of the checkpoint n, returns the MCUs left in
+ * the restart interval */
+static uintxx
+seekcheckpoint(struct TJPGRPblc* jpgr, uintxx n)
+{
+	uintxx i;
+	uintxx bits;
+	uint8* e;
+	uint64 offset;
+
+	e = PRVT->index + INDEXHEADERSIZE + n * INDEXENTRYSIZE;
+	offset = ((uint64) getu32(e) << 0x20) | getu32(e + 4);
+	PRVT->bgn = PRVT->srcbgn + (uintxx) offset;
+	initbitmode(jpgr);
+
+	bits = e[8];
+	if (bits) {
+		ensurebits(jpgr, bits);
+		dropbits(jpgr, bits);
+	}
+	for (i = 0; i < PRVT->ncomponents; i++) {
+		PRVT->components[i].cofficient = (int32) getu32(e + 12 + i * 4);
+	}
+	return (e[10] << 0x08) | e[11];
+}
+
+/* decodes the MCU at the given position of an interleaved scan, the units
+ * of a 3 component image are stored in the strips (see flushstrip) */
+CTB_INLINE bool
+decodemcu(struct TJPGRPblc* jpgr, uintxx y, uintxx x)
+{
+	uintxx i;
+	uintxx j;
+	uintxx draw;
+	struct TJPGComponent* c;
+
+	/* the MCUs outside the crop window are only decoded */
+	draw = 0;
+	if (CTB_LIKELY(PRVT->pixels != NULL)) {
+		draw = y >= PRVT->mcuy1 && y < PRVT->mcuy2;
+		draw = draw && x >= PRVT->mcux1 && x < PRVT->mcux2;
+	}
+
+	/* 1 component image */
+	if (PRVT->ncomponents == 1) {
+		c = PRVT->components + PRVT->corder[0];
+		if (CTB_UNLIKELY(decodeblock(jpgr, c, c->units[0]) == 0)) {
+			return 0;
+		}
+
+		if (CTB_LIKELY(draw)) {
+			transformunit(jpgr, c, c->units[0], c->units[0], c->bmask);
+			setpixels1(jpgr, y, x, c->units[0]);
+		}
+		return 1;
+	}
+
+	/* 3 component image */
+	for (i = 0; i < PRVT->ncomponents; i++) {
+		int16* unit;
+
+		c = PRVT->components + PRVT->corder[i];
+		unit = c->units[0];
+		for (j = 0; j < c->ucount; j++) {
+			if (CTB_UNLIKELY(decodeblock(jpgr, c, unit) == 0)) {
+				return 0;
+			}
+
+			if (CTB_LIKELY(draw)) {
+				if (PRVT->grayonly) {
+					uintxx uy;
+					uintxx ux;
+
+					if (c != PRVT->components) {
+						continue;
+					}
+					uy = y * c->ysampling + j / c->xsampling;
+					ux = x * c->xsampling + j % c->xsampling;
+					transformunit(jpgr, c, unit, unit, c->bmask);
+					setpixels1(jpgr, uy, ux, unit);
+					continue;
+				}
+				transformunit(jpgr, c, unit, unit, c->bmask);
+				stripunit(c, unit, x, j);
+			}
+		}
+	}
+	return 1;
+}
+
 static uintxx
 decodebaseline(struct TJPGRPblc* jpgr)
 {
 	uintxx y;
 	uintxx x;
-	uintxx i;
+	uintxx nrows;
+	uintxx ncols;
 	uintxx torgb;
 	uintxx interval;
+	uintxx dostrips;
+	uintxx mcusizey;
 
 	initbitmode(jpgr);
 	interval = PRVT->rinterval;
@@ -3289,89 +5630,46 @@ decodebaseline(struct TJPGRPblc* jpgr)
 		return 1;
 	}
 
-	/* 1 component image */
-	if (PRVT->ncomponents == 1) {
-		struct TJPGComponent* c1;
-
-		c1 = PRVT->components + PRVT->corder[0];
-		for (y = 0; y < c1->nrows; y++) {
-			for (x = 0; x < c1->ncols; x++) {
-				if (PRVT->rinterval) {
-					if (CTB_UNLIKELY(interval == 0)) {
-						if (checkinterval(jpgr) == 0) {
-							return 0;
-						}
-						initbitmode(jpgr);
-						interval = PRVT->rinterval;
-					}
-					interval -= 1;
-				}
-
-				if (CTB_UNLIKELY(decodeblock(jpgr, c1, c1->units[0]) == 0)) {
-					return 0;
-				}
-
-				if (CTB_LIKELY(PRVT->pixels != NULL)) {
-					inverseDCT(c1->units[0], c1->units[0], c1->qtable->values);
-					setpixels1(jpgr, y, x, c1->units[0]);
-				}
-			}
-		}
-		return 1;
-	}
-
-	/* 3 component image */
 	torgb = 1;
 	if (PRVT->isrgb == 1 || PRVT->keepyuv == 1)
 		torgb = 0;
 
-	if (PRVT->issubsampled == 0) {
-		struct TJPGComponent* c1;
-		struct TJPGComponent* c2;
-		struct TJPGComponent* c3;
+	/* the strips are converted after each MCU row (or the decoded part of
+	 * the row when there is an error) */
+	dostrips = PRVT->ncomponents == 3 && PRVT->pixels != NULL;
+	if (PRVT->grayonly) {
+		dostrips = 0;
+	}
+
+	/* with streaming output the rows are passed after each MCU row */
+	mcusizey = getmcuheight(jpgr);
+	PRVT->firstrow = 0;
 
-		c1 = PRVT->components + PRVT->corder[0];
-		c2 = PRVT->components + PRVT->corder[1];
-		c3 = PRVT->components + PRVT->corder[2];
-		for (y = 0; y < PRVT->nrows; y++) {
-			for (x = 0; x < PRVT->ncols; x++) {
-				if (PRVT->rinterval) {
-					if (CTB_UNLIKELY(interval == 0)) {
-						if (checkinterval(jpgr) == 0) {
-							return 0;
-						}
-						initbitmode(jpgr);
-						interval = PRVT->rinterval;
-					}
-					interval -= 1;
-				}
+	/* the decoding ends after the last MCU row of the crop window */
+	getmcucount(jpgr, &nrows, &ncols);
+	if (nrows > PRVT->mcuy2) {
+		nrows = PRVT->mcuy2;
+	}
 
-				if (CTB_UNLIKELY(decodeblock(jpgr, c1, c1->units[0]) == 0)) {
-					return 0;
-				}
-				if (CTB_UNLIKELY(decodeblock(jpgr, c2, c2->units[0]) == 0)) {
-					return 0;
-				}
-				if (CTB_UNLIKELY(decodeblock(jpgr, c3, c3->units[0]) == 0)) {
-					return 0;
-				}
-				if (CTB_LIKELY(PRVT->pixels != NULL)) {
-					inverseDCT(c1->units[0], c1->units[0], c1->qtable->values);
-					inverseDCT(c2->units[0], c2->units[0], c2->qtable->values);
-					inverseDCT(c3->units[0], c3->units[0], c3->qtable->values);
-					setpixels3ns(jpgr, y, x, torgb);
-				}
-			}
+	/* with an index the decoding starts at the last checkpoint before the
+	 * crop window */
+	y = 0;
+	if (PRVT->index && PRVT->isbuilding == 0) {
+		uintxx n;
+
+		n = PRVT->mcuy1 / PRVT->istep;
+		if (n) {
+			interval = seekcheckpoint(jpgr, n);
+			y = n * PRVT->istep;
 		}
-		return 1;
 	}
 
-	for (y = 0; y < PRVT->nrows; y++) {
-		for (x = 0; x < PRVT->ncols; x++) {
+	for (; y < nrows; y++) {
+		for (x = 0; x < ncols; x++) {
 			if (PRVT->rinterval) {
 				if (CTB_UNLIKELY(interval == 0)) {
 					if (checkinterval(jpgr) == 0) {
-						return 0;
+						goto L_ERROR;
 					}
 					initbitmode(jpgr);
 					interval = PRVT->rinterval;
@@ -3379,27 +5677,375 @@ decodebaseline(struct TJPGRPblc* jpgr)
 				interval -= 1;
 			}
 
-			for (i = 0; i < PRVT->ncomponents; i++) {
-				uintxx j;
-				struct TJPGComponent* c;
-
-				c = PRVT->components + PRVT->corder[i];
-				for (j = 0; j < c->ucount; j++) {
-					if (CTB_UNLIKELY(decodeblock(jpgr, c, c->units[j]) == 0)) {
-						return 0;
+			if (CTB_UNLIKELY(PRVT->isbuilding) && x == 0) {
+				if (y % PRVT->istep == 0) {
+					if (setcheckpoint(jpgr, y / PRVT->istep, interval) == 0) {
+						goto L_ERROR;
 					}
-					inverseDCT(c->units[j], c->units[j], c->qtable->values);
 				}
 			}
 
-			if (CTB_LIKELY(PRVT->pixels != NULL)) {
-				setpixels3ss(jpgr, y, x, torgb);
+			if (CTB_UNLIKELY(decodemcu(jpgr, y, x) == 0)) {
+				goto L_ERROR;
+			}
+		}
+		if (dostrips) {
+			flushstrip(jpgr, y, 0, ncols, torgb);
+		}
+		if (PRVT->outputfn) {
+			if (emitrows(jpgr, y * mcusizey, mcusizey, PRVT->scaledx) == 0) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+
+L_ERROR:
+	if (dostrips) {
+		flushstrip(jpgr, y, 0, x, torgb);
+	}
+	if (PRVT->outputfn) {
+		uintxx error;
+
+		/* keep the decoding error */
+		error = jpgr->error;
+		emitrows(jpgr, y * mcusizey, mcusizey, x * getmcuwidth(jpgr));
+		SETERROR(error);
+	}
+	return 0;
+}
+
+
+/*
+ * Parallel decoding, the restart intervals of a baseline image are located
+ * before the decoding and each thread decodes a range of intervals using its
+ * own copy of the reader */
+
+struct TJPGRTasks {
+	/* copies of the reader (one per thread) and the size of each one */
+	uint8* workers;
+	uintxx wsize;
+
+	/* position of each interval (plus the end of the scan) and the range of
+	 * intervals decoded (the ones in the crop window) */
+	uint8** intervals;
+	uintxx nintervals;
+	uintxx ifirst;
+	uintxx ilast;
+	uintxx nthreads;
+
+	uintxx nrows;
+	uintxx ncols;
+	uintxx torgb;
+	uintxx dostrips;
+};
+
+/* locates the restart markers of the scan, returns the number of intervals
+ * found (or zero if the scan doesn't end with a marker), the position after
+ * the last interval is the end of the scan */
+static uintxx
+indexintervals(struct TJPGRPblc* jpgr, uint8** intervals, uintxx n)
+{
+	uint8* s;
+	uint8* e;
+	uintxx count;
+
+	s = PRVT->bgn;
+	e = PRVT->end;
+
+	intervals[0] = s;
+	count = 1;
+	while (s + 1 < e) {
+		uintxx m;
+
+		/* skip 8 bytes at a time until one of them is 0xff */
+		for (; s + 8 < e; s += 8) {
+			uint64 v;
+
+			ctb_memcpy(&v, s, sizeof(v));
+			v = ~v;
+			if ((v - 0x0101010101010101ull) & ~v & 0x8080808080808080ull) {
+				break;
+			}
+		}
+
+		if (s[0] != 0xff) {
+			s++;
+			continue;
+		}
+
+		m = s[1];
+		if (m == 0x00 || m == 0xff) {
+			/* stuffed or fill byte */
+			s += 1 + (m == 0x00);
+			continue;
+		}
+
+		if (TOI16(0xff, m) >= RST0 && TOI16(0xff, m) <= RST7) {
+			if (count == n) {
+				return 0;
+			}
+			intervals[count++] = s + 2;
+			s += 2;
+			continue;
+		}
+
+		intervals[count] = s;
+		return count;
+	}
+	return 0;
+}
+
+static uintxx
+decodeinterval(struct TJPGRPblc* jpgr, struct TJPGRTasks* tasks, uintxx n)
+{
+	uintxx i;
+	uintxx y;
+	uintxx x;
+	uintxx s;
+	uintxx m;
+	uintxx total;
+
+	PRVT->bgn = tasks->intervals[n];
+	for (i = 0; i < PRVT->ncomponents; i++) {
+		PRVT->components[i].cofficient = 0;
+	}
+	initbitmode(jpgr);
+
+	m = n * PRVT->rinterval;
+	total = m + PRVT->rinterval;
+	if (total > tasks->nrows * tasks->ncols) {
+		total = tasks->nrows * tasks->ncols;
+	}
+
+	y = m / tasks->ncols;
+	x = m % tasks->ncols;
+
+	/* first column of the strips not converted yet */
+	s = x;
+	for (; m < total; m++) {
+		if (CTB_UNLIKELY(decodemcu(jpgr, y, x) == 0)) {
+			if (tasks->dostrips) {
+				flushstrip(jpgr, y, s, x, tasks->torgb);
+			}
+			return 0;
+		}
+
+		if (++x == tasks->ncols) {
+			if (tasks->dostrips) {
+				flushstrip(jpgr, y, s, x, tasks->torgb);
 			}
+			s = x = 0;
+			y++;
 		}
 	}
+	if (tasks->dostrips) {
+		flushstrip(jpgr, y, s, x, tasks->torgb);
+	}
 	return 1;
 }
 
+/* checks if the interval n has a MCU inside the crop window */
+static bool
+intervalinwindow(struct TJPGRPblc* jpgr, struct TJPGRTasks* tasks, uintxx n)
+{
+	uintxx y;
+	uintxx m;
+	uintxx total;
+
+	m = n * PRVT->rinterval;
+	total = m + PRVT->rinterval;
+	if (total > tasks->nrows * tasks->ncols) {
+		total = tasks->nrows * tasks->ncols;
+	}
+
+	y = m / tasks->ncols;
+	if (y < PRVT->mcuy1) {
+		y = PRVT->mcuy1;
+	}
+	for (; y < PRVT->mcuy2 && y * tasks->ncols < total; y++) {
+		uintxx x1;
+		uintxx x2;
+
+		/* columns of the row y in the interval */
+		x1 = 0;
+		if (y * tasks->ncols < m) {
+			x1 = m - y * tasks->ncols;
+		}
+		x2 = tasks->ncols;
+		if ((y + 1) * tasks->ncols > total) {
+			x2 = total - y * tasks->ncols;
+		}
+
+		if (x1 < PRVT->mcux2 && x2 > PRVT->mcux1) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+decodetask(void* arg, uintxx index)
+{
+	uintxx i;
+	uintxx n;
+	uintxx last;
+	struct TJPGRTasks* tasks;
+	struct TJPGRPblc* jpgr;
+
+	tasks = arg;
+	jpgr = (void*) (tasks->workers + index * tasks->wsize);
+
+	n = tasks->ilast - tasks->ifirst;
+	i    = tasks->ifirst + (n * (index + 0)) / tasks->nthreads;
+	last = tasks->ifirst + (n * (index + 1)) / tasks->nthreads;
+	for (; i < last; i++) {
+		if (PRVT->iscropped && intervalinwindow(jpgr, tasks, i) == 0) {
+			/* skipped without decoding */
+			continue;
+		}
+		if (decodeinterval(jpgr, tasks, i) == 0) {
+			if (jpgr->error == 0) {
+				SETERROR(JPGR_EBADDATA);
+			}
+			return;
+		}
+	}
+}
+
+#define PRVTSIZE ((sizeof(struct TJPGRPrvt) + 15) & ((uintxx) -16))
+
+static uintxx
+decodeparallel(struct TJPGRPblc* jpgr)
+{
+	uintxx i;
+	uintxx j;
+	uintxx n;
+	uintxx r;
+	uintxx amount;
+	uint8* memory;
+	struct TJPGRTasks tasks;
+
+	/* the intervals can only be located before the decoding if the whole
+	 * input is in memory, with a crop window the intervals outside the
+	 * window are skipped (even using a single thread) */
+	if (PRVT->nthreads < 2 && PRVT->iscropped == 0) {
+		return decodebaseline(jpgr);
+	}
+	if (PRVT->index) {
+		/* the index is filled (or used) by the serial decoder */
+		return decodebaseline(jpgr);
+	}
+	if (PRVT->rinterval == 0) {
+		return decodebaseline(jpgr);
+	}
+	if (PRVT->ismemsource == 0 || PRVT->pixels == NULL) {
+		return decodebaseline(jpgr);
+	}
+	if (PRVT->outputfn) {
+		/* the rows must be passed in order */
+		return decodebaseline(jpgr);
+	}
+
+	getmcucount(jpgr, &tasks.nrows, &tasks.ncols);
+	n = tasks.nrows * tasks.ncols;
+	n = (n + (PRVT->rinterval - 1)) / PRVT->rinterval;
+	if (n < 2) {
+		return decodebaseline(jpgr);
+	}
+
+	/* intervals from the first to the last MCU of the crop window */
+	i = PRVT->mcuy1 * tasks.ncols + PRVT->mcux1;
+	j = (PRVT->mcuy2 - 1) * tasks.ncols + PRVT->mcux2;
+	tasks.ifirst = i / PRVT->rinterval;
+	tasks.ilast  = (j + (PRVT->rinterval - 1)) / PRVT->rinterval;
+
+	tasks.nthreads = PRVT->nthreads;
+	if (tasks.nthreads > tasks.ilast - tasks.ifirst) {
+		tasks.nthreads = tasks.ilast - tasks.ifirst;
+	}
+	tasks.nintervals = n;
+
+	tasks.torgb = 1;
+	if (PRVT->isrgb == 1 || PRVT->keepyuv == 1)
+		tasks.torgb = 0;
+	tasks.dostrips = PRVT->ncomponents == 3 && PRVT->grayonly == 0;
+
+	/* reader copy, units, strips and upsampling rows */
+	tasks.wsize = PRVTSIZE;
+	for (i = 0; i < PRVT->ncomponents; i++) {
+		tasks.wsize += PRVT->components[i].ucount * 64 * sizeof(int16);
+	}
+	if (PRVT->ncomponents == 3) {
+		tasks.wsize += getstripsize(jpgr) * sizeof(int16);
+	}
+
+	amount = (n + 1) * sizeof(uint8*) + tasks.nthreads * tasks.wsize + 16;
+	memory = request_(PRVT, amount);
+	if (memory == NULL) {
+		SETERROR(JPGR_EOOM);
+		return 0;
+	}
+	tasks.intervals = (void*) memory;
+
+	if (indexintervals(jpgr, tasks.intervals, n) != n) {
+		/* let the serial decoder handle the damaged stream */
+		dispose_(PRVT, memory, amount);
+		return decodebaseline(jpgr);
+	}
+
+	tasks.workers = memory + (n + 1) * sizeof(uint8*);
+	tasks.workers = (uint8*) ((((uintxx) tasks.workers) | 15) + 1);
+	for (i = 0; i < tasks.nthreads; i++) {
+		struct TJPGRPrvt* worker;
+		int16* units;
+
+		worker = (void*) (tasks.workers + i * tasks.wsize);
+		ctb_memcpy(worker, PRVT, sizeof(struct TJPGRPrvt));
+
+		units = (void*) (((uint8*) worker) + PRVTSIZE);
+		for (j = 0; j < PRVT->ncomponents; j++) {
+			struct TJPGComponent* c;
+			uintxx k;
+
+			c = worker->components + j;
+			for (k = 0; k < c->ucount; k++) {
+				c->units[k] = units;
+				units += 64;
+			}
+			if (PRVT->ncomponents == 3) {
+				c->strip = units;
+				units += c->swidth * c->ysampling * c->usizey;
+				if (PRVT->issubsampled) {
+					c->srow = units;
+					units += getrowwidth(jpgr);
+				}
+			}
+		}
+	}
+
+	imgthr_runtasks(decodetask, &tasks, tasks.nthreads);
+
+	r = 1;
+	for (i = 0; i < tasks.nthreads; i++) {
+		struct TJPGRPblc* worker;
+
+		worker = (void*) (tasks.workers + i * tasks.wsize);
+		if (worker->error) {
+			SETERROR(worker->error);
+			r = 0;
+			break;
+		}
+	}
+
+	/* continue after the scan */
+	PRVT->bgn = tasks.intervals[n];
+	dispose_(PRVT, memory, amount);
+	return r;
+}
+
+#undef PRVTSIZE
+
 CTB_INLINE uintxx
 decodefirstDC(struct TJPGRPblc* jpgr, struct TJPGComponent* c, uintxx index)
 {
@@ -3856,56 +6502,71 @@ refineAC(struct TJPGRPblc* jpgr)
 	return 1;
 }
 
-static void
+static uintxx
 updateimg(struct TJPGRPblc* jpgr)
 {
 	uintxx y;
 	uintxx x;
 	uintxx i;
 	uintxx v;
+	uintxx m;
+	uintxx n;
 	uintxx torgb;
 	int16* temp;
 	int16* unit;
 	struct TJPGComponent* c;
-	void (*setpixels)(struct TJPGRPblc*, uintxx, uintxx, uintxx);
 
 	if (CTB_UNLIKELY(PRVT->pixels == NULL)) {
-		return;
+		return 1;
 	}
+	PRVT->firstrow = 0;
+
+	/* only the luma of a 3 component image is used with grayonly, only the
+	 * units in the crop window are transformed */
+	if (PRVT->ncomponents == 1 || PRVT->grayonly) {
+		uintxx y2;
+		uintxx x2;
 
-	if (PRVT->ncomponents == 1) {
 		c = PRVT->components;
-		for (y = 0; y < c->nrows; y++) {
-			for (x = 0; x < c->ncols; x++) {
+		n = 8 >> PRVT->scale;
+		y2 = (PRVT->cropy + PRVT->cropsizey + n - 1) / n;
+		x2 = (PRVT->cropx + PRVT->cropsizex + n - 1) / n;
+		for (y = PRVT->cropy / n; y < y2; y++) {
+			for (x = PRVT->cropx / n; x < x2; x++) {
 				temp = c->scan + ((y * c->icols + x) << 6);
 
 				if (jpgr->isprogressive == 0) {
 					/* non interleaved baseline image */
-					inverseDCT(temp, c->units[0], c->qtable->values);
+					transformunit(jpgr, c, temp, c->units[0], 0x3f);
 				}
 				else {
 					unit = c->units[0];
+					m = 0;
 					for (v = 0; v < 64; v++) {
 						unit[zzorder[v]] = temp[v];
+						if (temp[v]) {
+							m |= zzorder[v];
+						}
 					}
-					inverseDCT(unit, unit, c->qtable->values);
+					transformunit(jpgr, c, unit, unit, m);
 				}
 				setpixels1(jpgr, y, x, c->units[0]);
 			}
+			if (PRVT->outputfn) {
+				if (emitrows(jpgr, y * n, n, PRVT->scaledx) == 0) {
+					return 0;
+				}
+			}
 		}
-		return;
+		return 1;
 	}
 
 	torgb = 1;
 	if (PRVT->isrgb == 1 || PRVT->keepyuv == 1)
 		torgb = 0;
 
-	setpixels = setpixels3ss;
-	if (PRVT->issubsampled == 0)
-		setpixels = setpixels3ns;
-
-	for (y = 0; y < PRVT->nrows; y++) {
-		for (x = 0; x < PRVT->ncols; x++) {
+	for (y = PRVT->mcuy1; y < PRVT->mcuy2; y++) {
+		for (x = PRVT->mcux1; x < PRVT->mcux2; x++) {
 			for (i = 0; i < PRVT->ncomponents; i++) {
 				uintxx y2;
 				uintxx x2;
@@ -3924,25 +6585,36 @@ updateimg(struct TJPGRPblc* jpgr)
 					offsety = (y1 + y2) * c->icols;
 					for (x2 = 0; x2 < c->xsampling; x2++) {
 						temp = c->scan + ((offsety + x1 + x2) << 6);
+						unit = c->units[0];
 						if (jpgr->isprogressive == 0) {
 							/* non interleaved baseline image */
-							inverseDCT(temp, c->units[j], c->qtable->values);
-							j++;
+							transformunit(jpgr, c, temp, unit, 0x3f);
+							stripunit(c, unit, x, j++);
 							continue;
 						}
 
-						unit = c->units[j];
+						m = 0;
 						for (v = 0; v < 64; v++) {
 							unit[zzorder[v]] = temp[v];
+							if (temp[v]) {
+								m |= zzorder[v];
+							}
 						}
-						inverseDCT(unit, unit, c->qtable->values);
-						j++;
+						transformunit(jpgr, c, unit, unit, m);
+						stripunit(c, unit, x, j++);
 					}
 				}
 			}
-			setpixels(jpgr, y, x, torgb);
+		}
+		flushstrip(jpgr, y, PRVT->mcux1, PRVT->mcux2, torgb);
+		if (PRVT->outputfn) {
+			n = getmcuheight(jpgr);
+			if (emitrows(jpgr, y * n, n, PRVT->scaledx) == 0) {
+				return 0;
+			}
 		}
 	}
+	return 1;
 }
 
 uintxx
@@ -3972,7 +6644,9 @@ jpgr_decodeimg(TJPGReader* jpgr)
 			return 0;
 		}
 
-		updateimg(PBLC);
+		if (updateimg(PBLC) == 0) {
+			goto L_ERROR;
+		}
 		return 1;
 	}
 
@@ -4039,11 +6713,18 @@ jpgr_decodeimg(TJPGReader* jpgr)
 			}
 		}
 
-		updateimg(PBLC);
+		if (updateimg(PBLC) == 0) {
+			goto L_ERROR;
+		}
 		return 1;
 	}
 
-	if (decodebaseline(PBLC)) {
+	if (decodeparallel(PBLC)) {
+		if (PRVT->iscropped) {
+			/* the decoding stops after the crop window */
+			SETSTATE(4);
+			return 1;
+		}
 		if (parsesegments(PBLC) == 0) {
 			SETSTATE(5);
 		}
@@ -4074,7 +6755,9 @@ jpgr_updateimg(TJPGReader* jpgr)
 		}
 	}
 
-	updateimg(PBLC);
+	if (updateimg(PBLC) == 0) {
+		SETSTATE(JPGR_BADSTATE);
+	}
 }
 
 uintxx
@@ -4143,7 +6826,9 @@ jpgr_decodepass(TJPGReader* jpgr, bool update)
 	}
 
 	if (update) {
-		updateimg(PBLC);
+		if (updateimg(PBLC) == 0) {
+			goto L_ERROR;
+		}
 	}
 
 	r = parsesegments(PBLC);
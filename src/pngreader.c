@@ -18,6 +18,8 @@
 #include <jdeflate/inflator.h>
 #include <ctoolbox/memory.h>
 #include <ctoolbox/ckdint.h>
+#include "imgthreads.h"
+#include "imgcpu.h"
 
 
 #if defined(PNGR_CFG_DOCRC)
@@ -30,6 +32,43 @@
 	#include <ctoolbox/crypto/crc32.h>
 #endif
 
+#if defined(PNGR_CFG_NOINTRINSICS)
+	#define DOSSE2 0
+	#define DOX64  0
+#else
+	#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+		#define DOSSE2 1
+	#else
+		#define DOSSE2 0
+	#endif
+
+	#if defined(__x86_64__) || defined(_M_X64) || defined(_M_AMD64)
+		#define DOX64 1
+	#else
+		#define DOX64 0
+	#endif
+#endif
+
+#if DOSSE2
+	#include <emmintrin.h>
+#endif
+
+/* the SSE4.1, AVX2 and AVX-512 kernels are compiled for their instruction
+ * set and only called when the CPU has it */
+#if DOX64
+	#include <immintrin.h>
+
+	#if defined(__GNUC__) || defined(__clang__)
+		#define TARGETSSE41  __attribute__((target("sse4.1")))
+		#define TARGETAVX2   __attribute__((target("avx2")))
+		#define TARGETAVX512 __attribute__((target("avx512f,avx512bw")))
+	#else
+		#define TARGETSSE41
+		#define TARGETAVX2
+		#define TARGETAVX512
+	#endif
+#endif
+
 
 /* chunk size limit for ICCP, ITXT, ZTXT and TEXT chunks or unknown
  * chunks (8MB) */
@@ -57,6 +96,7 @@ struct TPNGRPrvt {
 		uintxx CHRM: 1;
 		uintxx TRNS: 1;
 		uintxx SRGB: 1;
+		uintxx IDOT: 1;
 	} chunkmap;
 
 	uintxx docrc;
@@ -67,6 +107,10 @@ struct TPNGRPrvt {
 	uint8* prevrow;
 	uint8* rbuffers[2];
 
+	/* set when the rows are inflated and unfiltered in place on the
+	 * output buffer */
+	uintxx inplace;
+
 	/* raw scanline before decoding, including the filter byte */
 	uintxx rawrowsize;
 	uintxx rawpelsize;
@@ -82,6 +126,38 @@ struct TPNGRPrvt {
 	uint8* pixels;
 	uint8* idxs;
 
+	/* crop window (see pngr_setcrop), the whole image by default */
+	uintxx cropy;
+	uintxx cropx;
+	uintxx cropsizey;
+	uintxx cropsizex;
+
+	/* streaming output (see pngr_setoutputfn), outrow is the buffer used to
+	 * convert the rows (when the unfiltered row can't be used directly) */
+	TIMGOutputFn outputfn;
+	void* outputuser;
+	uint8* outrow;
+
+	/* next row decoded by pngr_decoderows and the input state at the start
+	 * of the image data (memory source), used to restart the decoding */
+	uintxx nextrow;
+	uint8* idatbgn;
+	uintxx idatremaining;
+	uint32 idatcrc32;
+	uintxx idatdocrc;
+
+	/* number of threads (see pngr_setthreads) and the ring of row buffers
+	 * shared by the inflate and the unfilter threads (nslots rows) */
+	uintxx nthreads;
+	uint8* ring;
+	uintxx nslots;
+
+	/* bands of rows with their own deflate stream (see parseIDOT), the
+	 * first row of each band and the start of its first IDAT chunk */
+	uintxx nbands;
+	uintxx bandy[IMGTHR_MAXTASKS + 1];
+	uint8* bandbgn[IMGTHR_MAXTASKS];
+
 	/* internal memory */
 	uint8* mainmemory;
 	uintxx mainmsize;
@@ -102,6 +178,10 @@ struct TPNGRPrvt {
 	/* input callback parameter */
 	void* payload;
 
+	/* memory source, when set the input is read directly from it */
+	uint8* mbgn;
+	uint8* mend;
+
 	/* inflate state */
 	struct TInflator* inflator;
 
@@ -119,6 +199,10 @@ struct TPNGRPrvt {
 
 	/* custom allocator */
 	struct TAllocator* allctr;
+
+	/* unfilter kernels for each filter type (1 to 4), selected at creation
+	 * from the CPU features */
+	void (*unfilter[5])(uint8*, uint8*, uintxx, uintxx);
 };
 
 
@@ -146,6 +230,8 @@ dispose_(struct TPNGRPrvt* p, void* memory, uintxx amount)
 	a->dispose(memory, amount, a->user);
 }
 
+static void setkernels(struct TPNGRPblc*);
+
 TPNGReader*
 pngr_create(ePNGRFlags flags, TAllocator* allctr)
 {
@@ -168,6 +254,7 @@ pngr_create(ePNGRFlags flags, TAllocator* allctr)
 	PRVT->iccpmemory = NULL;
 	PRVT->mainmemory = NULL;
 	pngr_reset(pngr);
+	setkernels(pngr);
 
 	PBLC->flags = flags;
 	return pngr;
@@ -237,7 +324,7 @@ pngr_reset(TPNGReader* pngr)
 	PBLC->physunit = 0;
 
 	/* private stuff */
-	PRVT->chunkmap = (struct TPNGRChunkMap) {0, 0, 0, 0, 0, 0, 0, 0, 0};
+	PRVT->chunkmap = (struct TPNGRChunkMap) {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 	PRVT->hasalpha = 0;
 
 	PRVT->crc32 = 0;
@@ -246,9 +333,31 @@ pngr_reset(TPNGReader* pngr)
 	PRVT->interpolate = 0;
 	PRVT->pass = 0;
 
+	PRVT->inplace = 0;
+
 	PRVT->pixels = NULL;
 	PRVT->idxs   = NULL;
 
+	PRVT->outputfn   = NULL;
+	PRVT->outputuser = NULL;
+	PRVT->outrow     = NULL;
+
+	PRVT->nextrow = 0;
+	PRVT->idatbgn = NULL;
+	PRVT->idatremaining = 0;
+	PRVT->idatcrc32 = 0;
+	PRVT->idatdocrc = 0;
+
+	PRVT->nthreads = 1;
+	PRVT->ring   = NULL;
+	PRVT->nslots = 0;
+	PRVT->nbands = 0;
+
+	PRVT->cropy = 0;
+	PRVT->cropx = 0;
+	PRVT->cropsizey = 0;
+	PRVT->cropsizex = 0;
+
 	if (PRVT->mainmemory) {
 		dispose_(PRVT, PRVT->mainmemory, PRVT->mainmsize);
 		PRVT->mainmemory = NULL;
@@ -267,6 +376,8 @@ pngr_reset(TPNGReader* pngr)
 
 	PRVT->payload = NULL;
 	PRVT->inputfn = NULL;
+	PRVT->mbgn = NULL;
+	PRVT->mend = NULL;
 	inflator_reset(PRVT->inflator);
 }
 
@@ -302,6 +413,92 @@ pngr_setinputfn(TPNGReader* pngr, TIMGInputFn fn, void* user)
 
 	PRVT->inputfn = fn;
 	PRVT->payload = user;
+	PRVT->mbgn = NULL;
+	PRVT->mend = NULL;
+}
+
+void
+pngr_setsource(TPNGReader* pngr, const uint8* data, uintxx size)
+{
+	CTB_ASSERT(pngr && data);
+
+	if (pngr->state) {
+		SETSTATE(PNGR_BADSTATE);
+		if (pngr->error == 0) {
+			SETERROR(PNGR_EINCORRECTUSE);
+		}
+		return;
+	}
+
+	PRVT->mbgn = (uint8*) data;
+	PRVT->mend = (uint8*) data + size;
+	PRVT->inputfn = NULL;
+	PRVT->payload = NULL;
+}
+
+void
+pngr_setcrop(TPNGReader* pngr, uintxx y, uintxx x, uintxx sizey, uintxx sizex)
+{
+	CTB_ASSERT(pngr);
+
+	if (pngr->state != 0 || sizey == 0 || sizex == 0) {
+		SETSTATE(PNGR_BADSTATE);
+		if (pngr->error == 0) {
+			SETERROR(PNGR_EINCORRECTUSE);
+		}
+		return;
+	}
+
+	PRVT->cropy = y;
+	PRVT->cropx = x;
+	PRVT->cropsizey = sizey;
+	PRVT->cropsizex = sizex;
+}
+
+void
+pngr_setthreads(TPNGReader* pngr, uintxx nthreads)
+{
+	CTB_ASSERT(pngr);
+
+	if (pngr->state != 0) {
+		SETSTATE(PNGR_BADSTATE);
+		if (pngr->error == 0) {
+			SETERROR(PNGR_EINCORRECTUSE);
+		}
+		return;
+	}
+
+	if (nthreads == 0) {
+		nthreads = 1;
+	}
+	if (nthreads > IMGTHR_MAXTASKS) {
+		nthreads = IMGTHR_MAXTASKS;
+	}
+	PRVT->nthreads = nthreads;
+}
+
+
+#define ISMEMSOURCE(R) (((struct TPNGRPrvt*) (R))->mend != NULL)
+
+/* returns a pointer to the next size bytes of the memory source */
+CTB_INLINE uint8*
+frommemory(struct TPNGRPblc* pngr, uintxx size)
+{
+	uint8* s;
+
+	s = PRVT->mbgn;
+	if (CTB_UNLIKELY((uintxx) (PRVT->mend - s) < size)) {
+		SETERROR(PNGR_EBADDATA);
+		return NULL;
+	}
+	PRVT->mbgn += size;
+
+#if DOCRC
+	if (PRVT->docrc) {
+		PRVT->crc32 = crc32_update(PRVT->crc32, s, size);
+	}
+#endif
+	return s;
 }
 
 CTB_INLINE bool
@@ -309,6 +506,16 @@ readinput(struct TPNGRPblc* pngr, uint8* buffer, uintxx size)
 {
 	intxx r;
 
+	if (ISMEMSOURCE(pngr)) {
+		uint8* s;
+
+		if ((s = frommemory(pngr, size)) == NULL) {
+			return 0;
+		}
+		ctb_memcpy(buffer, s, size);
+		return 1;
+	}
+
 	r = PRVT->inputfn(buffer, size, PRVT->payload);
 	if (CTB_UNLIKELY(r ^ size)) {
 		static const uintxx error[] = {
@@ -332,6 +539,11 @@ readinput(struct TPNGRPblc* pngr, uint8* buffer, uintxx size)
 #define TOI32(A, B, C, D) ((A << 0x18) | (B << 0x10) | (C << 0x08) | (D))
 #define TOI16(A, B)       ((A << 0x08) | (B))
 
+/* unsigned version of TOI32 for the values that can use all the 32 bits */
+#define TOU32(S) \
+	(((uintxx) (S)[0] << 0x18) | ((uintxx) (S)[1] << 0x10) | \
+	 ((uintxx) (S)[2] << 0x08) | ((uintxx) (S)[3]))
+
 
 /* chunk header */
 struct TChunkHead {
@@ -345,11 +557,20 @@ CTB_INLINE struct TChunkHead
 getchunkhead(struct TPNGRPblc* pngr)
 {
 	struct TChunkHead head;
-	uint8 s[8];
+	uint8 b[8];
+	uint8* s;
 
-	s[7] = 0x00;
-	if (readinput(pngr, s, 8) == 0) {
-		return (struct TChunkHead) {0, {0, 0, 0, 0}};
+	if (ISMEMSOURCE(pngr)) {
+		if ((s = frommemory(pngr, 8)) == NULL) {
+			return (struct TChunkHead) {0, {0, 0, 0, 0}};
+		}
+	}
+	else {
+		s = b;
+		s[7] = 0x00;
+		if (readinput(pngr, s, 8) == 0) {
+			return (struct TChunkHead) {0, {0, 0, 0, 0}};
+		}
 	}
 
 	head.length = TOI32(s[0], s[1], s[2], s[3]);
@@ -379,6 +600,7 @@ getchunkhead(struct TPNGRPblc* pngr)
 #define CRC32_SRGB 0xEFE32C31
 #define CRC32_BKGD 0xFDD22101
 #define CRC32_PHYS 0x5216BA54
+#define CRC32_IDOT 0xF4E17B51
 
 
 #if DOCRC
@@ -614,6 +836,7 @@ static bool parseICCP(struct TPNGRPblc*, struct TChunkHead);
 static bool parseSRGB(struct TPNGRPblc*, struct TChunkHead);
 static bool parseBKGD(struct TPNGRPblc*, struct TChunkHead);
 static bool parsePHYS(struct TPNGRPblc*, struct TChunkHead);
+static bool parseIDOT(struct TPNGRPblc*, struct TChunkHead);
 
 static bool parseancillary(struct TPNGRPblc*, uint32, struct TChunkHead);
 
@@ -701,6 +924,10 @@ consumechunk(struct TPNGRPblc* pngr, uintxx total)
 {
 	uintxx j;
 
+	if (ISMEMSOURCE(pngr)) {
+		return frommemory(pngr, total) != NULL;
+	}
+
 	while (total) {
 		j = sizeof(PRVT->source);
 		if (j > total)
@@ -767,6 +994,12 @@ parseancillary(struct TPNGRPblc* pngr, uint32 fcc, struct TChunkHead head)
 			}
 			return 1;
 
+		case TOI32('i', 'D', 'O', 'T'):
+			if (parseIDOT(pngr, head) == 0) {
+				return 0;
+			}
+			return 1;
+
 		default:
 			/* we don't care about duplicated or malformed chunks that we
 			 * don't neeed to parse to recompose the final image.
@@ -971,23 +1204,132 @@ setvalues(struct TPNGRPblc* pngr, struct TImageInfo* info)
 	PRVT->rowsize = pelsize * pngr->sizex;
 	PRVT->pelsize = pelsize;
 
+	/* crop window, the whole image if not set */
+	if (PRVT->cropsizey == 0) {
+		PRVT->cropy = 0;
+		PRVT->cropx = 0;
+		PRVT->cropsizey = pngr->sizey;
+		PRVT->cropsizex = pngr->sizex;
+	}
+
 	/* sets the imageinfo struct */
-	info->sizex = pngr->sizex;
-	info->sizey = pngr->sizey;
+	info->sizex = PRVT->cropsizex;
+	info->sizey = PRVT->cropsizey;
 	info->colortype = mode;
 
 	info->depth = 8;
 	if (pngr->depth == 16) {
 		info->depth = 16;
 	}
-	info->size = imginfo_getrowsize(info) * pngr->sizey;
+	info->size = imginfo_getrowsize(info) * PRVT->cropsizey;
+
+	return 1;
+}
+
+/* checks if the unfiltered rows can be used as final pixels, the last row is
+ * always decoded apart because the unfilter function writes past the end of
+ * the row (up to 16 bytes, so the last row must be at least that long to
+ * keep the writes of the row above inside the buffer) */
+CTB_INLINE bool
+caninplace(struct TPNGRPblc* pngr)
+{
+	if (pngr->interlace || pngr->depth ^ 8 || pngr->sizey < 2) {
+		return 0;
+	}
+	if (PRVT->rowsize < 16) {
+		return 0;
+	}
+	if (pngr->colortype == 3 || PRVT->hasalpha) {
+		return 0;
+	}
+	if (PRVT->cropsizey != pngr->sizey || PRVT->cropsizex != pngr->sizex) {
+		return 0;
+	}
+	return 1;
+}
+
+/* minimum size of the image data and memory used by the row ring of the
+ * pipelined decoding */
+#define PIPEMINSIZE 0x40000L
+#define PIPEMEMORY  0x40000L
+
+#define PIPEMINSLOTS 4
+#define PIPEMAXSLOTS 64
+
+/* gets the number of rows of the ring used to inflate and unfilter the rows
+ * in two threads, 0 if the image is decoded in a single thread (the thread
+ * switching costs more than it saves on small images) */
+static uintxx
+getslots(struct TPNGRPblc* pngr)
+{
+	uintxx n;
+
+	if (PRVT->nthreads < 2 || pngr->interlace) {
+		return 0;
+	}
+	if (PRVT->rawrowsize * pngr->sizey < PIPEMINSIZE) {
+		return 0;
+	}
+
+	n = PIPEMEMORY / PRVT->rowmemory;
+	if (n < PIPEMINSLOTS) {
+		n = PIPEMINSLOTS;
+	}
+	if (n > PIPEMAXSLOTS) {
+		n = PIPEMAXSLOTS;
+	}
+	return n;
+}
+
+#undef PIPEMINSIZE
+#undef PIPEMEMORY
+#undef PIPEMINSLOTS
+#undef PIPEMAXSLOTS
+
+/* checks if the bands of an iDOT chunk are decoded in parallel, only with an
+ * image buffer (the rows are decoded out of order) */
+CTB_INLINE bool
+canusebands(struct TPNGRPblc* pngr)
+{
+	return PRVT->nbands && PRVT->nthreads > 1 && PRVT->outputfn == NULL;
+}
 
+/* gets the memory used by the private copy of the reader for each band but
+ * the first one (the state and the two row buffers) */
+CTB_INLINE uintxx
+getbandsize(struct TPNGRPblc* pngr)
+{
+	uintxx size;
+
+	size = sizeof(struct TPNGRPrvt) + (PRVT->rowmemory << 1);
+	return (size + 63) & ((uintxx) -64);
+}
+
+/* the crop window must be inside the image, crop is not supported for
+ * interlaced images */
+CTB_INLINE bool
+checkcrop(struct TPNGRPblc* pngr)
+{
+	if (PRVT->cropsizey == 0) {
+		return 1;
+	}
+	if (pngr->interlace) {
+		return 0;
+	}
+	if (PRVT->cropy >= pngr->sizey || PRVT->cropx >= pngr->sizex) {
+		return 0;
+	}
+	if (PRVT->cropsizey > pngr->sizey - PRVT->cropy ||
+		PRVT->cropsizex > pngr->sizex - PRVT->cropx) {
+		return 0;
+	}
 	return 1;
 }
 
 uintxx
 pngr_initdecoder(TPNGReader* pngr, TImageInfo* info)
 {
+	uintxx i;
 	CTB_ASSERT(pngr && info);
 
 	if (pngr->state) {
@@ -997,8 +1339,8 @@ pngr_initdecoder(TPNGReader* pngr, TImageInfo* info)
 		goto L_ERROR;
 	}
 
-	/* at this point we need an input function */
-	if (PRVT->inputfn == NULL) {
+	/* at this point we need an input function or a memory source */
+	if (PRVT->inputfn == NULL && ISMEMSOURCE(pngr) == 0) {
 		SETERROR(PNGR_EIOERROR);
 		goto L_ERROR;
 	}
@@ -1018,6 +1360,10 @@ pngr_initdecoder(TPNGReader* pngr, TImageInfo* info)
 
 		/* parse all the chunks until the first IDAT chunk */
 		if (parseIHDR(PBLC, head) && parsechunks(PBLC)) {
+			if (checkcrop(PBLC) == 0) {
+				SETERROR(PNGR_EINCORRECTUSE);
+				goto L_ERROR;
+			}
 			if (setvalues(PBLC, info)) {
 				if (pngr->interlace) {
 					setuppasses(PBLC);
@@ -1027,11 +1373,29 @@ pngr_initdecoder(TPNGReader* pngr, TImageInfo* info)
 				PRVT->tbgn = PRVT->target;
 				PRVT->tend = PRVT->target;
 
+				/* start of the image data (see pngr_decoderows) */
+				if (ISMEMSOURCE(pngr)) {
+					PRVT->idatbgn = PRVT->mbgn;
+					PRVT->idatremaining = PRVT->remaining;
+					PRVT->idatcrc32 = PRVT->crc32;
+					PRVT->idatdocrc = PRVT->docrc;
+				}
+
 				PRVT->result = INFLT_SRCEXHSTD;
 
 				/* ready to start decoding */
 				SETSTATE(1);
 				PBLC->requiredmemory = PRVT->rowmemory << 1;
+				if (caninplace(PBLC)) {
+					PBLC->requiredmemory = PRVT->rowmemory;
+				}
+				if ((i = getslots(PBLC)) != 0) {
+					PBLC->requiredmemory = PRVT->rowmemory * (i + 2);
+				}
+				if (canusebands(PBLC)) {
+					i = (PRVT->nbands - 1) * getbandsize(PBLC);
+					PBLC->requiredmemory += i;
+				}
 				return 1;
 			}
 
@@ -1050,6 +1414,7 @@ void
 pngr_setbuffers(TPNGReader* pngr, uint8* pixels, uint8* idxs)
 {
 	uintxx i;
+	uintxx total;
 	CTB_ASSERT(pngr);
 
 	if (pngr->state ^ 1) {
@@ -1060,17 +1425,50 @@ pngr_setbuffers(TPNGReader* pngr, uint8* pixels, uint8* idxs)
 		return;
 	}
 
+	/* in place decoding only needs a single row, it is used as the zero
+	 * row above the first one and then to decode the last row, with the
+	 * pipelined decoding the rows are inflated to the ring */
+	PRVT->nslots = 0;
+	if (canusebands(PBLC) == 0) {
+		PRVT->nslots = getslots(PBLC);
+	}
+
+	PRVT->inplace = 0;
+	if (pixels != NULL && caninplace(PBLC)) {
+		PRVT->inplace = PRVT->nslots == 0 && canusebands(PBLC) == 0;
+	}
+
+	total = PRVT->rowmemory << 1;
+	if (PRVT->inplace) {
+		total = PRVT->rowmemory;
+	}
+	if (PRVT->outputfn) {
+		total += PRVT->cropsizex * PRVT->pelsize;
+	}
+	total += PRVT->nslots * PRVT->rowmemory;
+
 	CTB_ASSERT(PRVT->mainmemory == NULL);
-	PRVT->mainmemory = request_(PRVT, PBLC->requiredmemory);
+	PRVT->mainmemory = request_(PRVT, total);
 	if (PRVT->mainmemory == NULL) {
 		SETSTATE(PNGR_BADSTATE);
 		SETERROR(PNGR_EOOM);
 		return;
 	}
-	PRVT->mainmsize = PBLC->requiredmemory;
+	PRVT->mainmsize = total;
 
 	PRVT->rbuffers[0] = PRVT->mainmemory;
 	PRVT->rbuffers[1] = PRVT->mainmemory + PRVT->rowmemory;
+	if (PRVT->inplace) {
+		PRVT->rbuffers[1] = PRVT->mainmemory;
+	}
+
+	if (PRVT->outputfn) {
+		PRVT->outrow = PRVT->mainmemory + (PRVT->rowmemory << 1);
+	}
+	if (PRVT->nslots) {
+		i = PRVT->nslots * PRVT->rowmemory;
+		PRVT->ring = PRVT->mainmemory + (total - i);
+	}
 
 	PRVT->currrow = PRVT->rbuffers[0];
 	PRVT->prevrow = PRVT->rbuffers[1];
@@ -1087,6 +1485,24 @@ pngr_setbuffers(TPNGReader* pngr, uint8* pixels, uint8* idxs)
 	SETSTATE(2);
 }
 
+void
+pngr_setoutputfn(TPNGReader* pngr, TIMGOutputFn fn, void* user)
+{
+	CTB_ASSERT(pngr && fn);
+
+	if (pngr->state ^ 1 || pngr->interlace) {
+		SETSTATE(PNGR_BADSTATE);
+		if (pngr->error == 0) {
+			SETERROR(PNGR_EINCORRECTUSE);
+		}
+		return;
+	}
+
+	PRVT->outputfn   = fn;
+	PRVT->outputuser = user;
+	pngr_setbuffers(pngr, NULL, NULL);
+}
+
 static bool
 parsePLTE(struct TPNGRPblc* pngr, struct TChunkHead head)
 {
@@ -1585,6 +2001,93 @@ parsePHYS(struct TPNGRPblc* pngr, struct TChunkHead head)
 	return 1;
 }
 
+/* Apple's iDOT chunk (not documented), the image data is split in bands of
+ * rows and the deflate stream of each band (after a full flush) starts on
+ * its own IDAT chunk. The chunk has the number of bands, a zero, the rows of
+ * the first band and the chunk size, followed by the rows of each band and
+ * the offset (from the start of the iDOT chunk) of the first IDAT chunk of
+ * each band but the first one, all of them 32 bit values. The bands are only
+ * used with a memory source, a malformed chunk is ignored */
+static bool
+parseIDOT(struct TPNGRPblc* pngr, struct TChunkHead head)
+{
+	uint8* bgn;
+	uint8* s;
+	uintxx n;
+	uintxx i;
+	uintxx y;
+	uintxx rows;
+	uintxx offset;
+	uintxx limit;
+
+	n = 0;
+	bgn = NULL;
+	if (PRVT->chunkmap.IDOT == 0 && pngr->state != 4) {
+		if (ISMEMSOURCE(pngr) && pngr->interlace == 0) {
+			/* start of the chunk */
+			bgn = PRVT->mbgn - 8;
+			n = IMGTHR_MAXTASKS;
+		}
+	}
+	PRVT->chunkmap.IDOT = 1;
+	PRVT->nbands = 0;
+
+	INITCRC32(pngr, CRC32_IDOT);
+	if (n == 0 || head.length > 12 + 8 * n) {
+		if (consumechunk(pngr, head.length) == 0) {
+			return 0;
+		}
+		checkcrc32(pngr);
+		if (pngr->error) {
+			return 0;
+		}
+		return 1;
+	}
+
+	s = PRVT->source;
+	if (readinput(pngr, s, head.length) == 0) {
+		return 0;
+	}
+	checkcrc32(pngr);
+	if (pngr->error) {
+		return 0;
+	}
+
+	n = TOU32(s);
+	if (n < 2 || n > IMGTHR_MAXTASKS || head.length != 12 + 8 * n) {
+		return 1;
+	}
+	s += 16;
+
+	for (y = i = 0; i < n; i++) {
+		rows = TOU32(s); s += 4;
+		if (rows == 0 || rows > pngr->sizey - y) {
+			return 1;
+		}
+		PRVT->bandy[i] = y;
+		y += rows;
+	}
+	if (y != pngr->sizey) {
+		return 1;
+	}
+
+	limit = (uintxx) (PRVT->mend - bgn);
+	PRVT->bandbgn[0] = NULL;
+	for (i = 1; i < n; i++) {
+		offset = TOU32(s); s += 4;
+		if (offset >= limit) {
+			return 1;
+		}
+		PRVT->bandbgn[i] = bgn + offset;
+		if (i > 1 && PRVT->bandbgn[i] <= PRVT->bandbgn[i - 1]) {
+			return 1;
+		}
+	}
+	PRVT->bandy[n] = pngr->sizey;
+	PRVT->nbands = n;
+	return 1;
+}
+
 
 #define SRCBUFFERSZ sizeof(((struct TPNGRPrvt*) 0)->source)
 #define TGTBUFFERSZ sizeof(((struct TPNGRPrvt*) 0)->target)
@@ -1871,11 +2374,12 @@ parseICCP(struct TPNGRPblc* pngr, struct TChunkHead head)
 #undef ADDWARNING
 
 #undef TOI32
+#undef TOU32
 #undef TOI16
 
 
 static uintxx
-inflateidat(struct TPNGRPblc* pngr)
+inflateidat(struct TPNGRPblc* pngr, uint8* target, uintxx size)
 {
 	uintxx r;
 	uintxx limit;
@@ -1909,16 +2413,29 @@ inflateidat(struct TPNGRPblc* pngr)
 				continue;
 			}
 
-			if (limit > SRCBUFFERSZ) {
-				limit = SRCBUFFERSZ;
-			}
+			if (ISMEMSOURCE(pngr)) {
+				uint8* s;
 
-			if (readinput(pngr, PRVT->source, limit) == 0) {
-				return 0;
+				/* the whole chunk is consumed in place */
+				if ((s = frommemory(pngr, limit)) == NULL) {
+					return 0;
+				}
+				PRVT->remaining -= (PRVT->inputsize = limit);
+
+				inflator_setsrc(PRVT->inflator, s, limit);
 			}
-			PRVT->remaining -= (PRVT->inputsize = limit);
+			else {
+				if (limit > SRCBUFFERSZ) {
+					limit = SRCBUFFERSZ;
+				}
 
-			inflator_setsrc(PRVT->inflator, PRVT->source, limit);
+				if (readinput(pngr, PRVT->source, limit) == 0) {
+					return 0;
+				}
+				PRVT->remaining -= (PRVT->inputsize = limit);
+
+				inflator_setsrc(PRVT->inflator, PRVT->source, limit);
+			}
 		}
 		else {
 			if (PRVT->result ^ INFLT_TGTEXHSTD) {
@@ -1928,7 +2445,7 @@ inflateidat(struct TPNGRPblc* pngr)
 			}
 		}
 
-		inflator_settgt(PRVT->inflator, PRVT->target, TGTBUFFERSZ);
+		inflator_settgt(PRVT->inflator, target, size);
 
 		PRVT->result = inflator_inflate(PRVT->inflator, 0);
 		if (PRVT->result == INFLT_ERROR) {
@@ -1947,7 +2464,6 @@ inflateidat(struct TPNGRPblc* pngr)
 }
 
 #undef SRCBUFFERSZ
-#undef TGTBUFFERSZ
 
 
 CTB_INLINE uintxx
@@ -1988,7 +2504,7 @@ checktail(struct TPNGRPblc* pngr)
 {
 	if (PRVT->result == INFLT_SRCEXHSTD ||
 		PRVT->result == INFLT_TGTEXHSTD) {
-		inflateidat(pngr);
+		inflateidat(pngr, PRVT->target, TGTBUFFERSZ);
 	}
 
 	if (PRVT->result == INFLT_OK) {
@@ -2016,6 +2532,11 @@ checktail(struct TPNGRPblc* pngr)
 	return 0;
 }
 
+/* rows of at least this size are inflated directly into the row buffer,
+ * smaller ones are served from the target buffer to avoid calling the
+ * inflator for just a few bytes */
+#define DIRECTMINSZ 512
+
 CTB_INLINE bool
 fetchrow(struct TPNGRPblc* pngr, uint8* target, uintxx size)
 {
@@ -2040,24 +2561,32 @@ fetchrow(struct TPNGRPblc* pngr, uint8* target, uintxx size)
 		else {
 			uintxx r;
 
-			if (CTB_UNLIKELY((r = inflateidat(pngr)) == 0)) {
+			if (total >= DIRECTMINSZ) {
+				/* the row may span several inflate calls */
+				r = inflateidat(pngr, target, total);
+				if (CTB_UNLIKELY(r == 0)) {
+					return 0;
+				}
+				target += r;
+				total  -= r;
+				continue;
+			}
+
+			r = inflateidat(pngr, PRVT->target, TGTBUFFERSZ);
+			if (CTB_UNLIKELY(r == 0)) {
 				return 0;
 			}
 			PRVT->tbgn = PRVT->target;
 			PRVT->tend = PRVT->tbgn + r;
-			continue;
 		}
 	}
 
 	return 1;
 }
 
+#undef DIRECTMINSZ
+#undef TGTBUFFERSZ
 
-#if defined(PNGR_CFG_EXTERNALASM)
-
-extern void pngr_unfilterASM(uint8*, uint8*, uintxx, uintxx);
-
-#else
 
 CTB_INLINE uint8
 paetchfilter(uint8 a, uint8 b, uint8 c)
@@ -2156,7 +2685,340 @@ unfilter(uint8* curr, uint8* prev, uintxx size, uintxx fp)
 	}
 }
 
+
+#if DOSSE2
+
+/* SSE2 version of the unfilter function, the rows must have 16 bytes of
+ * padding */
+
+CTB_INLINE __m128i
+loadpel(uint8* p)
+{
+	return _mm_loadl_epi64((__m128i*) p);
+}
+
+CTB_INLINE void
+storepel(uint8* p, __m128i v, uintxx size)
+{
+	uint32 a;
+	uint32 b;
+
+	if (size == 8) {
+		_mm_storel_epi64((__m128i*) p, v);
+		return;
+	}
+
+	a = (uint32) _mm_cvtsi128_si32(v);
+	p[0] = (uint8) (a >> 0x00);
+	p[1] = (uint8) (a >> 0x08);
+	p[2] = (uint8) (a >> 0x10);
+	if (size == 3) {
+		return;
+	}
+	p[3] = (uint8) (a >> 0x18);
+	if (size == 6) {
+		b = (uint32) _mm_cvtsi128_si32(_mm_srli_si128(v, 4));
+		p[4] = (uint8) (b >> 0x00);
+		p[5] = (uint8) (b >> 0x08);
+	}
+}
+
+CTB_INLINE void
+subfilterSSE2(uint8* curr, uintxx size, uintxx psize)
+{
+	__m128i a;
+	uintxx i;
+
+	a = _mm_setzero_si128();
+	for (i = 0; i < size; i += psize) {
+		a = _mm_add_epi8(loadpel(curr + i), a);
+		storepel(curr + i, a, psize);
+	}
+}
+
+CTB_INLINE void
+avgfilterSSE2(uint8* curr, uint8* prev, uintxx size, uintxx psize)
+{
+	__m128i a;
+	__m128i b;
+	__m128i m;
+	__m128i one;
+	uintxx i;
+
+	one = _mm_set1_epi8(1);
+
+	a = _mm_setzero_si128();
+	for (i = 0; i < size; i += psize) {
+		b = loadpel(prev + i);
+
+		/* (a + b) >> 1, without the rounding of pavgb */
+		m = _mm_and_si128(_mm_xor_si128(a, b), one);
+		m = _mm_sub_epi8(_mm_avg_epu8(a, b), m);
+
+		a = _mm_add_epi8(loadpel(curr + i), m);
+		storepel(curr + i, a, psize);
+	}
+}
+
+CTB_INLINE void
+paethfilterSSE2(uint8* curr, uint8* prev, uintxx size, uintxx psize)
+{
+	__m128i a, b, c;
+	__m128i pa, pb, pc;
+	__m128i m;
+	__m128i zero;
+	uintxx i;
+
+	zero = _mm_setzero_si128();
+
+	a = zero;
+	c = zero;
+	for (i = 0; i < size; i += psize) {
+		b = _mm_unpacklo_epi8(loadpel(prev + i), zero);
+
+		/* p = a + b - c, pa = |p - a|, pb = |p - b|, pc = |p - c| */
+		pa = _mm_sub_epi16(b, c);
+		pb = _mm_sub_epi16(a, c);
+		pc = _mm_add_epi16(pa, pb);
+		pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+		pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+		pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+		/* the ties are resolved in the order a, b, c */
+		m = _mm_min_epi16(pa, _mm_min_epi16(pb, pc));
+		c = _mm_or_si128(
+			_mm_and_si128(_mm_cmpeq_epi16(m, pb), b),
+			_mm_andnot_si128(_mm_cmpeq_epi16(m, pb), c));
+		c = _mm_or_si128(
+			_mm_and_si128(_mm_cmpeq_epi16(m, pa), a),
+			_mm_andnot_si128(_mm_cmpeq_epi16(m, pa), c));
+
+		a = _mm_add_epi8(_mm_packus_epi16(c, c), loadpel(curr + i));
+		storepel(curr + i, a, psize);
+
+		a = _mm_unpacklo_epi8(a, zero);
+		c = b;
+	}
+}
+
+static void
+unfilterSSE2(uint8* curr, uint8* prev, uintxx size, uintxx fp)
+{
+	uintxx i;
+	uintxx psize;
+
+	psize = fp & 0xffff;
+	if (fp >> 16 == 2) {
+		for (i = 0; i < size; i += 16) {
+			__m128i a;
+			__m128i b;
+
+			a = _mm_loadu_si128((__m128i*) (curr + i));
+			b = _mm_loadu_si128((__m128i*) (prev + i));
+			_mm_storeu_si128((__m128i*) (curr + i), _mm_add_epi8(a, b));
+		}
+		return;
+	}
+
+	/* the pixels are decoded one at a time, there is no gain for the
+	 * smaller sizes */
+	if (psize < 3) {
+		unfilter(curr, prev, size, fp);
+		return;
+	}
+
+	switch (fp >> 16) {
+		case 1:
+			switch (psize) {
+				case 3: subfilterSSE2(curr, size, 3); break;
+				case 4: subfilterSSE2(curr, size, 4); break;
+				case 6: subfilterSSE2(curr, size, 6); break;
+				case 8: subfilterSSE2(curr, size, 8); break;
+			}
+			break;
+
+		case 3:
+			switch (psize) {
+				case 3: avgfilterSSE2(curr, prev, size, 3); break;
+				case 4: avgfilterSSE2(curr, prev, size, 4); break;
+				case 6: avgfilterSSE2(curr, prev, size, 6); break;
+				case 8: avgfilterSSE2(curr, prev, size, 8); break;
+			}
+			break;
+
+		case 4:
+			switch (psize) {
+				case 3: paethfilterSSE2(curr, prev, size, 3); break;
+				case 4: paethfilterSSE2(curr, prev, size, 4); break;
+				case 6: paethfilterSSE2(curr, prev, size, 6); break;
+				case 8: paethfilterSSE2(curr, prev, size, 8); break;
+			}
+			break;
+	}
+}
+
+#endif
+
+
+#if DOX64
+
+/* SSE4.1, AVX2 and AVX-512 versions, selected at creation when the CPU has
+ * the instruction set (Sub, Average and Paeth depend on the previous pixel,
+ * so only Up gains from the wider registers) */
+
+CTB_INLINE TARGETSSE41 void
+paethfilterSSE41(uint8* curr, uint8* prev, uintxx size, uintxx psize)
+{
+	__m128i a, b, c;
+	__m128i pa, pb, pc;
+	__m128i m;
+	__m128i zero;
+	uintxx i;
+
+	zero = _mm_setzero_si128();
+
+	a = zero;
+	c = zero;
+	for (i = 0; i < size; i += psize) {
+		b = _mm_unpacklo_epi8(loadpel(prev + i), zero);
+
+		pa = _mm_sub_epi16(b, c);
+		pb = _mm_sub_epi16(a, c);
+		pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+		pa = _mm_abs_epi16(pa);
+		pb = _mm_abs_epi16(pb);
+
+		/* the ties are resolved in the order a, b, c */
+		m = _mm_blendv_epi8(b, c, _mm_cmpgt_epi16(pb, pc));
+		m = _mm_blendv_epi8(a, m, _mm_cmpgt_epi16(pa, _mm_min_epi16(pb, pc)));
+
+		a = _mm_add_epi8(_mm_packus_epi16(m, m), loadpel(curr + i));
+		storepel(curr + i, a, psize);
+
+		a = _mm_unpacklo_epi8(a, zero);
+		c = b;
+	}
+}
+
+static TARGETSSE41 void
+unfilterpaethSSE41(uint8* curr, uint8* prev, uintxx size, uintxx fp)
+{
+	switch (fp & 0xffff) {
+		case 3: paethfilterSSE41(curr, prev, size, 3); break;
+		case 4: paethfilterSSE41(curr, prev, size, 4); break;
+		case 6: paethfilterSSE41(curr, prev, size, 6); break;
+		case 8: paethfilterSSE41(curr, prev, size, 8); break;
+		default:
+			unfilter(curr, prev, size, fp);
+	}
+}
+
+static TARGETAVX2 void
+unfilterupAVX2(uint8* curr, uint8* prev, uintxx size, uintxx fp)
+{
+	uintxx i;
+	__m256i a;
+	__m256i b;
+
+	(void) fp;
+	for (i = 0; i + 32 <= size; i += 32) {
+		a = _mm256_loadu_si256((__m256i*) (curr + i));
+		b = _mm256_loadu_si256((__m256i*) (prev + i));
+		_mm256_storeu_si256((__m256i*) (curr + i), _mm256_add_epi8(a, b));
+	}
+
+	/* the tail uses the padding bytes */
+	for (; i < size; i += 16) {
+		__m128i c;
+		__m128i d;
+
+		c = _mm_loadu_si128((__m128i*) (curr + i));
+		d = _mm_loadu_si128((__m128i*) (prev + i));
+		_mm_storeu_si128((__m128i*) (curr + i), _mm_add_epi8(c, d));
+	}
+}
+
+static TARGETAVX512 void
+unfilterupAVX512(uint8* curr, uint8* prev, uintxx size, uintxx fp)
+{
+	uintxx i;
+	__m512i a;
+	__m512i b;
+
+	(void) fp;
+	for (i = 0; i + 64 <= size; i += 64) {
+		a = _mm512_loadu_si512((void*) (curr + i));
+		b = _mm512_loadu_si512((void*) (prev + i));
+		_mm512_storeu_si512((void*) (curr + i), _mm512_add_epi8(a, b));
+	}
+
+	/* the tail uses the padding bytes */
+	for (; i < size; i += 16) {
+		__m128i c;
+		__m128i d;
+
+		c = _mm_loadu_si128((__m128i*) (curr + i));
+		d = _mm_loadu_si128((__m128i*) (prev + i));
+		_mm_storeu_si128((__m128i*) (curr + i), _mm_add_epi8(c, d));
+	}
+}
+
+#endif
+
+
+#if defined(PNGR_CFG_EXTERNALASM)
+
+extern void pngr_initASM(void);
+
+extern void pngr_unfilterASM(uint8*, uint8*, uintxx, uintxx);
+
+#endif
+
+static void
+setkernels(struct TPNGRPblc* pngr)
+{
+	uintxx i;
+#if DOX64
+	uintxx features;
+#endif
+
+	for (i = 1; i < 5; i++) {
+		PRVT->unfilter[i] = unfilter;
+	}
+	PRVT->unfilter[0] = NULL;
+
+#if DOSSE2
+	/* SSE2 is part of the x86-64 baseline */
+	for (i = 1; i < 5; i++) {
+		PRVT->unfilter[i] = unfilterSSE2;
+	}
+#endif
+
+#if DOX64
+	features = imgcpu_getfeatures();
+	if (features & IMGCPU_SSE41) {
+		PRVT->unfilter[4] = unfilterpaethSSE41;
+	}
+#endif
+
+#if defined(PNGR_CFG_EXTERNALASM)
+	/* the ASM function replaces the SSE2 and SSE4.1 kernels (it selects
+	 * its SSE4.1 Paeth variants by itself) */
+	pngr_initASM();
+	for (i = 1; i < 5; i++) {
+		PRVT->unfilter[i] = pngr_unfilterASM;
+	}
+#endif
+
+#if DOX64
+	if (features & IMGCPU_AVX2) {
+		PRVT->unfilter[2] = unfilterupAVX2;
+	}
+	if (features & IMGCPU_AVX512) {
+		PRVT->unfilter[2] = unfilterupAVX512;
+	}
 #endif
+}
 
 static void
 unpack(uint8* row, uintxx size, uintxx depth)
@@ -2204,182 +3066,753 @@ unpack(uint8* row, uintxx size, uintxx depth)
 			for (--i; i >= 0; i--) {
 				uint8 v;
 
-				v = row[i];
-				row[--j] = (v >> 0) & ((((uint8) 1) << 4) - 1);
-				row[--j] = (v >> 4) & ((((uint8) 1) << 4) - 1);
-			}
-			break;
+				v = row[i];
+				row[--j] = (v >> 0) & ((((uint8) 1) << 4) - 1);
+				row[--j] = (v >> 4) & ((((uint8) 1) << 4) - 1);
+			}
+			break;
+	}
+}
+
+#define UNFILTER(C, P, S, F) PRVT->unfilter[(F) >> 16]((C), (P), (S), (F))
+
+/* unfilters the fetched row (the current row) and swaps the rows */
+CTB_INLINE uint8*
+unfilterrow(struct TPNGRPblc* pngr, uintxx sizex, uintxx rowsize)
+{
+	uint8* curr;
+	uint8* prev;
+	uintxx filter;
+
+	curr = PRVT->currrow;
+	prev = PRVT->prevrow;
+
+	filter = curr[0];
+	curr++;
+	prev++;
+	if (CTB_LIKELY(filter)) {
+		if (CTB_UNLIKELY(filter > 4)) {
+			SETERROR(PNGR_EBADDATA);
+			SETSTATE(PNGR_BADSTATE);
+			return NULL;
+		}
+		UNFILTER(curr, prev, rowsize - 1, (filter << 16) | PRVT->rawpelsize);
+	}
+
+	if (CTB_UNLIKELY(pngr->depth < 8)) {
+		unpack(curr, sizex, pngr->depth);
+	}
+
+	/* swap rows */
+	PRVT->prevrow = curr - 1;
+	PRVT->currrow = prev - 1;
+	return curr;
+}
+
+CTB_INLINE uint8*
+decoderow(struct TPNGRPblc* pngr, uintxx sizex, uintxx rowsize)
+{
+	PRVT->currrow = PRVT->rbuffers[0];
+	if (PRVT->prevrow == PRVT->rbuffers[0]) {
+		PRVT->currrow = PRVT->rbuffers[1];
+	}
+
+	if (fetchrow(pngr, PRVT->currrow, rowsize) == 0) {
+		SETSTATE(PNGR_BADSTATE);
+		return NULL;
+	}
+	return unfilterrow(pngr, sizex, rowsize);
+}
+
+/* decodes all the rows but the last one directly on the output buffer, each
+ * inflate call also fetches the filter byte of the next row, it lands on the
+ * first byte of the next row so it must be read before the unfiltering */
+static uint8*
+decodeinplace(struct TPNGRPblc* pngr)
+{
+	uint8* row;
+	uint8* prev;
+	uintxx rowsize;
+	uintxx size;
+	uintxx i;
+	uint8 filter;
+
+	rowsize = PRVT->rowsize;
+
+	row  = PRVT->pixels;
+	prev = PRVT->rbuffers[0] + 1;
+	if (fetchrow(pngr, &filter, 1) == 0) {
+		return NULL;
+	}
+
+	for (i = 0; i + 1 < pngr->sizey; i++) {
+		uintxx current;
+
+		size = rowsize + 1;
+		if (i + 2 == pngr->sizey) {
+			size = rowsize;
+		}
+		if (fetchrow(pngr, row, size) == 0) {
+			return NULL;
+		}
+
+		current = filter;
+		filter  = row[rowsize];
+		if (CTB_LIKELY(current)) {
+			if (CTB_UNLIKELY(current > 4)) {
+				SETERROR(PNGR_EBADDATA);
+				return NULL;
+			}
+			UNFILTER(row, prev, rowsize, (current << 16) | PRVT->rawpelsize);
+		}
+
+		prev = row;
+		row += rowsize;
+	}
+
+	/* the last row is decoded on the row buffer using this as previous row,
+	 * its filter byte was not fetched yet */
+	PRVT->prevrow = prev - 1;
+	return row;
+}
+
+
+#if CTB_IS_LITTLEENDIAN
+	#define BYTE0_OFFSET 1
+	#define BYTE1_OFFSET 0
+#else
+	#define BYTE0_OFFSET 0
+	#define BYTE1_OFFSET 1
+#endif
+
+/* sets n pixels from the unfiltered row */
+static void
+setrow(struct TPNGRPblc* pngr, uint8* pixels, uint8* row, uintxx n)
+{
+	uintxx i;
+
+	if (PRVT->hasalpha) {
+		if (pngr->colortype == 0 || pngr->colortype == 2) {
+			if (pngr->depth ^ 16) {
+				uint8 sample[4];
+
+				sample[0] = (uint8) pngr->alpha[0];
+				sample[1] = (uint8) pngr->alpha[1];
+				sample[2] = (uint8) pngr->alpha[2];
+				if (pngr->colortype == 0) {
+					for (i = 0; i < n; i++) {
+						pixels[0] = row[0];
+						pixels[1] = 0xff;
+						if (row[0] == sample[0]) {
+							pixels[1] = 0x00;
+						}
+						pixels += 2;
+						row += 1;
+					}
+				}
+				else {
+					for (i = 0; i < n; i++) {
+						pixels[0] = row[0];
+						pixels[1] = row[1];
+						pixels[2] = row[2];
+						pixels[3] = 0xff;
+						if (row[0] == sample[0] &&
+							row[1] == sample[1] &&
+							row[2] == sample[2]) {
+							pixels[3] = 0x00;
+						}
+						pixels += 4;
+						row += 3;
+					}
+				}
+			}
+			else {
+				uint8* sample;
+
+				sample = (uint8*) pngr->alpha;
+				if (pngr->colortype == 0) {
+					for (i = 0; i < n; i++) {
+						pixels[0] = row[BYTE0_OFFSET + 0];
+						pixels[1] = row[BYTE1_OFFSET + 0];
+						pixels[2] = 0xff;
+						pixels[3] = 0xff;
+						if (pixels[0] == sample[0] &&
+							pixels[1] == sample[1]) {
+							pixels[2] = 0x00;
+							pixels[3] = 0x00;
+						}
+						pixels += 4;
+						row += 2;
+					}
+				}
+				else {
+					for (i = 0; i < n; i++) {
+						pixels[0] = row[BYTE0_OFFSET + 0];
+						pixels[1] = row[BYTE1_OFFSET + 0];
+						pixels[2] = row[BYTE0_OFFSET + 2];
+						pixels[3] = row[BYTE1_OFFSET + 2];
+						pixels[4] = row[BYTE0_OFFSET + 4];
+						pixels[5] = row[BYTE1_OFFSET + 4];
+						pixels[6] = 0xff;
+						pixels[7] = 0xff;
+						if (pixels[0] == sample[0] &&
+							pixels[1] == sample[1] &&
+							pixels[2] == sample[2] &&
+							pixels[3] == sample[3] &&
+							pixels[4] == sample[4] &&
+							pixels[5] == sample[5]) {
+							pixels[6] = 0x00;
+							pixels[7] = 0x00;
+						}
+						pixels += 8;
+						row += 6;
+					}
+				}
+			}
+			return;
+		}
+	}
+
+#if CTB_IS_LITTLEENDIAN
+	if (pngr->depth == 16) {
+		uintxx total;
+
+		total = n * (PRVT->pelsize >> 1);
+		for (i = 0; i < total; i++) {
+			*pixels++ = row[1];
+			*pixels++ = row[0];
+			row += 2;
+		}
+		return;
+	}
+#endif
+
+	ctb_memcpy(pixels, row, n * PRVT->pelsize);
+}
+
+/* converts the columns of the crop window of an unfiltered row to the final
+ * pixels (palette expansion, alpha key and byte order) */
+static void
+convertrow(struct TPNGRPblc* pngr, uint8* pixels, uint8* row)
+{
+	uintxx j;
+	uintxx n;
+	uintxx entry;
+
+	n = PRVT->cropsizex;
+	row += PRVT->cropx * PRVT->rawpelsize;
+	if (CTB_LIKELY(pngr->colortype != 3)) {
+		setrow(pngr, pixels, row, n);
+		return;
+	}
+
+	/* we don't check the range here */
+	if (PRVT->hasalpha) {
+		for (j = 0; j < n; j++) {
+			entry = row[j] * 4;
+
+			*pixels++ = pngr->palette[entry + 0];
+			*pixels++ = pngr->palette[entry + 1];
+			*pixels++ = pngr->palette[entry + 2];
+			*pixels++ = pngr->palette[entry + 3];
+		}
+		return;
+	}
+
+	for (j = 0; j < n; j++) {
+		entry = row[j] * 4;
+		*pixels++ = pngr->palette[entry + 0];
+		*pixels++ = pngr->palette[entry + 1];
+		*pixels++ = pngr->palette[entry + 2];
+	}
+}
+
+/* passes the row y (of the crop window) to the output function (streaming
+ * output), the unfiltered row is passed directly when it doesn't need a
+ * conversion, returns 0 if the function stops the decoding (the error is set
+ * by the caller) */
+static bool
+emitrow(struct TPNGRPblc* pngr, uint8* row, uintxx y)
+{
+	uint8* pixels;
+	uintxx size;
+
+	pixels = row + PRVT->cropx * PRVT->rawpelsize;
+	if (pngr->depth == 16 || pngr->colortype == 3 || PRVT->hasalpha) {
+		pixels = PRVT->outrow;
+		convertrow(pngr, pixels, row);
+	}
+
+	size = PRVT->cropsizex * PRVT->pelsize;
+	return PRVT->outputfn(pixels, y, 1, size, PRVT->outputuser) != 0;
+}
+
+/* stores the row y of the crop window in the image buffers (if set) and
+ * passes it to the output function */
+static bool
+putrow(struct TPNGRPblc* pngr, uint8* row, uintxx y)
+{
+	uint8* idxs;
+	uintxx j;
+
+	if (CTB_LIKELY(PRVT->pixels != NULL)) {
+		j = y * PRVT->cropsizex * PRVT->pelsize;
+		convertrow(pngr, PRVT->pixels + j, row);
+	}
+	if (PRVT->outputfn) {
+		if (emitrow(pngr, row, y) == 0) {
+			return 0;
+		}
+	}
+
+	if (CTB_LIKELY(PRVT->idxs != NULL)) {
+		idxs = PRVT->idxs + y * PRVT->cropsizex;
+
+		row += PRVT->cropx;
+		for (j = 0; j < PRVT->cropsizex; j++) {
+			idxs[j] = row[j];
+		}
+	}
+	return 1;
+}
+
+
+/* pipelined decoding, the rows are inflated by a second thread to a ring of
+ * row buffers while the calling thread unfilters and converts them, each
+ * thread only writes its own counter (single producer and single consumer) */
+struct TPNGRPipe {
+	struct TPNGRPblc* pngr;
+
+	/* rows to decode */
+	uintxx total;
+
+	/* rows inflated and rows whose slot can be reused (the last unfiltered
+	 * row is kept as the previous row of the next one) */
+	volatile uintxx produced;
+	volatile uintxx released;
+
+	/* set when the inflate thread fails and when the unfilter thread
+	 * stops (the inflate thread doesn't wait for a free slot) */
+	volatile uintxx failed;
+	volatile uintxx aborted;
+
+	/* error found by the unfilter thread, the reader error is only set by
+	 * the inflate thread while both threads are running */
+	uintxx error;
+};
+
+#define SLOT(N) (PRVT->ring + ((N) % PRVT->nslots) * PRVT->rowmemory)
+
+static void
+inflatetask(struct TPNGRPipe* pipe)
+{
+	struct TPNGRPblc* pngr;
+	uintxx i;
+
+	pngr = pipe->pngr;
+	for (i = 0; i < pipe->total; i++) {
+		while (i >= imgthr_load(&pipe->released) + PRVT->nslots) {
+			if (imgthr_load(&pipe->aborted)) {
+				return;
+			}
+			imgthr_yield();
+		}
+
+		if (fetchrow(pngr, SLOT(i), PRVT->rawrowsize) == 0) {
+			imgthr_store(&pipe->failed, 1);
+			return;
+		}
+		imgthr_store(&pipe->produced, i + 1);
+	}
+}
+
+static void
+unfiltertask(struct TPNGRPipe* pipe)
+{
+	struct TPNGRPblc* pngr;
+	uintxx i;
+	uint8* curr;
+	uint8* prev;
+	uintxx filter;
+	uintxx failed;
+
+	pngr = pipe->pngr;
+
+	prev = PRVT->prevrow;
+	for (i = 0; i < pipe->total; i++) {
+		/* the flag is read first, so a failed inflate thread has already
+		 * published all its rows */
+		for (;;) {
+			failed = imgthr_load(&pipe->failed);
+			if (i < imgthr_load(&pipe->produced)) {
+				break;
+			}
+			if (failed) {
+				return;
+			}
+			imgthr_yield();
+		}
+
+		curr = SLOT(i);
+
+		filter = curr[0];
+		if (CTB_LIKELY(filter)) {
+			if (CTB_UNLIKELY(filter > 4)) {
+				pipe->error = PNGR_EBADDATA;
+				break;
+			}
+			filter = (filter << 16) | PRVT->rawpelsize;
+			UNFILTER(curr + 1, prev + 1, PRVT->rawrowsize - 1, filter);
+		}
+
+		if (CTB_UNLIKELY(pngr->depth < 8)) {
+			unpack(curr + 1, pngr->sizex, pngr->depth);
+		}
+
+		if (i >= PRVT->cropy) {
+			if (putrow(pngr, curr + 1, i - PRVT->cropy) == 0) {
+				pipe->error = PNGR_EABORTED;
+				break;
+			}
+		}
+
+		prev = curr;
+		imgthr_store(&pipe->released, i);
+	}
+
+	if (pipe->error) {
+		imgthr_store(&pipe->aborted, 1);
+	}
+}
+
+#undef SLOT
+
+static void
+pipetask(void* arg, uintxx index)
+{
+	if (index) {
+		inflatetask(arg);
+		return;
+	}
+	unfiltertask(arg);
+}
+
+/* decodes the first total rows with the pipeline, returns the number of
+ * rows decoded (0 if the thread can't be created, the rows are decoded in a
+ * single thread then) */
+static uintxx
+decodepipelined(struct TPNGRPblc* pngr, uintxx total)
+{
+	struct TPNGRPipe pipe;
+
+	pipe.pngr  = pngr;
+	pipe.total = total;
+	pipe.produced = 0;
+	pipe.released = 0;
+	pipe.failed  = 0;
+	pipe.aborted = 0;
+	pipe.error = 0;
+	if (imgthr_runpair(pipetask, &pipe) == 0) {
+		return 0;
+	}
+
+	if (pipe.error) {
+		SETERROR(pipe.error);
+		SETSTATE(PNGR_BADSTATE);
+		return 0;
+	}
+	if (pipe.failed) {
+		SETSTATE(PNGR_BADSTATE);
+		return 0;
+	}
+	return total;
+}
+
+
+/* restarts the decoding at the start of the image data */
+static void
+rewindimage(struct TPNGRPblc* pngr)
+{
+	uintxx i;
+
+	PRVT->mbgn = PRVT->idatbgn;
+	PRVT->remaining = PRVT->idatremaining;
+	PRVT->crc32 = PRVT->idatcrc32;
+	PRVT->docrc = PRVT->idatdocrc;
+
+	inflator_reset(PRVT->inflator);
+	PRVT->result = INFLT_SRCEXHSTD;
+	PRVT->tbgn = PRVT->target;
+	PRVT->tend = PRVT->target;
+
+	for (i = 0; i < PRVT->rowmemory; i++) {
+		PRVT->prevrow[i] = 0;
+	}
+	PRVT->nextrow = 0;
+}
+
+
+/* parallel decoding of the bands of an iDOT chunk, each band is decoded by a
+ * copy of the reader with its own inflator, but the last one that is decoded
+ * by the reader (so the chunks after the image data are read as usual). A
+ * band whose first row is filtered with the row above (up, average and
+ * paeth filters) is stopped after fetching that row and it is finished in
+ * order when the previous band is done. If a band fails the image is
+ * decoded again in a single thread, so the errors are the same */
+struct TPNGRBand {
+	struct TPNGRPblc* pngr;
+
+	/* rows to decode */
+	uintxx first;
+	uintxx last;
+
+	uintxx deferred;
+};
+
+struct TPNGRBands {
+	struct TPNGRBand bands[IMGTHR_MAXTASKS];
+	uintxx nbands;
+	uintxx ntasks;
+};
+
+/* sets the input at the start of the IDAT chunk of a band, the deflate
+ * stream of the band doesn't have a zlib header */
+static bool
+seekband(struct TPNGRPblc* pngr, uint8* bgn)
+{
+	struct TChunkHead head;
+
+	PRVT->mbgn  = bgn;
+	PRVT->docrc = 0;
+
+	head = getchunkhead(pngr);
+	if (head.fcc[0] != 'I' ||
+		head.fcc[1] != 'D' ||
+		head.fcc[2] != 'A' || head.fcc[3] != 'T') {
+		if (pngr->error == 0) {
+			SETERROR(PNGR_EBADDATA);
+		}
+		SETSTATE(PNGR_BADSTATE);
+		return 0;
+	}
+
+	INITCRC32(pngr, CRC32_IDAT);
+	PRVT->remaining = head.length;
+
+	inflator_reset(PRVT->inflator);
+	PRVT->result = INFLT_SRCEXHSTD;
+	PRVT->tbgn = PRVT->target;
+	PRVT->tend = PRVT->target;
+	return 1;
+}
+
+/* checks that the first IDAT chunk of the bands 1 to n - 1 is one of the
+ * IDAT chunks after the current one */
+static bool
+checkbands(struct TPNGRPblc* pngr, uintxx n)
+{
+	uint8* s;
+	uintxx i;
+	uintxx length;
+
+	if ((uintxx) (PRVT->mend - PRVT->mbgn) < PRVT->remaining + 4) {
+		return 0;
+	}
+
+	s = PRVT->mbgn + PRVT->remaining + 4;
+	for (i = 1; i < n;) {
+		if ((uintxx) (PRVT->mend - s) < 12) {
+			return 0;
+		}
+		if (s[4] != 'I' || s[5] != 'D' || s[6] != 'A' || s[7] != 'T') {
+			return 0;
+		}
+		if (s == PRVT->bandbgn[i]) {
+			i++;
+		}
+
+		length = ((uintxx) s[0] << 0x18) | ((uintxx) s[1] << 0x10) |
+			((uintxx) s[2] << 0x08) | ((uintxx) s[3]);
+		if ((uintxx) (PRVT->mend - s) - 12 < length) {
+			return 0;
+		}
+		s += length + 12;
+	}
+	return 1;
+}
+
+/* decodes the rows of a band, the first one is already fetched (the errors
+ * are set on the reader of the band) */
+static void
+decodebandrows(struct TPNGRBand* band)
+{
+	struct TPNGRPblc* pngr;
+	uint8* row;
+	uintxx i;
+
+	pngr = band->pngr;
+
+	row = unfilterrow(pngr, pngr->sizex, PRVT->rawrowsize);
+	for (i = band->first; row; ) {
+		if (i >= PRVT->cropy) {
+			putrow(pngr, row, i - PRVT->cropy);
+		}
+		if (++i == band->last) {
+			break;
+		}
+		row = decoderow(pngr, pngr->sizex, PRVT->rawrowsize);
+	}
+}
+
+static void
+bandtask(void* arg, uintxx index)
+{
+	struct TPNGRBands* bands;
+	struct TPNGRBand* band;
+	struct TPNGRPblc* pngr;
+	uintxx i;
+
+	bands = arg;
+	for (i = index; i < bands->nbands; i += bands->ntasks) {
+		band = bands->bands + i;
+		pngr = band->pngr;
+		if (pngr->error) {
+			continue;
+		}
+
+		PRVT->currrow = PRVT->rbuffers[0];
+		if (fetchrow(pngr, PRVT->currrow, PRVT->rawrowsize) == 0) {
+			SETSTATE(PNGR_BADSTATE);
+			continue;
+		}
+		if (i != 0 && PRVT->currrow[0] >= 2) {
+			band->deferred = 1;
+			continue;
+		}
+		decodebandrows(band);
 	}
 }
 
-
-#if defined(PNGR_CFG_EXTERNALASM)
-	#define UNFILTER pngr_unfilterASM
-#else
-	#define UNFILTER unfilter
-#endif
-
-CTB_INLINE uint8*
-decoderow(struct TPNGRPblc* pngr, uintxx sizex, uintxx rowsize)
+/* decodes the first total rows by bands, returns the number of rows decoded
+ * (0 if the bands can't be used, the rows are decoded in a single thread
+ * then) */
+static uintxx
+decodebands(struct TPNGRPblc* pngr, uintxx total)
 {
-	uint8* curr;
-	uint8* prev;
-	uintxx filter;
+	struct TPNGRBands bands;
+	struct TPNGRBand* band;
+	struct TPNGRPrvt* copy;
+	uint8* memory;
+	uintxx bsize;
+	uintxx n;
+	uintxx i;
+	uintxx j;
 
-	PRVT->currrow = PRVT->rbuffers[0];
-	if (PRVT->prevrow == PRVT->rbuffers[0]) {
-		PRVT->currrow = PRVT->rbuffers[1];
+	/* bands with rows to decode */
+	for (n = 1; n < PRVT->nbands; n++) {
+		if (PRVT->bandy[n] >= total) {
+			break;
+		}
+	}
+	if (n == 1 || checkbands(pngr, n) == 0) {
+		return 0;
 	}
 
-	curr = PRVT->currrow;
-	prev = PRVT->prevrow;
-	if (fetchrow(pngr, curr, rowsize) == 0) {
-		SETSTATE(PNGR_BADSTATE);
-		return NULL;
+	bsize = getbandsize(pngr);
+	memory = request_(PRVT, (n - 1) * bsize);
+	if (memory == NULL) {
+		return 0;
 	}
 
-	filter = curr[0];
-	curr++;
-	prev++;
-	if (CTB_LIKELY(filter)) {
-		if (CTB_UNLIKELY(filter > 4)) {
-			SETERROR(PNGR_EBADDATA);
-			SETSTATE(PNGR_BADSTATE);
-			return NULL;
+	for (i = 0; i < n; i++) {
+		band = bands.bands + i;
+		band->first = PRVT->bandy[i];
+		band->last  = PRVT->bandy[i + 1];
+		if (band->last > total) {
+			band->last = total;
+		}
+		band->deferred = 0;
+		band->pngr = pngr;
+		if (i + 1 == n) {
+			break;
 		}
-		UNFILTER(curr, prev, rowsize - 1, (filter << 16) | PRVT->rawpelsize);
-	}
 
-	if (CTB_UNLIKELY(pngr->depth < 8)) {
-		unpack(curr, sizex, pngr->depth);
-	}
+		copy = (void*) (memory + i * bsize);
+		copy[0] = PRVT[0];
+		copy->inflator = inflator_create(PRVT->allctr);
+		if (copy->inflator == NULL) {
+			while (i--) {
+				copy = (void*) bands.bands[i].pngr;
+				inflator_destroy(copy->inflator);
+			}
+			dispose_(PRVT, memory, (n - 1) * bsize);
+			return 0;
+		}
+		copy->mainmemory = NULL;
+		copy->iccpmemory = NULL;
 
-	/* swap rows */
-	PRVT->prevrow = curr - 1;
-	PRVT->currrow = prev - 1;
-	return curr;
-}
+		copy->rbuffers[0] = (uint8*) (copy + 1);
+		copy->rbuffers[1] = copy->rbuffers[0] + PRVT->rowmemory;
+		copy->currrow = copy->rbuffers[0];
+		copy->prevrow = copy->rbuffers[1];
+		ctb_memset(copy->prevrow, 0, PRVT->rowmemory);
 
+		band->pngr = (struct TPNGRPblc*) copy;
+	}
 
-#if CTB_IS_LITTLEENDIAN
-	#define BYTE0_OFFSET 1
-	#define BYTE1_OFFSET 0
-#else
-	#define BYTE0_OFFSET 0
-	#define BYTE1_OFFSET 1
-#endif
+	for (i = 1; i < n; i++) {
+		seekband(bands.bands[i].pngr, PRVT->bandbgn[i]);
+	}
 
-static void
-setrow(struct TPNGRPblc* pngr, uint8* pixels, uint8* row)
-{
-	uintxx i;
+	bands.nbands = n;
+	bands.ntasks = n;
+	if (bands.ntasks > PRVT->nthreads) {
+		bands.ntasks = PRVT->nthreads;
+	}
+	imgthr_runtasks(bandtask, &bands, bands.ntasks);
 
-	if (PRVT->hasalpha) {
-		if (pngr->colortype == 0 || pngr->colortype == 2) {
-			if (pngr->depth ^ 16) {
-				uint8 sample[4];
+	/* finishes the deferred bands and checks the bands in order, a band
+	 * can't read the chunks of the next one */
+	for (i = 0; i < n; i++) {
+		struct TPNGRPrvt* p;
 
-				sample[0] = (uint8) pngr->alpha[0];
-				sample[1] = (uint8) pngr->alpha[1];
-				sample[2] = (uint8) pngr->alpha[2];
-				if (pngr->colortype == 0) {
-					for (i = 0; i < pngr->sizex; i++) {
-						pixels[0] = row[0];
-						pixels[1] = 0xff;
-						if (row[0] == sample[0]) {
-							pixels[1] = 0x00;
-						}
-						pixels += 2;
-						row += 1;
-					}
-				}
-				else {
-					for (i = 0; i < pngr->sizex; i++) {
-						pixels[0] = row[0];
-						pixels[1] = row[1];
-						pixels[2] = row[2];
-						pixels[3] = 0xff;
-						if (row[0] == sample[0] &&
-							row[1] == sample[1] &&
-							row[2] == sample[2]) {
-							pixels[3] = 0x00;
-						}
-						pixels += 4;
-						row += 3;
-					}
-				}
-			}
-			else {
-				uint8* sample;
+		band = bands.bands + i;
+		p = (struct TPNGRPrvt*) band->pngr;
+		if (band->deferred && p->hidden.error == 0) {
+			copy = (void*) bands.bands[i - 1].pngr;
+			ctb_memcpy(p->prevrow, copy->prevrow, PRVT->rowmemory);
+			decodebandrows(band);
+		}
 
-				sample = (uint8*) pngr->alpha;
-				if (pngr->colortype == 0) {
-					for (i = 0; i < pngr->sizex; i++) {
-						pixels[0] = row[BYTE0_OFFSET + 0];
-						pixels[1] = row[BYTE1_OFFSET + 0];
-						pixels[2] = 0xff;
-						pixels[3] = 0xff;
-						if (pixels[0] == sample[0] &&
-							pixels[1] == sample[1]) {
-							pixels[2] = 0x00;
-							pixels[3] = 0x00;
-						}
-						pixels += 4;
-						row += 2;
-					}
-				}
-				else {
-					for (i = 0; i < pngr->sizex; i++) {
-						pixels[0] = row[BYTE0_OFFSET + 0];
-						pixels[1] = row[BYTE1_OFFSET + 0];
-						pixels[2] = row[BYTE0_OFFSET + 2];
-						pixels[3] = row[BYTE1_OFFSET + 2];
-						pixels[4] = row[BYTE0_OFFSET + 4];
-						pixels[5] = row[BYTE1_OFFSET + 4];
-						pixels[6] = 0xff;
-						pixels[7] = 0xff;
-						if (pixels[0] == sample[0] &&
-							pixels[1] == sample[1] &&
-							pixels[2] == sample[2] &&
-							pixels[3] == sample[3] &&
-							pixels[4] == sample[4] &&
-							pixels[5] == sample[5]) {
-							pixels[6] = 0x00;
-							pixels[7] = 0x00;
-						}
-						pixels += 8;
-						row += 6;
-					}
-				}
-			}
-			return;
+		if (p->hidden.error || p->hidden.state == PNGR_BADSTATE) {
+			break;
+		}
+		if (i + 1 < n && p->mbgn > PRVT->bandbgn[i + 1]) {
+			break;
 		}
 	}
 
-#if CTB_IS_LITTLEENDIAN
-	if (pngr->depth == 16) {
-		uintxx total;
-
-		total = pngr->sizex * (PRVT->pelsize >> 1);
-		for (i = 0; i < total; i++) {
-			*pixels++ = row[1];
-			*pixels++ = row[0];
-			row += 2;
-		}
-		return;
+	for (j = 0; j + 1 < n; j++) {
+		copy = (void*) bands.bands[j].pngr;
+		inflator_destroy(copy->inflator);
 	}
-#endif
+	dispose_(PRVT, memory, (n - 1) * bsize);
 
-	ctb_memcpy(pixels, row, PRVT->rowsize);
+	if (i != n) {
+		SETERROR(0);
+		SETSTATE(3);
+		rewindimage(pngr);
+		return 0;
+	}
+	return total;
 }
 
 uintxx
 pngr_decodeimg(TPNGReader* pngr)
 {
 	uintxx i;
-	uintxx j;
+	uintxx last;
 	uint8* pixels;
-	uint8* idxs;
 	CTB_ASSERT(pngr);
 
 	if (pngr->state ^ 3) {
@@ -2414,9 +3847,42 @@ pngr_decodeimg(TPNGReader* pngr)
 		return 0;
 	}
 
-	pixels = PRVT->pixels;
-	idxs   = PRVT->idxs;
-	for (i = 0; i < pngr->sizey; i++) {
+	if (PRVT->nextrow) {
+		/* the rows are being decoded with pngr_decoderows */
+		SETSTATE(PNGR_BADSTATE);
+		if (pngr->error == 0) {
+			SETERROR(PNGR_EINCORRECTUSE);
+		}
+		return 0;
+	}
+
+	/* the rows above the crop window are only unfiltered */
+	last = PRVT->cropy + PRVT->cropsizey;
+
+	i = 0;
+	if (PRVT->inplace) {
+		pixels = decodeinplace(PBLC);
+		if (CTB_UNLIKELY(pixels == NULL)) {
+			SETSTATE(PNGR_BADSTATE);
+			return 0;
+		}
+		i = pngr->sizey - 1;
+	}
+	else {
+		if (canusebands(PBLC)) {
+			i = decodebands(PBLC, last);
+		}
+		else {
+			if (PRVT->nslots) {
+				i = decodepipelined(PBLC, last);
+			}
+		}
+		if (pngr->state == PNGR_BADSTATE) {
+			return 0;
+		}
+	}
+
+	for (; i < last; i++) {
 		uint8* row;
 
 		row = decoderow(PBLC, pngr->sizex, PRVT->rawrowsize);
@@ -2424,45 +3890,23 @@ pngr_decodeimg(TPNGReader* pngr)
 			SETSTATE(PNGR_BADSTATE);
 			return 0;
 		}
-
-		if (CTB_LIKELY(pixels != NULL)) {
-			if (CTB_UNLIKELY(pngr->colortype == 3)) {
-				uintxx entry;
-
-				/* we don't check the range here */
-				if (PRVT->hasalpha) {
-					for (j = 0; j < pngr->sizex; j++) {
-						entry = row[j] * 4;
-
-						*pixels++ = pngr->palette[entry + 0];
-						*pixels++ = pngr->palette[entry + 1];
-						*pixels++ = pngr->palette[entry + 2];
-						*pixels++ = pngr->palette[entry + 3];
-					}
-				}
-				else {
-					for (j = 0; j < pngr->sizex; j++) {
-						entry = row[j] * 4;
-						*pixels++ = pngr->palette[entry + 0];
-						*pixels++ = pngr->palette[entry + 1];
-						*pixels++ = pngr->palette[entry + 2];
-					}
-				}
-			}
-			else {
-				setrow(PBLC, pixels, row);
-				pixels += PRVT->rowsize;
-			}
+		if (i < PRVT->cropy) {
+			continue;
 		}
 
-		if (CTB_LIKELY(idxs != NULL)) {
-			for (j = 0; j < pngr->sizex; j++) {
-				idxs[j] = row[j];
-			}
-			idxs += pngr->sizex;
+		if (putrow(PBLC, row, i - PRVT->cropy) == 0) {
+			SETERROR(PNGR_EABORTED);
+			SETSTATE(PNGR_BADSTATE);
+			return 0;
 		}
 	}
 
+	/* the rest of the image data is not needed */
+	if (last != pngr->sizey) {
+		SETSTATE(4);
+		return 1;
+	}
+
 	if (checktail(PBLC) == 0)  {
 		SETSTATE(5);
 		return 1;
@@ -2475,6 +3919,75 @@ pngr_decodeimg(TPNGReader* pngr)
 	return 1;
 }
 
+uintxx
+pngr_decoderows(TPNGReader* pngr, uintxx first, uintxx count)
+{
+	uintxx i;
+	uintxx last;
+	CTB_ASSERT(pngr);
+
+	if (pngr->state ^ 3) {
+		if (pngr->state == 2) {
+			PBLC->state++;
+		}
+		else {
+			SETSTATE(PNGR_BADSTATE);
+			if (pngr->error == 0) {
+				SETERROR(PNGR_EINCORRECTUSE);
+			}
+			return 0;
+		}
+	}
+
+	if (PRVT->outputfn == NULL || count == 0) {
+		goto L_ERROR;
+	}
+	if (first >= PRVT->cropsizey || count > PRVT->cropsizey - first) {
+		goto L_ERROR;
+	}
+
+	/* the rows before the current one can only be decoded again from the
+	 * start of the image data */
+	first += PRVT->cropy;
+	if (first < PRVT->nextrow) {
+		if (PRVT->idatbgn == NULL) {
+			goto L_ERROR;
+		}
+		rewindimage(PBLC);
+	}
+
+	last = first + count;
+	for (i = PRVT->nextrow; i < last; i++) {
+		uint8* row;
+
+		row = decoderow(PBLC, pngr->sizex, PRVT->rawrowsize);
+		if (CTB_UNLIKELY(row == NULL)) {
+			SETSTATE(PNGR_BADSTATE);
+			return 0;
+		}
+		PRVT->nextrow = i + 1;
+		if (i < first) {
+			continue;
+		}
+
+		if (emitrow(PBLC, row, i - PRVT->cropy) == 0) {
+			SETSTATE(PNGR_BADSTATE);
+			if (pngr->error == 0) {
+				SETERROR(PNGR_EABORTED);
+			}
+			return 0;
+		}
+	}
+	return 1;
+
+L_ERROR:
+	SETSTATE(PNGR_BADSTATE);
+	if (pngr->error == 0) {
+		SETERROR(PNGR_EINCORRECTUSE);
+	}
+	return 0;
+}
+
 
 CTB_INLINE uint8*
 getsample(struct TPNGRPblc* pngr, uint8* source, uint8* pixel)
@@ -2759,6 +4272,8 @@ L_DONE:
 #undef ORIGIN_Y
 
 
+#undef ISMEMSOURCE
+
 #undef SETERROR
 #undef SETSTATE
 #undef PBLC